@@ -0,0 +1,432 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Delivery of messages to a maildir folder, the tmp -> new way. Messages are
+ * written to O_TMPFILEs in tmp/ (or to named files where those aren't
+ * supported), and a commit links them all into new/. The fsyncs are grouped
+ * per commit: the data of all the files first, then new/ once, so a batch
+ * costs about as much as a single message. Nothing is in new/ before its
+ * data is on disk, and everything is in new/ once the commit returns, which
+ * is all Maildir promises.
+ *
+ * The file size is known by the time the message is linked, so it goes to
+ * the name as the S= field and readers needn't stat the file. The sizes of
+ * a commit also go to the maildirsize file, as one line for the batch.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "deliver.h"
+#include "quota.h"
+
+static int deliver_link(struct maildir_deliver *d,
+	struct maildir_delivery *m);
+static void delivery_free(struct maildir_delivery *m);
+
+/** Start delivering to a folder.
+ * \param path Path of the folder, NULL to use mdf's.
+ * \param mdf The folder, if it's open. Its stats and messages are updated
+ *   by the commits, and our deliveries don't make it dirty. May be NULL.
+ * \param flags Mask of enum maildir_deliver_flags.
+ * \return 0 - ok, -1 - error.
+ */
+int maildir_deliver_open(struct maildir_deliver *d, const char *path,
+	struct maildir_folder *mdf, int flags)
+{
+    char path2[PATH_MAX];
+
+    memset(d, 0, sizeof(*d));
+    if (!path)
+	path = mdf->path;
+    if (strlen(path) + 5 >= PATH_MAX) {
+	fprintf(stderr, "Overlong path: %s/new\n", path);
+	return -1;
+    }
+    strcpy(d->path, path);
+    d->mdf = mdf;
+    d->flags = flags;
+    d->pid = getpid();
+
+    /* A folder of a maildir++ has the maildirfolder file, the root doesn't
+     * (see #maildirpp_folder_create). */
+    if (mdf)
+	strcpy(d->root, mdf->md->path);
+    else {
+	strcpy(path2, path);
+	strcat(path2, "/maildirfolder");
+	strcpy(d->root, path);
+	char *slash = d->root + strlen(d->root);
+	while (slash > d->root + 1 && slash[-1] == '/')
+	    *--slash = 0;
+	if (!access(path2, F_OK) && (slash = strrchr(d->root, '/')))
+	    *(slash == d->root ? slash + 1 : slash) = 0;
+    }
+
+    strcpy(path2, path);
+    strcat(path2, "/tmp");
+    d->tmp_fd = open(path2, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->tmp_fd == -1) {
+	perror(path2); goto err1;
+    }
+
+    strcpy(path2, path);
+    strcat(path2, "/new");
+    d->new_fd = open(path2, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->new_fd == -1) {
+	perror(path2); goto err2;
+    }
+
+    /* The hostname goes to the names, escape what would break them. */
+    char host[sizeof(d->host) / 4];
+    if (gethostname(host, sizeof(host)))
+	strcpy(host, "localhost");
+    host[sizeof(host) - 1] = 0;
+    char *p = d->host;
+    for (char *h = host; *h; h++)
+	if (*h == '/')
+	    p = stpcpy(p, "\\057");
+	else if (*h == ':')
+	    p = stpcpy(p, "\\072");
+	else
+	    *p++ = *h;
+    *p = 0;
+
+    d->pending = g_array_new(0, 0, sizeof(struct maildir_delivery));
+
+    return 0;
+
+err2:
+    close(d->tmp_fd);
+err1:
+    return -1;
+}
+
+/** Commit the pending messages and stop delivering.
+ * \return Result of the commit.
+ */
+int maildir_deliver_close(struct maildir_deliver *d)
+{
+    if (d->writing)
+	maildir_deliver_abort(d);
+    int ret = maildir_deliver_commit(d);
+
+    g_array_free(d->pending, 1);
+    close(d->new_fd);
+    close(d->tmp_fd);
+
+    return ret;
+}
+
+/** Start writing a message.
+ * \param when Its delivery time, for the name, 0 for now. Messages which
+ *   come from elsewhere (e.g. an mbox) keep theirs this way.
+ * \return 0 - ok, -1 - error.
+ */
+int maildir_deliver_begin(struct maildir_deliver *d, time_t when)
+{
+    struct maildir_delivery *m = &d->cur;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    if (when > 0)
+	tv.tv_sec = when;
+    memset(m, 0, sizeof(*m));
+    m->name = g_strdup_printf("%ld.M%ldP%ldQ%lu.%s", (long) tv.tv_sec,
+	    (long) tv.tv_usec, (long) d->pid, ++d->seq, d->host);
+
+    if (!d->no_tmpfile) {
+	m->fd = openat(d->tmp_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (m->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR ||
+		    errno == EINVAL))
+	    d->no_tmpfile = 1;
+    }
+    if (d->no_tmpfile) {
+	m->tmp_name = g_strdup(m->name);
+	m->fd = openat(d->tmp_fd, m->tmp_name,
+		O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+    }
+
+    if (m->fd == -1) {
+	perror("open(tmp)");
+	g_free(m->tmp_name);
+	g_free(m->name);
+	return -1;
+    }
+
+    d->writing = 1;
+    return 0;
+}
+
+/** Write a piece of the message being delivered.
+ * \return 0 - ok, -1 - error (the message is aborted).
+ */
+int maildir_deliver_write(struct maildir_deliver *d, const void *buf,
+	size_t len)
+{
+    struct maildir_delivery *m = &d->cur;
+    const char *p = buf;
+
+    while (len > 0) {
+	ssize_t r = write(m->fd, p, len);
+	if (r == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror("write(tmp)");
+	    maildir_deliver_abort(d);
+	    return -1;
+	}
+	p += r;
+	len -= r;
+	m->size += r;
+    }
+
+    return 0;
+}
+
+/** Finish writing the message. It is delivered by the next commit.
+ * \return 0 - ok, -1 - error.
+ */
+int maildir_deliver_end(struct maildir_deliver *d)
+{
+    struct maildir_delivery *m = &d->cur;
+
+    char *name = g_strdup_printf("%s,S=%lld", m->name, (long long) m->size);
+    g_free(m->name);
+    m->name = name;
+
+    /* Have the data written out while we write the other messages, so the
+     * commit doesn't wait for all of it. */
+    if (!(d->flags & MDD_NO_SYNC))
+	sync_file_range(m->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+    g_array_append_val(d->pending, *m);
+    d->writing = 0;
+
+    return 0;
+}
+
+/** Throw away the message being written. */
+void maildir_deliver_abort(struct maildir_deliver *d)
+{
+    struct maildir_delivery *m = &d->cur;
+
+    if (!d->writing)
+	return;
+
+    if (m->tmp_name)
+	unlinkat(d->tmp_fd, m->tmp_name, 0);
+    delivery_free(m);
+    d->writing = 0;
+}
+
+/** Throw away the messages written but not committed yet (and the one
+ * being written), e.g. when the caller can't tell which of them would be
+ * delivered twice. */
+void maildir_deliver_abort_pending(struct maildir_deliver *d)
+{
+    maildir_deliver_abort(d);
+
+    for (int i = 0; i < d->pending->len; i++) {
+	struct maildir_delivery *m =
+	    &g_array_index(d->pending, struct maildir_delivery, i);
+	if (m->tmp_name)
+	    unlinkat(d->tmp_fd, m->tmp_name, 0);
+	delivery_free(m);
+    }
+    g_array_set_size(d->pending, 0);
+}
+
+/** Deliver the contents of a file (or the rest of a pipe). Files are copied
+ * with copy_file_range, so the data don't go through us.
+ * \return 0 - ok, -1 - error.
+ */
+int maildir_deliver_fd(struct maildir_deliver *d, int fd)
+{
+    char buf[65536];
+    int copy = 1;
+
+    if (maildir_deliver_begin(d, 0))
+	return -1;
+
+    while (1) {
+	ssize_t r;
+
+	if (copy) {
+	    r = copy_file_range(fd, NULL, d->cur.fd, NULL, 1 << 30, 0);
+	    if (r == -1 && (errno == EINVAL || errno == EXDEV ||
+			errno == ENOSYS || errno == EOPNOTSUPP)) {
+		/* Not a file, or no support, copy it ourselves. */
+		copy = 0;
+		continue;
+	    }
+	    if (r > 0)
+		d->cur.size += r;
+	} else {
+	    r = read(fd, buf, sizeof(buf));
+	    if (r > 0 && maildir_deliver_write(d, buf, r))
+		return -1;
+	}
+
+	if (r == 0)
+	    break;
+	if (r == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror("read");
+	    maildir_deliver_abort(d);
+	    return -1;
+	}
+    }
+
+    return maildir_deliver_end(d);
+}
+
+/** Copy a range of a file to the message being delivered, with
+ * copy_file_range if possible.
+ * \return 0 - ok, -1 - error (the message is aborted).
+ */
+int maildir_deliver_range(struct maildir_deliver *d, int fd, off_t off,
+	size_t len)
+{
+    char buf[65536];
+    int copy = 1;
+
+    while (len > 0) {
+	ssize_t r;
+
+	if (copy) {
+	    r = copy_file_range(fd, &off, d->cur.fd, NULL, len, 0);
+	    if (r == -1 && (errno == EINVAL || errno == EXDEV ||
+			errno == ENOSYS || errno == EOPNOTSUPP)) {
+		copy = 0;
+		continue;
+	    }
+	    if (r > 0)
+		d->cur.size += r;
+	} else {
+	    r = pread(fd, buf, MIN(len, sizeof(buf)), off);
+	    if (r > 0) {
+		if (maildir_deliver_write(d, buf, r))
+		    return -1;
+		off += r;
+	    }
+	}
+
+	if (r == 0) {
+	    fprintf(stderr, "Unexpected end of file\n");
+	    maildir_deliver_abort(d);
+	    return -1;
+	}
+	if (r == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror("read");
+	    maildir_deliver_abort(d);
+	    return -1;
+	}
+	len -= r;
+    }
+
+    return 0;
+}
+
+/** Move a written message to new/. */
+static int deliver_link(struct maildir_deliver *d,
+	struct maildir_delivery *m)
+{
+    if (m->tmp_name)
+	return renameat(d->tmp_fd, m->tmp_name, d->new_fd, m->name);
+
+    /* Linking an O_TMPFILE by the fd itself (AT_EMPTY_PATH) needs
+     * CAP_DAC_READ_SEARCH, through /proc it doesn't. */
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", m->fd);
+    if (!linkat(AT_FDCWD, proc, d->new_fd, m->name, AT_SYMLINK_FOLLOW))
+	return 0;
+    if (errno != ENOENT)
+	return -1;
+    return linkat(m->fd, "", d->new_fd, m->name, AT_EMPTY_PATH);
+}
+
+/** Deliver the pending messages: sync their data, link them into new/ and
+ * sync that. Messages which fail are thrown away.
+ * \return The number of messages delivered, -1 if some failed.
+ */
+int maildir_deliver_commit(struct maildir_deliver *d)
+{
+    int sync = !(d->flags & MDD_NO_SYNC);
+    int ret = 0, failed = 0;
+    long long size = 0;
+
+    if (d->pending->len == 0)
+	return 0;
+
+    for (int i = 0; i < d->pending->len; i++) {
+	struct maildir_delivery *m =
+	    &g_array_index(d->pending, struct maildir_delivery, i);
+	if (sync && fdatasync(m->fd)) {
+	    perror(m->name);
+	    m->size = -1;
+	}
+    }
+
+    for (int i = 0; i < d->pending->len; i++) {
+	struct maildir_delivery *m =
+	    &g_array_index(d->pending, struct maildir_delivery, i);
+	if (m->size < 0)
+	    continue;
+	if (d->mdf)
+	    maildir_folder_expect(d->mdf, m->name, SD_NEW);
+	if (deliver_link(d, m)) {
+	    perror(m->name);
+	    m->size = -1;
+	}
+    }
+
+    if (sync && fsync(d->new_fd)) {
+	perror(d->path);
+	failed = 1;
+    }
+
+    if (d->mdf)
+	maildir_folder_expect_end(d->mdf);
+
+    for (int i = 0; i < d->pending->len; i++) {
+	struct maildir_delivery *m =
+	    &g_array_index(d->pending, struct maildir_delivery, i);
+	if (m->size < 0) {
+	    if (m->tmp_name)
+		unlinkat(d->tmp_fd, m->tmp_name, 0);
+	    failed = 1;
+	} else {
+	    if (d->mdf)
+		maildir_folder_add_message(d->mdf, m->name);
+	    if (d->delivered)
+		g_array_append_val(d->delivered, i);
+	    size += m->size;
+	    ret++;
+	}
+	delivery_free(m);
+    }
+    g_array_set_size(d->pending, 0);
+
+    /* The messages are in, a failure here is not worth a redelivery. */
+    if (ret)
+	maildir_quota_add(d->root, size, ret);
+
+    return failed ? -1 : ret;
+}
+
+static void delivery_free(struct maildir_delivery *m)
+{
+    close(m->fd);
+    g_free(m->tmp_name);
+    g_free(m->name);
+}
@@ -0,0 +1,61 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#ifndef DELIVER_H
+#define DELIVER_H
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include "maildir.h"
+
+/** Default number of messages delivered by one commit. */
+#define MAILDIR_DELIVER_BATCH 64
+
+enum maildir_deliver_flags {
+    MDD_NO_SYNC	= 1 << 0 /**< Don't fsync anything. Faster, but the
+			  *   messages may be lost if the system crashes. */
+};
+
+/** A message written to tmp/ (or an O_TMPFILE), not yet in new/. */
+struct maildir_delivery {
+    int fd;
+    char *tmp_name; ///< Its name in tmp/, NULL if it's an O_TMPFILE.
+    char *name; ///< The name it gets in new/, with the S= field.
+    off_t size;
+};
+
+/** Delivery to a folder, see #maildir_deliver_open. */
+struct maildir_deliver {
+    char path[PATH_MAX]; ///< Of the folder.
+    char root[PATH_MAX]; ///< Of its maildir++, whose quota the commits update.
+    int tmp_fd, new_fd; ///< The tmp and new subdirs.
+    struct maildir_folder *mdf; ///< To be kept up to date, may be NULL.
+    int flags; ///< Mask of enum maildir_deliver_flags.
+    int no_tmpfile; ///< O_TMPFILE is not supported here.
+    char host[256]; ///< Hostname, with '/' and ':' escaped.
+    pid_t pid;
+    unsigned long seq; ///< Deliveries made by the process.
+    struct maildir_delivery cur; ///< The message being written.
+    int writing; ///< Is there a message being written?
+    GArray *pending; /**< List of struct maildir_delivery, written but
+		      *   not committed. */
+    GArray *delivered; /**< If set (by the caller), the commits add the
+			*   positions (int) in #pending of the messages
+			*   they delivered. */
+};
+
+int maildir_deliver_open(struct maildir_deliver *d, const char *path,
+	struct maildir_folder *mdf, int flags);
+int maildir_deliver_close(struct maildir_deliver *d);
+int maildir_deliver_begin(struct maildir_deliver *d, time_t when);
+int maildir_deliver_write(struct maildir_deliver *d, const void *buf,
+	size_t len);
+int maildir_deliver_end(struct maildir_deliver *d);
+void maildir_deliver_abort(struct maildir_deliver *d);
+void maildir_deliver_abort_pending(struct maildir_deliver *d);
+int maildir_deliver_fd(struct maildir_deliver *d, int fd);
+int maildir_deliver_range(struct maildir_deliver *d, int fd, off_t off,
+	size_t len);
+int maildir_deliver_commit(struct maildir_deliver *d);
+
+#endif /* DELIVER_H */
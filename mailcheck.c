@@ -9,29 +9,56 @@
 #include <signal.h>
 #include <ncurses.h>
 #include "maildir.h"
+#include "quota.h"
 
 /* Configuration vars. */
 static int dont_cur = 0;
 static int watch = 0;
+static int stats = 0;
+static int subtrees = 0;
+static int quota = 0;
+static long long budget = 0;
+static struct maildirpp_options opts;
 static int (*print)(const char *, ...) = printf;
 
 static volatile int signalled = 0;
 static int total = 0;
+static const char *root = NULL; ///< Maildir of the subtrees, if several.
+
+static const char *mails(int n)
+{
+    return (n == 1 ? "   novy mail" :
+	    (n < 5 ? "  nove maily" :
+	     "novych mailu"));
+}
 
 /* Print the number of new messages in the folder. */
 static void mailbox(struct maildir_folder *mdf)
 {
+    if (!mdf->stats)
+	return; /* Not walked yet. */
+
     int new = mdf->stats->new;
     if (new) {
-	print("Mas %4i %s v %s\n", new,
-		(new == 1 ? "   novy mail" :
-		 (new < 5 ? "  nove maily" :
-		  "novych mailu")),
-		mdf->path);
+	print("Mas %4i %s v %s\n", new, mails(new), mdf->path);
 	total += new;
     }
 }
 
+/* Print the number of new messages in subtrees of the folder hierarchy. */
+static void subtree(struct maildir_tree *node)
+{
+    if (node->children->len == 0)
+	return;
+
+    int new = node->total.new;
+    if (new && *node->name)
+	print("Mas %4i %s v %s%s%s.*\n", new, mails(new), root ? root : "",
+		root ? "/." : "", node->name);
+
+    g_ptr_array_foreach(node->children, (GFunc) subtree, 0);
+}
+
 static void sighandler(int sig)
 {
     signalled = 1;
@@ -39,16 +66,20 @@ static void sighandler(int sig)
 
 int main(int argc, char *argv[])
 {
-    char *maildir;
+    GPtrArray *maildirs = g_ptr_array_new_with_free_func(g_free);
 
     /* Parse cmdline options */
     while (1) {
 	char c;
 
-	if ((c = getopt(argc, argv, "nhw")) == -1)
+	if ((c = getopt(argc, argv, "b:f:nhqrtvw")) == -1)
 	    break;
 
 	switch (c) {
+	    case 'b':
+		budget = atoll(optarg) * 1000;
+		break;
+
 	    case 'n':
 		dont_cur = 1;
 		break;
@@ -57,11 +88,46 @@ int main(int argc, char *argv[])
 		watch = 1;
 		break;
 
+	    case 'q':
+		quota = 1;
+		break;
+
+	    case 'r':
+		opts.flags |= MDO_NESTED;
+		break;
+
+	    case 't':
+		subtrees = 1;
+		break;
+
+	    case 'f':
+		opts.flags |= MDO_LAZY_DIRS;
+		opts.fd_budget = atoi(optarg);
+		break;
+
+	    case 'v':
+		stats = 1;
+		opts.ctx = maildirpp_ctx_new();
+		maildirpp_ctx_set_verbose(opts.ctx, 1);
+		break;
+
 	    case 'h':
-		fprintf(stderr, "Usage: %s [options] [<maildir location>]\n",
+		fprintf(stderr, "Usage: %s [options] [<maildir location>...]"
+			"\n",
 			argv[0]);
 		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -b <ms> - with -w, spend at most <ms> "
+			"walking folders before updating the screen\n");
+		fprintf(stderr, " -f <n> - keep at most <n> folder dirs "
+			"open\n");
 		fprintf(stderr, " -n - walk only \"new\" subdir\n");
+		fprintf(stderr, " -q - update the maildirsize file and print "
+			"quota usage\n");
+		fprintf(stderr, " -r - look for nested folders in "
+			"subdirectories\n");
+		fprintf(stderr, " -t - print totals of folder subtrees\n");
+		fprintf(stderr, " -v - be verbose and print statistics at "
+			"exit\n");
 		fprintf(stderr, " -w - keep monitoring the maildir for "
 			"changes\n");
 		return 0;
@@ -74,20 +140,26 @@ int main(int argc, char *argv[])
 	}
     }
 
-    /* Maildir location specified? Use the default otherwise. */
-    if (optind < argc)
-	maildir = g_strdup(argv[optind]);
-    else {
+    /* Maildir locations specified? Use the default otherwise. */
+    for (int i = optind; i < argc; i++)
+	g_ptr_array_add(maildirs, g_strdup(argv[i]));
+    if (maildirs->len == 0) {
 	char *home = getenv("HOME");
 	if (!home) abort();
-	maildir = g_strconcat(home, "/Mail", NULL);
+	g_ptr_array_add(maildirs, g_strconcat(home, "/Mail", NULL));
     }
 
-    /* And the fun begins here. */
-    struct maildirpp md;
+    /* And the fun begins here. All the maildirs share one context, so one
+     * poll watches them all. */
+    int n = maildirs->len;
+    struct maildirpp *mds = g_new0(struct maildirpp, n);
 
-    if (maildirpp_open(&md, maildir) != 0)
-	abort();
+    if (!opts.ctx)
+	opts.ctx = maildirpp_ctx_new();
+    for (int i = 0; i < n; i++)
+	if (maildirpp_open_opts(&mds[i], g_ptr_array_index(maildirs, i),
+		    &opts) != 0)
+	    abort();
 
     /* Init curses/signal, if watch. */
     if (watch) {
@@ -108,27 +180,48 @@ int main(int argc, char *argv[])
 	    print("\tLast change: %s\n", ctime(&t));
 	}
 
-	/* If the list of subfolders changes, refresh it. */
-	if (maildirpp_dirty(&md, 0))
-	    maildirpp_refresh_subfolders_list(&md);
-
-	/* Print counts of new messages. */
-	/* This reloads only changed folders: */
-	maildirpp_folders_fill(&md, MFD_STATS,
-		SD_NEW | (dont_cur ? 0 : SD_CUR));
 	total = 0;
-	g_ptr_array_foreach(md.subfolders, (GFunc) mailbox, 0);
+	for (int i = 0; i < n; i++) {
+	    struct maildirpp *md = &mds[i];
+
+	    /* If the list of subfolders changes, refresh it. */
+	    if (maildirpp_dirty(md, 0))
+		maildirpp_refresh_subfolders_list(md);
+
+	    /* Print counts of new messages. */
+	    /* This reloads only changed folders: */
+	    maildirpp_folders_fill_budget(md, quota ? MFD_SIZES : MFD_STATS,
+		    SD_NEW | (dont_cur ? 0 : SD_CUR),
+		    watch && budget ? MAX(budget / n, 1) : 0);
+	    g_ptr_array_foreach(md->subfolders, (GFunc) mailbox, 0);
+	}
+
+	/* The totals go after all the folders, not between the maildirs. */
+	for (int i = 0; subtrees && i < n; i++)
+	    if (mds[i].tree->total.new) {
+		root = n > 1 ? mds[i].path : NULL;
+		subtree(mds[i].tree);
+	    }
+
+	for (int i = 0; quota && i < n; i++) {
+	    struct maildirpp *md = &mds[i];
+	    struct maildir_quota q;
+
+	    /* Until all the folders are walked, show the recorded usage. */
+	    if (maildirpp_quota_update(md) != -1 &&
+		    maildirpp_quota_read(md, &q) == 0)
+		print("Kvota%s%s: %lld/%lld B, %lld/%lld zprav\n",
+			n > 1 ? " " : "", n > 1 ? md->path : "", q.size,
+			q.size_limit, q.count, q.count_limit);
+	}
 	if (total) {
 	    print(" --\n");
-	    print("Mas celkem %i %s.\n", total,
-		    (total == 1 ? "   novy mail" :
-		     (total < 5 ? "  nove maily" :
-		      "novych mailu")));
+	    print("Mas celkem %i %s.\n", total, mails(total));
 	}
 
 	if (watch) {
 	    refresh();
-	    maildirpp_pause_if_not_dirty(&md);
+	    maildirpp_ctx_wait(opts.ctx, -1);
 	}
     } while (watch && !signalled);
 
@@ -136,9 +229,15 @@ int main(int argc, char *argv[])
 	endwin();
     }
 
-    maildirpp_close(&md);
+    for (int i = 0; i < n; i++) {
+	if (stats)
+	    maildirpp_counters_print(&mds[i], stderr);
+	maildirpp_close(&mds[i]);
+    }
+    maildirpp_ctx_free(opts.ctx);
 
-    g_free(maildir);
+    g_free(mds);
+    g_ptr_array_free(maildirs, 1);
 
     return 0;
 }
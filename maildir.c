@@ -6,152 +6,534 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include "maildir.h"
+#include "msgid.h"
+#include "probes.h"
+#include "quota.h"
 #include "rfc822.h"
 #include "util.h"
 
-#define DNOTIFY_SIGNAL (SIGRTMIN + 1)
-
-static int verbose = 0;
-#define VERBOSE(x) do { if (verbose) { x; } } while (0)
-
-/** A set of dirty directories. */
-static volatile fd_set dirty_fds;
-static int sig_inited = 0;
+/** Events watched in the maildir++ itself and in wannabe folders. */
+#define WATCH_DIR_EVENTS (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+	IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+/** Events watched in the new and cur subdirs of folders. */
+#define WATCH_MSGS_EVENTS (WATCH_DIR_EVENTS|IN_MODIFY)
+
+/** Memory taken by a message in the trees and indexes besides the struct and
+ * the strings, for #message_bytes. */
+#define MESSAGE_NODE_BYTES (8 * sizeof(void *))
+
+#define VERBOSE(md, x) do { if ((md)->ctx->verbose) { x; } } while (0)
+
+/** The context of maildirs opened without one. */
+static struct maildirpp_ctx default_ctx = { .notify_fd = -1 };
+
+/** Someone interested in changes of a watched directory. */
+struct watch_target {
+    struct maildirpp *md; ///< For the counters.
+    int *dirty; ///< Where to set #mask when the directory changes.
+    int mask;
+    GHashTable **expected; /**< Changes to ignore, see
+			    *   maildir_folder.expected. May be NULL. */
+    int dirs_only; /**< Only changes of subdirectories count, see
+		    *   #watch_add_dirs. */
+};
+
+/** An inotify watch. A directory may be watched on behalf of more maildirs
+ * (or twice by one of them, via a symlink), inotify gives us the same watch
+ * descriptor for all of them. */
+struct watch {
+    int wd;
+    GArray *targets; ///< List of struct watch_target.
+};
+
+/** A message to be changed by a bulk operation, #maildir_folder_set_flags
+ * or #maildir_folder_expunge. */
+struct bulk_msg {
+    int subdir; ///< SD_NEW or SD_CUR.
+    char *name, *new_name; ///< new_name is NULL unless renamed.
+    int done; ///< Has the change been made?
+    long long size; ///< Of an expunged message, for the quota.
+};
+
+/** What #maildir_folder_expunge removes. */
+struct expunge_match {
+    int flags; ///< Mask of MF_* flags the messages must have.
+    time_t before; ///< Delivered before this, 0 for any time.
+};
+
+/** Unlinks done by one thread of #maildir_folder_expunge. */
+struct expunge_batch {
+    int dir_fds[2]; ///< Of new and cur.
+    struct bulk_msg *msgs;
+    int len;
+};
+
+/** What #maildir_folder_archive moves. */
+struct archive_match {
+    time_t before; ///< Delivered before this, 0 for any time.
+    int date_header; ///< Select messages of unknown time, for MA_DATE_HEADER.
+};
+
+/** State of #maildir_folder_archive, moving the partitions. */
+struct archive_state {
+    struct maildir_folder *mdf;
+    int data; ///< Given to the created folders.
+    struct maildir_folder_stats delta; ///< Of #mdf.
+    int ret; ///< Messages moved so far, -1 on error.
+};
+
+/** Selects messages for bulk operations, by the flags and delivery time
+ * parsed from the name. */
+typedef int (*bulk_match_func)(int flags, time_t delivered, void *data);
+
+/** A batch of messages with the storage for their names. */
+struct walk_batch {
+    struct maildir_folder_walk_batch b;
+    char names[MAILDIR_WALK_BATCH][NAME_MAX + 1];
+};
 
 
 /* Forward decls */
-static void sig_handler(int sig, siginfo_t *si, void *data);
-static void sig_init(void);
-static void sig_block(int block);
-static void sig_wait(int (*f) (void *), void *param);
-enum { SFI_ISSET = 0, SFI_CLEAR = 1, SFI_SET   = 2 };
-enum { SFI_DONTBLOCK = 0, SFI_BLOCK = 1 };
-static int sig_fd_isset(int fd, int clear, int sig);
-static int dnotify(int fd, int flags);
-static int maildirpp_load_subfolders_list(struct maildirpp *md);
+static int notify_init(struct maildirpp_ctx *ctx);
+static int watch_add(struct maildirpp *md, const char *path, uint32_t events,
+	int *dirty, int mask, GHashTable **expected);
+static void watch_remove(struct maildirpp_ctx *ctx, int wd, int *dirty);
+static int watch_add_dirs(struct maildirpp *md, const char *path);
+static void watch_set_dirty(struct watch *w,
+	const struct inotify_event *ev);
+static void notify_process(struct maildirpp_ctx *ctx,
+	const struct inotify_event *ev);
+static void notify_read(struct maildirpp_ctx *ctx);
+static int maildirpp_load_subfolders_list(struct maildirpp *md,
+	GHashTable *old);
+static int maildirpp_scan_dir(struct maildirpp *md, char *path2,
+	size_t path2_len, int depth, GHashTable *old);
+static struct maildir_tree *maildir_tree_new(struct maildir_tree *parent,
+	const char *name, size_t name_len);
+static void maildir_tree_insert(struct maildir_tree *root,
+	struct maildir_folder *mdf);
+static void maildir_tree_free(struct maildir_tree *node);
+static void maildir_tree_update(struct maildir_tree *node,
+	const struct maildir_folder_stats *stats, int sign);
+static int maildir_tree_compare(struct maildir_tree **a,
+	struct maildir_tree **b);
 static int maildirpp_compare_folder(struct maildir_folder **a,
 	struct maildir_folder **b);
+static int maildirpp_compare_folder_sched(struct maildir_folder **a,
+	struct maildir_folder **b);
 static void maildirpp_free_subfolders_list(struct maildirpp *md);
+static int maildir_folder_watched(struct maildir_folder *mdf);
 static int maildir_folder_open(struct maildir_folder *mdf, const char *path);
 static void maildir_folder_close(struct maildir_folder *mdf);
 static void maildir_folder_close_and_free(struct maildir_folder *mdf);
+static DIR *maildir_folder_dir(struct maildir_folder *mdf, int subdir);
+static void maildir_folder_close_dirs(struct maildir_folder *mdf);
+static void maildirpp_trim_dirs(struct maildirpp *md);
 static int maildirpp_dirty2(struct maildirpp *md);
+static void maildir_folder_walk_batch(struct walk_batch *batch,
+	GArray *msgs_funcs, GArray *batch_funcs,
+	char *path2, size_t path2_len);
 static void maildir_folder_walk_messages(struct maildir_folder *mdf,
-	GArray *funcs, int walk_subdirs);
+	struct walk_batch *batch, GArray *msgs_funcs, GArray *batch_funcs,
+	int walk_subdirs);
 static void maildir_folder_stats_clear(struct maildir_folder *mdf);
-static void maildir_folder_stats_message(
-	struct maildir_folder_walk_messages_params *params);
-static int message_parse_flags(const char *name);
-static int message_open(struct message *msg);
+static void maildir_folder_stats_post(struct maildir_folder *mdf);
+static void maildir_folder_stats_flush(struct maildir_folder *mdf);
+static void maildir_folder_stats_flags(struct maildir_folder_stats *stats,
+	int flags, int n);
+static void maildir_folder_stats_batch(
+	const struct maildir_folder_walk_batch *batch);
+static void maildir_folder_sizes_prepare(struct maildir_folder *mdf);
+static void maildir_folder_sizes_post(struct maildir_folder *mdf);
+static int message_parse_flags(const char *name, size_t len);
+static int message_parse_size(const char *name, long long *size,
+	long long *vsize);
+static time_t message_parse_time(const char *name);
+static void maildir_folder_stats_time(struct maildir_folder_stats *stats,
+	time_t t, int new);
+static void maildir_folder_stats_untime(struct maildir_folder_stats *stats,
+	time_t t);
+static int message_open(struct maildirpp *md, struct message *msg, int fd);
+static int message_read_fd(struct maildirpp *md, struct message *msg,
+	int fd);
+static int message_compare_ino(struct message **a, struct message **b);
+static void messages_read_sorted(struct maildirpp *md, GPtrArray *msgs);
 static void message_free(struct message *msg);
+static time_t message_sort_date(const struct message *msg);
+static const char *subject_base(const char *s);
+static const char *message_thread(const struct message *msg);
+static int view_compare_date(const struct message *a,
+	const struct message *b, struct maildirpp *md);
+static int view_compare_from(const struct message *a,
+	const struct message *b, struct maildirpp *md);
+static int view_compare_subject(const struct message *a,
+	const struct message *b, struct maildirpp *md);
+static int view_compare_thread(const struct message *a,
+	const struct message *b, struct maildirpp *md);
+static void maildir_folder_views_add(struct maildir_folder *mdf,
+	struct message *msg);
+static gboolean message_to_views(char *key, struct message *value,
+	struct maildir_folder *mdf);
+static void maildir_folder_index(struct maildir_folder *mdf,
+	struct message *msg);
+static void maildir_folder_unindex(struct maildir_folder *mdf,
+	struct message *msg);
 static void message_free_and_free(struct message *msg);
+static long long message_bytes(const struct message *msg);
+static gboolean message_add_bytes(char *key, struct message *value,
+	long long *bytes);
+static void maildir_folder_account(struct maildir_folder *mdf,
+	long long delta);
+static void maildir_folder_touch(struct maildir_folder *mdf);
+static void maildir_folder_messages_free(struct maildir_folder *mdf);
+static void maildir_folder_evict(struct maildir_folder *mdf);
+static void maildir_folder_reload(struct maildir_folder *mdf);
+static void maildirpp_trim_msgs(struct maildirpp *md,
+	struct maildir_folder *keep);
 static void maildir_folder_messages_prepare(struct maildir_folder *mdf);
 static void maildir_folder_messages_post(struct maildir_folder *mdf);
 static void maildir_folder_messages_msg(
 	struct maildir_folder_walk_messages_params *params);
+static void maildir_folder_messages_match(struct maildir_folder *mdf);
+static guint message_unique_hash(const char *name);
+static gboolean message_unindex(char *key, struct message *value,
+	struct maildir_folder *mdf);
+static gboolean message_to_hash(char *key, struct message *value,
+	GHashTable *hash);
+static gboolean message_to_array(char *key, struct message *value,
+	GPtrArray *array);
+static gboolean message_to_names(char *key, struct message *value,
+	GHashTable *names);
+static gboolean message_unique_equal(const char *a, const char *b);
+static void maildir_folder_changes_prepare(struct maildir_folder *mdf);
+static void maildir_folder_changes_clear(struct maildir_folder *mdf);
+static void maildir_folder_changes_add(struct maildir_folder *mdf, int type,
+	struct message *msg, struct message *old);
+static struct message *message_from_name(struct maildir_folder *mdf,
+	const char *name, int subdir);
+static void maildir_folder_changes_evicted(struct maildir_folder *mdf);
+static char *message_flags_name(const char *name, int set, int clear);
+static int maildir_folder_select(struct maildir_folder *mdf,
+	bulk_match_func match, void *data, GArray *todo);
+static int maildir_folder_select_names(struct maildir_folder *mdf,
+	const char *const *names, int n_names, GArray *todo);
+static void bulk_msgs_free(GArray *todo);
+static int match_unread(int flags, time_t delivered, void *data);
+static int match_all(int flags, time_t delivered, void *data);
+static void maildir_folder_flags_renamed(struct maildir_folder *mdf,
+	const struct bulk_msg *r, struct maildir_folder_stats *delta);
+static int match_expunge(int flags, time_t delivered, void *data);
+static void expunge_batch_run(struct expunge_batch *b, void *unused);
+static void maildir_folder_expunged(struct maildir_folder *mdf,
+	const struct bulk_msg *r, struct maildir_folder_stats *delta);
+static void expect_add(struct maildirpp_ctx *ctx, GHashTable **expected,
+	const char *name, int mask);
+static void expect_end(struct maildirpp_ctx *ctx, GHashTable **expected);
+static void maildir_folder_stats_msg(struct maildir_folder *mdf,
+	const char *name, struct maildir_folder_stats *delta, int sign);
+static int maildir_folder_put_message(struct maildir_folder *mdf,
+	const char *name, int subdir, struct message *msg);
+static struct message *maildir_folder_steal_message(
+	struct maildir_folder *mdf, const char *name);
+static int match_archive(int flags, time_t delivered, void *data);
+static time_t message_read_date(struct maildir_folder *mdf,
+	const struct bulk_msg *r);
+static int maildir_folder_move(struct maildir_folder *mdf,
+	struct maildir_folder *dst, GArray *todo,
+	struct maildir_folder_stats *delta);
+static gboolean archive_to(char *name, GArray *msgs,
+	struct archive_state *st);
+struct ctx_job;
+static void ctx_job_run(struct ctx_job *job, void *unused);
+static void ctx_run(struct maildirpp_ctx *ctx, int threads, GFunc func,
+	void *items, size_t size, int n);
+static long long now_usec(void);
+
+
+/** Initialize the inotify instance and the watches map of a context. */
+static int notify_init(struct maildirpp_ctx *ctx)
+{
+    if (ctx->notify_fd != -1)
+	return 0;
+
+    ctx->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ctx->notify_fd == -1) {
+	perror("inotify_init1"); return -1;
+    }
+
+    ctx->watches = g_hash_table_new(g_direct_hash, g_direct_equal);
 
+    return 0;
+}
 
-/** dnotify signal handler. */
-static void sig_handler(int sig, siginfo_t *si, void *data)
+/** Watch a directory. When it changes, <code>*dirty |= mask</code> is done.
+ * \return The watch descriptor, -1 on error (errno is set).
+ */
+static int watch_add(struct maildirpp *md, const char *path, uint32_t events,
+	int *dirty, int mask, GHashTable **expected)
 {
-    assert(si != NULL);
-    FD_SET(si->si_fd, &dirty_fds);
+    struct maildirpp_ctx *ctx = md->ctx;
+    int wd = inotify_add_watch(ctx->notify_fd, path, events | IN_MASK_ADD);
+    if (wd == -1)
+	return -1;
+
+    struct watch *w = g_hash_table_lookup(ctx->watches, GINT_TO_POINTER(wd));
+    if (!w) {
+	w = g_slice_new(struct watch);
+	w->wd = wd;
+	w->targets = g_array_new(0, 0, sizeof(struct watch_target));
+	g_hash_table_insert(ctx->watches, GINT_TO_POINTER(wd), w);
+    }
+
+    struct watch_target t = { .md = md, .dirty = dirty, .mask = mask,
+	.expected = expected };
+    g_array_append_val(w->targets, t);
+
+    return wd;
 }
 
-/** Initialize the signal handler and dirty_fds set. */
-static void sig_init(void)
+/** Watch a directory which may contain (or become) a folder, for changes
+ * of the list of subfolders. Only its subdirectories matter, so the files
+ * in it (dovecot-uidlist, maildirsize and the likes) are ignored.
+ * \return See #watch_add.
+ */
+static int watch_add_dirs(struct maildirpp *md, const char *path)
 {
-    struct sigaction act;
+    int wd = watch_add(md, path, WATCH_DIR_EVENTS, &md->dirty, 1, NULL);
+    if (wd == -1)
+	return -1;
 
-    if (sig_inited)
-	return;
-    sig_inited = 1;
+    struct watch *w = g_hash_table_lookup(md->ctx->watches,
+	    GINT_TO_POINTER(wd));
+    g_array_index(w->targets, struct watch_target,
+	    w->targets->len - 1).dirs_only = 1;
+
+    return wd;
+}
+
+/** Stop watching a directory on behalf of the given dirty flag. */
+static void watch_remove(struct maildirpp_ctx *ctx, int wd, int *dirty)
+{
+    struct watch *w = g_hash_table_lookup(ctx->watches, GINT_TO_POINTER(wd));
+    assert(w != NULL);
 
-    FD_ZERO(&dirty_fds);
+    for (int i = 0; i < w->targets->len; i++)
+	if (g_array_index(w->targets, struct watch_target, i).dirty == dirty) {
+	    g_array_remove_index_fast(w->targets, i);
+	    break;
+	}
 
-    act.sa_sigaction = sig_handler;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = SA_SIGINFO | SA_RESTART;
-    sigaction(DNOTIFY_SIGNAL, &act, NULL);
+    if (w->targets->len == 0) {
+	/* Fails if the dir is gone already, never mind. */
+	inotify_rm_watch(ctx->notify_fd, wd);
+	g_hash_table_remove(ctx->watches, GINT_TO_POINTER(wd));
+	g_array_free(w->targets, 1);
+	g_slice_free(struct watch, w);
+    }
+}
 
-    act.sa_handler = SIG_IGN;
-    act.sa_flags = SA_RESTART;
-    sigaction(SIGIO, &act, NULL);
+/** Mark everyone interested in a watch dirty, except those who expect the
+ * change of the entry or don't care about it.
+ * \param ev The event, NULL if unknown (events were lost).
+ */
+static void watch_set_dirty(struct watch *w, const struct inotify_event *ev)
+{
+    const char *name = ev && ev->len ? ev->name : NULL;
 
-    sig_block(0);
+    for (int i = 0; i < w->targets->len; i++) {
+	struct watch_target *t =
+	    &g_array_index(w->targets, struct watch_target, i);
+	if (name && t->dirs_only && !(ev->mask & IN_ISDIR))
+	    continue;
+	if (name && t->expected && *t->expected &&
+		(GPOINTER_TO_INT(g_hash_table_lookup(*t->expected, name)) &
+		 t->mask))
+	    continue;
+	*t->dirty |= t->mask;
+	t->md->counters.notifications++;
+    }
 }
 
-/** Block/unblock the dnotify signal. */
-static void sig_block(int block)
+/** Process one inotify event. */
+static void notify_process(struct maildirpp_ctx *ctx,
+	const struct inotify_event *ev)
 {
-    sigset_t mask;
+    PROBE2(notify, ev->wd, ev->mask);
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+	/* We lost some events, everything is dirty now. */
+	GHashTableIter iter;
+	struct watch *w;
+	g_hash_table_iter_init(&iter, ctx->watches);
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &w))
+	    watch_set_dirty(w, NULL);
+	return;
+    }
 
-    sigemptyset(&mask);
-    sigaddset(&mask, DNOTIFY_SIGNAL);
-    sigprocmask(block ? SIG_BLOCK : SIG_UNBLOCK, &mask, NULL);
+    struct watch *w = g_hash_table_lookup(ctx->watches,
+	    GINT_TO_POINTER(ev->wd));
+    if (w)
+	watch_set_dirty(w, ev);
 }
 
-/** Block the signal, run the function and if it returns 1, return, otherwise
- * unblock and pause. */
-static void sig_wait(int (*f) (void *), void *param)
+/** Read and process all pending inotify events of a context. */
+static void notify_read(struct maildirpp_ctx *ctx)
 {
-    sigset_t mask, old_mask;
+    char buf[16384]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    if (ctx->notify_fd == -1)
+	return;
+
+    while (1) {
+	ssize_t len = read(ctx->notify_fd, buf, sizeof(buf));
+	if (len == -1) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN)
+		perror("read(inotify)");
+	    return;
+	}
 
-    sigemptyset(&mask);
-    sigaddset(&mask, DNOTIFY_SIGNAL);
-    sigprocmask(SIG_BLOCK, &mask, &old_mask);
-    if (f(param) == 0)
-	sigsuspend(&old_mask);
-    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	for (char *p = buf; p < buf + len; ) {
+	    const struct inotify_event *ev = (const struct inotify_event *) p;
+	    notify_process(ctx, ev);
+	    p += sizeof(struct inotify_event) + ev->len;
+	}
+    }
 }
 
-/** Check and eventually clear/set a given fd in the dirty_fds set. 
- * \param clear 0 - nothing, 1 - clear, 2 - set
- * \param sig Block/unblock the signal while accessing? */
-static int sig_fd_isset(int fd, int clear, int sig)
+/** Create a library context. Maildirs are opened in it by
+ * maildirpp_options.ctx.
+ * \return The context, free it with #maildirpp_ctx_free.
+ */
+struct maildirpp_ctx *maildirpp_ctx_new(void)
 {
-    int ret;
+    struct maildirpp_ctx *ctx = g_new0(struct maildirpp_ctx, 1);
 
-    assert(fd >= 0);
+    ctx->notify_fd = -1;
+    ctx->maildirs = g_ptr_array_new();
 
-    if (sig) sig_block(1);
-    ret = FD_ISSET(fd, &dirty_fds);
-    if (clear == SFI_CLEAR) FD_CLR(fd, &dirty_fds);
-    if (clear == SFI_SET) FD_SET(fd, &dirty_fds);
-    if (sig) sig_block(0);
+    return ctx;
+}
 
-    return ret;
+/** Free a context, once its maildirs are closed. Waits for its worker
+ * threads. */
+void maildirpp_ctx_free(struct maildirpp_ctx *ctx)
+{
+    assert(ctx != &default_ctx);
+    assert(ctx->maildirs->len == 0);
+
+    if (ctx->pool)
+	g_thread_pool_free(ctx->pool, FALSE, TRUE);
+    if (ctx->notify_fd != -1) {
+	close(ctx->notify_fd);
+	g_hash_table_destroy(ctx->watches);
+    }
+    g_ptr_array_free(ctx->maildirs, 1);
+    g_free(ctx);
+}
+
+/** Get the context of maildirs opened without one. It can't be freed. */
+struct maildirpp_ctx *maildirpp_ctx_default(void)
+{
+    return &default_ctx;
 }
 
-/** Set up dnotify on a dir. */
-static int dnotify(int fd, int flags)
+/** Jobs run by the worker pool of a context, see #ctx_run. */
+struct ctx_jobs {
+    GFunc func;
+    GMutex lock;
+    GCond done;
+    int left; ///< Jobs not finished yet.
+};
+
+/** One of #ctx_jobs. */
+struct ctx_job {
+    struct ctx_jobs *jobs;
+    void *data;
+};
+
+/** Run a job, in a worker thread. */
+static void ctx_job_run(struct ctx_job *job, void *unused)
 {
-    /* Clear the dirty flag */
-    sig_fd_isset(fd, SFI_CLEAR, SFI_BLOCK);
+    struct ctx_jobs *jobs = job->jobs;
+
+    jobs->func(job->data, NULL);
+
+    g_mutex_lock(&jobs->lock);
+    if (--jobs->left == 0)
+	g_cond_signal(&jobs->done);
+    g_mutex_unlock(&jobs->lock);
+}
 
-    /* Set up dnotify */
-    if (fcntl(fd, F_SETSIG, DNOTIFY_SIGNAL) == -1) {
-	perror("fcntl(F_SETSIG)"); return -1;
+/** Call \a func for \a n items of \a size bytes by up to \a threads
+ * threads of the context's worker pool, and wait for them all. The pool is
+ * started on the first use and kept until the context is freed.
+ */
+static void ctx_run(struct maildirpp_ctx *ctx, int threads, GFunc func,
+	void *items, size_t size, int n)
+{
+    if (n == 1 || threads == 1) {
+	for (int i = 0; i < n; i++)
+	    func((char *) items + i * size, NULL);
+	return;
     }
 
-    if (fcntl(fd, F_NOTIFY, flags) == -1) {
-	perror("fcntl(F_NOTIFY)"); return -1;
+    threads = MIN(threads, n);
+    if (!ctx->pool)
+	ctx->pool = g_thread_pool_new((GFunc) ctx_job_run, NULL, threads,
+		FALSE, NULL);
+    else
+	g_thread_pool_set_max_threads(ctx->pool, threads, NULL);
+
+    struct ctx_jobs jobs = { .func = func, .left = n };
+    struct ctx_job *job = g_new(struct ctx_job, n);
+
+    g_mutex_init(&jobs.lock);
+    g_cond_init(&jobs.done);
+    for (int i = 0; i < n; i++) {
+	job[i].jobs = &jobs;
+	job[i].data = (char *) items + i * size;
+	g_thread_pool_push(ctx->pool, &job[i], NULL);
     }
 
-    return 0;
+    g_mutex_lock(&jobs.lock);
+    while (jobs.left > 0)
+	g_cond_wait(&jobs.done, &jobs.lock);
+    g_mutex_unlock(&jobs.lock);
+
+    g_cond_clear(&jobs.done);
+    g_mutex_clear(&jobs.lock);
+    g_free(job);
 }
 
-/** Open the given maildir++.
+/** Open the given maildir++ with the default options.
  * \return 0 - ok, -1 - error.
  */
 int maildirpp_open(struct maildirpp *md, const char *path)
+{
+    return maildirpp_open_opts(md, path, NULL);
+}
+
+/** Open the given maildir++.
+ * \param opts Options, NULL for the defaults.
+ * \return 0 - ok, -1 - error.
+ */
+int maildirpp_open_opts(struct maildirpp *md, const char *path,
+	const struct maildirpp_options *opts)
 {
     memset(md, 0, sizeof(struct maildirpp));
+    if (opts)
+	md->opts = *opts;
 
     /* Check the path len. (add 1 for /)
      * (just a stupid safety check, we need much more of course) */
@@ -160,34 +542,48 @@ int maildirpp_open(struct maildirpp *md, const char *path)
     }
     strcpy(md->path, path);
 
-    /* Init signal handler */
-    sig_init();
+    /* Evicted messages would drop out of the index, and lookups would miss
+     * them. */
+    if ((md->opts.flags & MDO_MSGID_INDEX) && md->opts.msgs_budget > 0) {
+	fprintf(stderr, "%s: MDO_MSGID_INDEX can't be used with a "
+		"msgs_budget\n", path);
+	goto err1;
+    }
+
+    /* Init inotify */
+    md->ctx = opts && opts->ctx ? opts->ctx : &default_ctx;
+    if (notify_init(md->ctx))
+	goto err1;
 
-    /* Open the dir */
-    md->dir = opendir(path);
-    if (!md->dir) {
+    /* Watch the dir */
+    md->wd = watch_add(md, path, WATCH_DIR_EVENTS, &md->dirty, 1,
+	    &md->expected);
+    if (md->wd == -1) {
 	perror(path); goto err1;
     }
 
-    /* Set up dnotify */
-    if (dnotify(dirfd(md->dir), DN_CREATE|DN_DELETE|DN_RENAME|DN_MULTISHOT))
-	goto err2;
-
-    if (maildirpp_load_subfolders_list(md))
+    if (maildirpp_load_subfolders_list(md, NULL))
 	goto err3;
 
+    if (!md->ctx->maildirs)
+	md->ctx->maildirs = g_ptr_array_new();
+    g_ptr_array_add(md->ctx->maildirs, md);
+
     return 0;
 
 err3:
     maildirpp_free_subfolders_list(md);
-err2:
-    closedir(md->dir);
+    watch_remove(md->ctx, md->wd, &md->dirty);
 err1:
     return -1;
 }
 
-/** Load the list of subfolders */
-static int maildirpp_load_subfolders_list(struct maildirpp *md)
+/** Load the list of subfolders.
+ * \param old Map of paths to folders to be reused rather than opened again,
+ *   NULL if none. Those found are stolen from it.
+ */
+static int maildirpp_load_subfolders_list(struct maildirpp *md,
+	GHashTable *old)
 {
     char path2[PATH_MAX];
     size_t path2_len;
@@ -200,79 +596,143 @@ static int maildirpp_load_subfolders_list(struct maildirpp *md)
     assert(md->subfolders == NULL);
     md->subfolders = g_ptr_array_new();
     assert(md->subdirs == NULL);
-    md->subdirs = g_ptr_array_new();
+    md->subdirs = g_array_new(0, 0, sizeof(int));
 
-    /* Unset dirty flag and rewind dir */
-    sig_fd_isset(dirfd(md->dir), SFI_CLEAR, SFI_BLOCK);
-    rewinddir(md->dir);
+    long long start = now_usec();
+    md->counters.subfolder_reloads++;
+    PROBE1(subfolders__reload__start, md->path);
+
+    /* Unset dirty flag */
+    notify_read(md->ctx);
+    md->dirty = 0;
 
     /* Load the list of subfolders */
+    if (maildirpp_scan_dir(md, path2, path2_len, 0, old))
+	return -1;
+
+    /* Sort them */
+    g_ptr_array_sort(md->subfolders, (GCompareFunc) maildirpp_compare_folder);
+
+    /* And build the hierarchy. */
+    assert(md->tree == NULL);
+    md->tree = maildir_tree_new(NULL, NULL, 0);
+    for (int i = 0; i < md->subfolders->len; i++)
+	maildir_tree_insert(md->tree,
+		(struct maildir_folder *) g_ptr_array_index(md->subfolders, i));
+
+    md->counters.reload_time += now_usec() - start;
+    PROBE3(subfolders__reload__end, md->path, md->subfolders->len,
+	    md->subdirs->len);
+
+    return 0;
+}
+
+/** Look for folders in a directory of the maildir++ (and its
+ * subdirectories, with MDO_NESTED).
+ * \param path2 Path of the directory, including the trailing "/". Used as a
+ *        buffer, its contents are preserved.
+ * \param depth 0 for the maildir++ itself.
+ * \param old See #maildirpp_load_subfolders_list.
+ */
+static int maildirpp_scan_dir(struct maildirpp *md, char *path2,
+	size_t path2_len, int depth, GHashTable *old)
+{
+    DIR *dir = opendir(path2);
+    if (!dir) {
+	if (depth) {
+	    VERBOSE(md, perror(path2)); return 0;
+	}
+	perror(path2); return -1;
+    }
+
     struct dirent *dent;
     while (1) {
 	errno = 0;
-	if ((dent = readdir(md->dir)) == 0) {
+	if ((dent = readdir(dir)) == 0) {
 	    if (errno == 0)
 		break;
-	    perror("readdir"); return -1;
+	    perror("readdir"); closedir(dir); return -1;
 	}
 
-	/* Filter out "..". */
-	if (strcmp(dent->d_name,"..") /*&& dent->d_name[0] == '.'*/) {
-	    /* Another dumb len check */
-	    size_t name_len = strlen(dent->d_name);
-	    if (name_len + path2_len + 4 >= PATH_MAX) {
-		fprintf(stderr, "Overlong path: %s%s/new\n", path2,
-			dent->d_name);
-		continue;
-	    }
-
-	    int opened = 0;
-
-	    /* Does it have a "new" subdir? */
-	    strcpy(path2 + path2_len, dent->d_name);
-	    strcpy(path2 + path2_len + name_len, "/new");
-	    if (access(path2, X_OK) == 0) {
-		/* Ok, open and push */
+	/* Filter out "..", and "." unless it's the top (INBOX). */
+	if (!strcmp(dent->d_name, "..") ||
+		(depth && !strcmp(dent->d_name, ".")))
+	    continue;
 
-		path2[path2_len + name_len] = 0;
+	/* Another dumb len check */
+	size_t name_len = strlen(dent->d_name);
+	if (name_len + path2_len + 5 >= PATH_MAX) {
+	    fprintf(stderr, "Overlong path: %s%s/new\n", path2,
+		    dent->d_name);
+	    continue;
+	}
 
-		struct maildir_folder *folder =
-		    g_slice_new0(struct maildir_folder);
+	int opened = 0;
+
+	/* Does it have a "new" subdir? */
+	strcpy(path2 + path2_len, dent->d_name);
+	strcpy(path2 + path2_len + name_len, "/new");
+	if (access(path2, X_OK) == 0) {
+	    /* Ok, open and push */
+
+	    path2[path2_len + name_len] = 0;
+
+	    struct maildir_folder *folder = old ?
+		g_hash_table_lookup(old, path2) : NULL;
+	    if (folder && !maildir_folder_watched(folder))
+		folder = NULL; /* Replaced by another one, left in old. */
+	    if (folder) {
+		/* Known already, keep it with all its data. */
+		g_hash_table_remove(old, path2);
+		g_ptr_array_add(md->subfolders, folder);
+		opened = 1;
+	    } else {
+		folder = g_slice_new0(struct maildir_folder);
 		/* The zero ---^ is important! */
 		folder->md = md;
+		if (depth == 0 && !strcmp(dent->d_name, "."))
+		    folder->priority = MAILDIR_PRIO_INBOX;
 		if (maildir_folder_open(folder, path2) == 0) {
 		    g_ptr_array_add(md->subfolders, folder);
 		    opened = 1;
 		} else
 		    g_slice_free(struct maildir_folder, folder);
 	    }
+	}
 
-	    if (!opened &&
-		    strcmp(dent->d_name, "new") &&
-		    strcmp(dent->d_name, "cur") &&
-		    strcmp(dent->d_name, "tmp")) {
-		/* Looks like a maildir folder but is not. Watch it in case it
-		 * becomes a folder. */
-		/* Since we don't require '.' at the beginning of a mailbox
-		 * name, exclude new/cur/tmp. */
-
-		path2[path2_len + name_len] = 0;
-
-		DIR *subdir = opendir(path2);
-		if (subdir) {
-		    if (dnotify(dirfd(subdir),
-				DN_CREATE|DN_DELETE|DN_RENAME|DN_MULTISHOT))
-			closedir(subdir);
-		    else
-			g_ptr_array_add(md->subdirs, subdir);
-		} else
-		    VERBOSE(perror(path2));
+	/* Since we don't require '.' at the beginning of a mailbox name,
+	 * exclude new/cur/tmp. */
+	if (!strcmp(dent->d_name, "new") || !strcmp(dent->d_name, "cur") ||
+		!strcmp(dent->d_name, "tmp") || !strcmp(dent->d_name, "."))
+	    continue;
+
+	if (!opened || (md->opts.flags & MDO_NESTED)) {
+	    /* Looks like a maildir folder but is not, or it may contain
+	     * nested folders. Watch it in case it becomes a folder or some
+	     * appear. */
+
+	    path2[path2_len + name_len] = 0;
+
+	    int wd = watch_add_dirs(md, path2);
+	    if (wd != -1)
+		g_array_append_val(md->subdirs, wd);
+	    else
+		VERBOSE(md, perror(path2));
+
+	    /* Descend into it. */
+	    if (wd != -1 && (md->opts.flags & MDO_NESTED) &&
+		    depth + 1 < MAILDIR_MAX_DEPTH) {
+		strcpy(path2 + path2_len + name_len, "/");
+		if (maildirpp_scan_dir(md, path2, path2_len + name_len + 1,
+			    depth + 1, old)) {
+		    closedir(dir); return -1;
+		}
 	    }
 	}
     }
 
-    /* Sort them */
-    g_ptr_array_sort(md->subfolders, (GCompareFunc) maildirpp_compare_folder);
+    path2[path2_len] = 0;
+    closedir(dir);
 
     return 0;
 }
@@ -283,6 +743,33 @@ static int maildirpp_compare_folder(struct maildir_folder **a,
     return strcmp((*a)->path, (*b)->path);
 }
 
+/** Are the subdirs of the folder still the ones we watch? They aren't if
+ * the folder has been replaced by another of the same name. */
+static int maildir_folder_watched(struct maildir_folder *mdf)
+{
+    struct maildirpp_ctx *ctx = mdf->md->ctx;
+    char path2[PATH_MAX];
+    int same = 1;
+
+    for (int i = 0; i < 2; i++) {
+	int wd = i ? mdf->wd_cur : mdf->wd_new;
+	strcpy(path2, mdf->path);
+	strcat(path2, i ? "/cur" : "/new");
+
+	/* Adding the same events again just gives us the watch. */
+	int wd2 = inotify_add_watch(ctx->notify_fd, path2,
+		WATCH_MSGS_EVENTS | IN_MASK_ADD);
+	if (wd2 != wd) {
+	    same = 0;
+	    if (wd2 != -1 && !g_hash_table_lookup(ctx->watches,
+			GINT_TO_POINTER(wd2)))
+		inotify_rm_watch(ctx->notify_fd, wd2);
+	}
+    }
+
+    return same;
+}
+
 /** Free the list of subfolders. */
 static void maildirpp_free_subfolders_list(struct maildirpp *md)
 {
@@ -293,25 +780,79 @@ static void maildirpp_free_subfolders_list(struct maildirpp *md)
     md->subfolders = 0;
 
     assert(md->subdirs != NULL);
-    g_ptr_array_foreach(md->subdirs, (GFunc) closedir, 0);
-    g_ptr_array_free(md->subdirs, 1);
+    for (int i = 0; i < md->subdirs->len; i++)
+	watch_remove(md->ctx, g_array_index(md->subdirs, int, i),
+		&md->dirty);
+    g_array_free(md->subdirs, 1);
     md->subdirs = 0;
+
+    if (md->tree) {
+	maildir_tree_free(md->tree);
+	md->tree = 0;
+    }
 }
 
-/** Refresh the list of subfolders. */
+/** Refresh the list of subfolders. Folders still there are kept as they
+ * are, with their stats, messages and changes, only the new ones are
+ * opened and those gone closed.
+ */
 int maildirpp_refresh_subfolders_list(struct maildirpp *md)
 {
-    maildirpp_free_subfolders_list(md);
-    return maildirpp_load_subfolders_list(md);
+    GPtrArray *folders = md->subfolders;
+    GArray *subdirs = md->subdirs;
+    GHashTable *old = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (int i = 0; i < folders->len; i++) {
+	struct maildir_folder *mdf =
+	    (struct maildir_folder *) g_ptr_array_index(folders, i);
+	g_hash_table_insert(old, mdf->path, mdf);
+	mdf->node = NULL;
+    }
+    md->subfolders = NULL;
+    md->subdirs = NULL;
+    maildir_tree_free(md->tree);
+    md->tree = NULL;
+
+    int ret = maildirpp_load_subfolders_list(md, old);
+
+    /* The watches of the wannabe folders are added again by the scan,
+     * drop the old ones only now, so that the directories stay watched. */
+    for (int i = 0; i < subdirs->len; i++)
+	watch_remove(md->ctx, g_array_index(subdirs, int, i), &md->dirty);
+    g_array_free(subdirs, 1);
+
+    /* Close the folders which are gone. */
+    GHashTableIter iter;
+    struct maildir_folder *mdf;
+    g_hash_table_iter_init(&iter, old);
+    while (g_hash_table_iter_next(&iter, NULL, (void **) &mdf))
+	maildir_folder_close_and_free(mdf);
+    g_hash_table_destroy(old);
+    g_ptr_array_free(folders, 1);
+
+    /* The kept folders count into the totals of the new hierarchy. */
+    for (int i = 0; md->tree && i < md->subfolders->len; i++) {
+	mdf = (struct maildir_folder *) g_ptr_array_index(md->subfolders, i);
+	if (mdf->stats)
+	    maildir_tree_update(mdf->node, mdf->stats, 1);
+    }
+
+    return ret;
 }
 
 /** Close the given maildir++. */
 void maildirpp_close(struct maildirpp *md)
 {
     maildirpp_free_subfolders_list(md);
-
-    assert(md->dir != NULL);
-    closedir(md->dir);
+    assert(md->dirs_open == 0);
+
+    watch_remove(md->ctx, md->wd, &md->dirty);
+    g_ptr_array_remove(md->ctx->maildirs, md);
+    maildirpp_msgid_free(md);
+    if (md->fields) {
+	g_ptr_array_foreach(md->fields, (GFunc) g_free, 0);
+	g_ptr_array_free(md->fields, 1);
+    }
 
     memset(md, 0, sizeof(struct maildirpp));
 }
@@ -331,39 +872,31 @@ static int maildir_folder_open(struct maildir_folder *mdf, const char *path)
     strcpy(mdf->path, path);
     strcpy(path2, path);
 
-    /* Open the new subdir */
+    /* Watch the new subdir */
     strcpy(path2 + path_len, "/new");
-    mdf->dir_new = opendir(path2);
-    if (!mdf->dir_new) {
-	VERBOSE(perror(path2)); goto err1;
+    mdf->wd_new = watch_add(mdf->md, path2, WATCH_MSGS_EVENTS, &mdf->dirty,
+	    SD_NEW, &mdf->expected);
+    if (mdf->wd_new == -1) {
+	VERBOSE(mdf->md, perror(path2)); goto err1;
     }
 
-    /* Open the cur subdir */
+    /* Watch the cur subdir */
     strcpy(path2 + path_len, "/cur");
-    mdf->dir_cur = opendir(path2);
-    if (!mdf->dir_cur) {
-	VERBOSE(perror(path2)); goto err2;
+    mdf->wd_cur = watch_add(mdf->md, path2, WATCH_MSGS_EVENTS, &mdf->dirty,
+	    SD_CUR, &mdf->expected);
+    if (mdf->wd_cur == -1) {
+	VERBOSE(mdf->md, perror(path2)); goto err2;
     }
 
-    /* Set up dnotify */
-    if (dnotify(dirfd(mdf->dir_new),
-		DN_CREATE|DN_DELETE|DN_RENAME|DN_MODIFY|DN_MULTISHOT))
-	goto err3;
-    if (dnotify(dirfd(mdf->dir_cur),
-		DN_CREATE|DN_DELETE|DN_RENAME|DN_MODIFY|DN_MULTISHOT))
-	goto err3;
-
     /* The folder is dirty by default, because we haven't read any messages
-     * yet. */
-    sig_fd_isset(dirfd(mdf->dir_new), SFI_SET, SFI_BLOCK);
-    sig_fd_isset(dirfd(mdf->dir_cur), SFI_SET, SFI_BLOCK);
+     * yet. The dir streams are opened once they're needed. */
+    mdf->dirty = SD_NEW | SD_CUR;
+    mdf->lru.data = mdf;
 
     return 0;
 
-err3:
-    closedir(mdf->dir_cur);
 err2:
-    closedir(mdf->dir_new);
+    watch_remove(mdf->md->ctx, mdf->wd_new, &mdf->dirty);
 err1:
     return -1;
 }
@@ -371,16 +904,19 @@ err1:
 /** Close a given subfolder. */
 static void maildir_folder_close(struct maildir_folder *mdf)
 {
-    assert(mdf->dir_cur != NULL);
-    closedir(mdf->dir_cur);
-    assert(mdf->dir_new != NULL);
-    closedir(mdf->dir_new);
+    maildir_folder_close_dirs(mdf);
+    watch_remove(mdf->md->ctx, mdf->wd_cur, &mdf->dirty);
+    watch_remove(mdf->md->ctx, mdf->wd_new, &mdf->dirty);
 
     if (mdf->stats)
 	g_slice_free(struct maildir_folder_stats, mdf->stats);
-    if (mdf->messages)
-	g_tree_destroy(mdf->messages);
+    maildir_folder_messages_free(mdf);
+    if (mdf->evicted_names)
+	g_hash_table_destroy(mdf->evicted_names);
     assert(mdf->old_messages == NULL);
+    assert(mdf->unsized == NULL);
+    assert(mdf->unmatched == NULL);
+    maildir_folder_changes_clear(mdf);
 
     /*memset(mdf, 0, sizeof(struct maildir_folder));*/
 }
@@ -393,42 +929,309 @@ static void maildir_folder_close_and_free(struct maildir_folder *mdf)
     g_slice_free(struct maildir_folder, mdf);
 }
 
-/** Is the maildir++ dirty (has the list of subfolders changed?)
- * \param dont_block - non-public API, just pass 0 */
-int maildirpp_dirty(struct maildirpp *md, int dont_block)
+/** Create a new node of the folder hierarchy.
+ * \param name The last component of the name, not NUL-terminated.
+ */
+static struct maildir_tree *maildir_tree_new(struct maildir_tree *parent,
+	const char *name, size_t name_len)
 {
-    int ret = 0;
+    struct maildir_tree *node = g_slice_new0(struct maildir_tree);
+
+    node->parent = parent;
+    if (!parent)
+	node->name = g_strdup("");
+    else if (!*parent->name)
+	node->name = g_strndup(name, name_len);
+    else {
+	char *last = g_strndup(name, name_len);
+	node->name = g_strconcat(parent->name, ".", last, NULL);
+	g_free(last);
+    }
+    node->children = g_ptr_array_new();
 
-    if (!dont_block) sig_block(1);
-    ret = sig_fd_isset(dirfd(md->dir), SFI_ISSET, SFI_DONTBLOCK);
-    assert(md->subdirs != NULL);
-    for (int i = 0; !ret && i < md->subdirs->len; i++) {
-	DIR *subdir = (DIR *) g_ptr_array_index(md->subdirs, i);
-	ret |= sig_fd_isset(dirfd(subdir), SFI_ISSET, SFI_DONTBLOCK);
+    if (parent)
+	g_ptr_array_add(parent->children, node);
+
+    return node;
+}
+
+/** Insert a folder into the hierarchy, creating the missing nodes.
+ * Both '.' (Maildir++) and '/' (nested dirs) separate the components of
+ * the folder name, so ".lists.linux" and "lists/linux" end up at the same
+ * node. The INBOX is the root.
+ */
+static void maildir_tree_insert(struct maildir_tree *root,
+	struct maildir_folder *mdf)
+{
+    struct maildir_tree *node = root;
+    const char *p = mdf->path + strlen(mdf->md->path);
+
+    while (*p) {
+	size_t len;
+
+	p += strspn(p, "./");
+	if (!*p)
+	    break;
+	len = strcspn(p, "./");
+
+	struct maildir_tree *child = NULL;
+	for (int i = 0; i < node->children->len; i++) {
+	    struct maildir_tree *c =
+		(struct maildir_tree *) g_ptr_array_index(node->children, i);
+	    const char *last = strrchr(c->name, '.');
+	    last = last ? last + 1 : c->name;
+	    if (strlen(last) == len && !strncmp(last, p, len)) {
+		child = c; break;
+	    }
+	}
+	node = child ? child : maildir_tree_new(node, p, len);
+
+	p += len;
     }
-    if (!dont_block) sig_block(0);
 
-    return ret;
+    /* Two folders may map to the same node (".a.b" and "a/b"), #mdf is the
+     * first of them then. Both count into the totals. */
+    if (!node->mdf)
+	node->mdf = mdf;
+    mdf->node = node;
+}
+
+/** Free a node and its descendants. */
+static void maildir_tree_free(struct maildir_tree *node)
+{
+    g_ptr_array_foreach(node->children, (GFunc) maildir_tree_free, 0);
+    g_ptr_array_free(node->children, 1);
+    g_free(node->name);
+    g_slice_free(struct maildir_tree, node);
+}
+
+/** Add (sign = 1) or subtract (sign = -1) folder stats to/from the totals of
+ * a node and all its ancestors. */
+static void maildir_tree_update(struct maildir_tree *node,
+	const struct maildir_folder_stats *stats, int sign)
+{
+    for (; node; node = node->parent)
+	maildir_folder_stats_add(&node->total, stats, sign);
+}
+
+/** Find a node of the folder hierarchy by its name, e.g. "lists.linux".
+ * The root (INBOX and all the other folders) is "".
+ * \return The node or NULL.
+ */
+struct maildir_tree *maildirpp_tree_lookup(struct maildirpp *md,
+	const char *name)
+{
+    struct maildir_tree *node = md->tree;
+
+    while (node && strcmp(node->name, name)) {
+	struct maildir_tree *next = NULL;
+
+	/* Descend to the child whose name is a prefix of the wanted one. */
+	for (int i = 0; i < node->children->len; i++) {
+	    struct maildir_tree *c =
+		(struct maildir_tree *) g_ptr_array_index(node->children, i);
+	    size_t len = strlen(c->name);
+	    if (!strncmp(c->name, name, len) &&
+		    (name[len] == '.' || !name[len])) {
+		next = c; break;
+	    }
+	}
+
+	node = next;
+    }
+
+    return node;
+}
+
+/** Order of the children of a node, by name. */
+static int maildir_tree_compare(struct maildir_tree **a,
+	struct maildir_tree **b)
+{
+    return strcmp((*a)->name, (*b)->name);
+}
+
+/** Create a Maildir++ folder, e.g. "Archive.2025", and add it to the list
+ * of subfolders and the hierarchy right away. Our changes of the maildir++
+ * don't make it dirty, so the list isn't reloaded for them. An existing
+ * folder of that name is just returned.
+ *
+ * \param data Mask of MFD_STATS, MFD_MSGS. A new folder is empty, so it
+ *   gets this data (empty) right away instead of being dirty.
+ * \return The folder, NULL on error.
+ */
+struct maildir_folder *maildirpp_folder_create(struct maildirpp *md,
+	const char *name, int data)
+{
+    struct maildir_tree *node = maildirpp_tree_lookup(md, name);
+    if (node && node->mdf)
+	return node->mdf;
+
+    if (!*name || *name == '.' || strchr(name, '/')) {
+	fprintf(stderr, "Invalid folder name: %s\n", name);
+	return NULL;
+    }
+
+    char path2[PATH_MAX];
+    size_t path_len = strlen(md->path) + 2 + strlen(name);
+    if (path_len + 14 >= PATH_MAX) {
+	fprintf(stderr, "Overlong path: %s/.%s/maildirfolder\n", md->path,
+		name);
+	return NULL;
+    }
+
+    char *entry = g_strconcat(".", name, NULL);
+    expect_add(md->ctx, &md->expected, entry, 1);
+    g_free(entry);
+
+    static const char *const dirs[] = { "", "/tmp", "/new", "/cur" };
+    strcpy(path2, md->path);
+    strcat(path2, "/.");
+    strcat(path2, name);
+    for (int i = 0; i < G_N_ELEMENTS(dirs); i++) {
+	strcpy(path2 + path_len, dirs[i]);
+	if (mkdir(path2, 0700) && errno != EEXIST) {
+	    perror(path2); goto err1;
+	}
+    }
+
+    /* Tells Courier (and the likes) it's a folder, not a maildir. */
+    strcpy(path2 + path_len, "/maildirfolder");
+    int fd = open(path2, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd != -1)
+	close(fd);
+    path2[path_len] = 0;
+
+    struct maildir_folder *mdf = g_slice_new0(struct maildir_folder);
+    mdf->md = md;
+    if (maildir_folder_open(mdf, path2)) {
+	perror(path2); goto err2;
+    }
+
+    if (md->opts.flags & MDO_NESTED) {
+	int wd = watch_add_dirs(md, path2);
+	if (wd != -1)
+	    g_array_append_val(md->subdirs, wd);
+    }
+
+    expect_end(md->ctx, &md->expected);
+
+    g_ptr_array_add(md->subfolders, mdf);
+    g_ptr_array_sort(md->subfolders, (GCompareFunc) maildirpp_compare_folder);
+    maildir_tree_insert(md->tree, mdf);
+    for (node = mdf->node; node->parent; node = node->parent)
+	g_ptr_array_sort(node->parent->children,
+		(GCompareFunc) maildir_tree_compare);
+
+    if (data) {
+	if (data & MFD_STATS) {
+	    mdf->stats = g_slice_new0(struct maildir_folder_stats);
+	    mdf->stats->when = time(0);
+	}
+	if (data & MFD_MSGS) {
+	    mdf->messages = g_tree_new_full((GCompareDataFunc) strcmp, 0,
+		    NULL, (GDestroyNotify) message_free_and_free);
+	    maildir_folder_touch(mdf);
+	}
+	mdf->dirty = 0;
+	mdf->walked = SD_NEW | SD_CUR;
+    }
+
+    return mdf;
+
+err2:
+    g_slice_free(struct maildir_folder, mdf);
+err1:
+    expect_end(md->ctx, &md->expected);
+    return NULL;
+}
+
+/** Get the dir stream of the new or cur subdir of a folder, opening it if
+ * it's not open yet. It stays open until #maildirpp_trim_dirs decides
+ * otherwise.
+ * \param subdir SD_NEW or SD_CUR.
+ * \return The stream, NULL on error.
+ */
+static DIR *maildir_folder_dir(struct maildir_folder *mdf, int subdir)
+{
+    struct maildirpp *md = mdf->md;
+    DIR **dir = subdir == SD_NEW ? &mdf->dir_new : &mdf->dir_cur;
+
+    /* Move to the end of the LRU list (or add there). */
+    if (mdf->dir_new || mdf->dir_cur)
+	g_queue_unlink(&md->dirs_lru, &mdf->lru);
+    g_queue_push_tail_link(&md->dirs_lru, &mdf->lru);
+
+    if (!*dir) {
+	char path2[PATH_MAX];
+	strcpy(path2, mdf->path);
+	strcat(path2, subdir == SD_NEW ? "/new" : "/cur");
+
+	*dir = opendir(path2);
+	if (!*dir) {
+	    perror(path2);
+	    if (!mdf->dir_new && !mdf->dir_cur)
+		g_queue_unlink(&md->dirs_lru, &mdf->lru);
+	    return NULL;
+	}
+	md->dirs_open++;
+    }
+
+    return *dir;
+}
+
+/** Close the dir streams of a folder. */
+static void maildir_folder_close_dirs(struct maildir_folder *mdf)
+{
+    struct maildirpp *md = mdf->md;
+
+    if (!mdf->dir_new && !mdf->dir_cur)
+	return;
+
+    g_queue_unlink(&md->dirs_lru, &mdf->lru);
+    if (mdf->dir_new) {
+	closedir(mdf->dir_new); mdf->dir_new = NULL; md->dirs_open--;
+    }
+    if (mdf->dir_cur) {
+	closedir(mdf->dir_cur); mdf->dir_cur = NULL; md->dirs_open--;
+    }
+}
+
+/** Close the least recently used dir streams to get within the fd budget
+ * (only with MDO_LAZY_DIRS). */
+static void maildirpp_trim_dirs(struct maildirpp *md)
+{
+    if (!(md->opts.flags & MDO_LAZY_DIRS))
+	return;
+
+    while (md->dirs_open > md->opts.fd_budget && md->dirs_lru.head)
+	maildir_folder_close_dirs(
+		(struct maildir_folder *) md->dirs_lru.head->data);
+}
+
+/** Is the maildir++ dirty (has the list of subfolders changed?)
+ * \param dont_block - unused, kept for compatibility */
+int maildirpp_dirty(struct maildirpp *md, int dont_block)
+{
+    notify_read(md->ctx);
+    return md->dirty;
 }
 
 /** Is any of the subfolders dirty?
  * (message added/removed/changed status/modified)
- * \param dont_block - non-public API, just pass 0 */
+ * \param dont_block - unused, kept for compatibility */
 int maildirpp_dirty_subfolders(struct maildirpp *md, int dont_block)
 {
-    int ret = 0;
+    notify_read(md->ctx);
 
-    if (!dont_block) sig_block(1);
     assert(md->subfolders != NULL);
-    for (int i = 0; !ret && i < md->subfolders->len; i++) {
+    for (int i = 0; i < md->subfolders->len; i++) {
 	struct maildir_folder *mdf =
 	    (struct maildir_folder *) g_ptr_array_index(md->subfolders, i);
-	ret |= sig_fd_isset(dirfd(mdf->dir_new), SFI_ISSET, SFI_DONTBLOCK);
-	ret |= sig_fd_isset(dirfd(mdf->dir_cur), SFI_ISSET, SFI_DONTBLOCK);
+	if (mdf->dirty)
+	    return 1;
     }
-    if (!dont_block) sig_block(0);
 
-    return ret;
+    return 0;
 }
 
 static int maildirpp_dirty2(struct maildirpp *md)
@@ -436,25 +1239,144 @@ static int maildirpp_dirty2(struct maildirpp *md)
     return maildirpp_dirty(md, 1) || maildirpp_dirty_subfolders(md, 1);
 }
 
-/** Reliable way to wait for signal or just return if it's dirty */
+/** Wait for a change or just return if it's dirty. Returns early if
+ * interrupted by a signal. */
 void maildirpp_pause_if_not_dirty(struct maildirpp *md)
 {
-    sig_wait((int (*) (void *)) maildirpp_dirty2, (void *) md);
+    struct pollfd pfd = { .fd = md->ctx->notify_fd, .events = POLLIN };
+
+    while (!maildirpp_dirty2(md)) {
+	if (poll(&pfd, 1, -1) == -1) {
+	    if (errno != EINTR)
+		perror("poll");
+	    return;
+	}
+    }
 }
 
-/** Set verbosity. */
+/** Set verbosity of the default context. */
 void maildirpp_set_verbose(int new_verbose)
 {
-    verbose = new_verbose;
+    maildirpp_ctx_set_verbose(&default_ctx, new_verbose);
+}
+
+/** Set verbosity of a context. */
+void maildirpp_ctx_set_verbose(struct maildirpp_ctx *ctx, int verbose)
+{
+    ctx->verbose = verbose;
+}
+
+/** Wait until some maildir of the context is dirty, see
+ * #maildirpp_pause_if_not_dirty. One thread can watch many maildirs this
+ * way.
+ * \param timeout In milliseconds, -1 for no limit.
+ * \return 1 - something is dirty, 0 - timed out, -1 - error (or a
+ *   signal).
+ */
+int maildirpp_ctx_wait(struct maildirpp_ctx *ctx, int timeout)
+{
+    struct pollfd pfd = { .fd = ctx->notify_fd, .events = POLLIN };
+    long long end = now_usec() + timeout * 1000LL;
+
+    while (1) {
+	for (int i = 0; ctx->maildirs && i < ctx->maildirs->len; i++)
+	    if (maildirpp_dirty2((struct maildirpp *)
+			g_ptr_array_index(ctx->maildirs, i)))
+		return 1;
+
+	int left = timeout < 0 ? -1 : MAX((end - now_usec()) / 1000, 0);
+	switch (poll(&pfd, 1, left)) {
+	    case -1:
+		if (errno != EINTR)
+		    perror("poll");
+		return -1;
+	    case 0:
+		return 0;
+	}
+    }
+}
+
+/** Monotonic time in microseconds, for the counters. */
+static long long now_usec(void)
+{
+    return g_get_monotonic_time();
+}
+
+/** Reset the instrumentation counters. */
+void maildirpp_counters_reset(struct maildirpp *md)
+{
+    memset(&md->counters, 0, sizeof(struct maildirpp_counters));
+}
+
+/** Print the instrumentation counters in a human readable form. */
+void maildirpp_counters_print(struct maildirpp *md, FILE *f)
+{
+    struct maildirpp_counters *c = &md->counters;
+
+    fprintf(f, "subfolder list reloads: %lu (%.3f ms)\n",
+	    c->subfolder_reloads, c->reload_time / 1000.0);
+    fprintf(f, "notifications:          %lu\n", c->notifications);
+    fprintf(f, "folders rescanned:      %lu (%.3f ms)\n",
+	    c->folder_scans, c->walk_time / 1000.0);
+    fprintf(f, "dirents scanned:        %lu\n", c->dirents);
+    fprintf(f, "messages parsed:        %lu (%lu header bytes, %.3f ms)\n",
+	    c->msgs_parsed, c->hdr_bytes, c->parse_time / 1000.0);
+    fprintf(f, "messages reused:        %lu\n", c->msgs_reused);
+    fprintf(f, "messages vanished:      %lu\n", c->msgs_vanished);
+    fprintf(f, "folders evicted:        %lu (%lu reloaded)\n",
+	    c->folder_evictions, c->folder_reloads);
+}
+
+/** Pass a batch of messages to the walker functions: the whole batch to
+ * each batch function, then message by message to the message
+ * functions. */
+static void maildir_folder_walk_batch(struct walk_batch *batch,
+	GArray *msgs_funcs, GArray *batch_funcs,
+	char *path2, size_t path2_len)
+{
+    struct maildir_folder_walk_batch *b = &batch->b;
+
+    for (int i = 0; i < batch_funcs->len; i++) {
+	maildir_folder_walk_batch_func f =
+	    g_array_index(batch_funcs, maildir_folder_walk_batch_func, i);
+	f(b);
+    }
+
+    if (msgs_funcs->len > 0) {
+	struct maildir_folder_walk_messages_params params = { .mdf = b->mdf,
+	    .msg_full_path = path2 };
+
+	for (int j = 0; j < b->len; j++) {
+	    memcpy(path2 + path2_len, b->names[j], b->name_lens[j] + 1);
+	    params.msg_name = b->names[j];
+	    params.msg_subdir = b->subdir;
+	    params.msg_flags = b->flags[j];
+	    params.msg_delivered = b->delivered[j];
+	    params.msg_ino = b->inos[j];
+
+	    for (int i = 0; i < msgs_funcs->len; i++) {
+		maildir_folder_walk_messages_func f =
+		    g_array_index(msgs_funcs,
+			    maildir_folder_walk_messages_func, i);
+		f(&params);
+	    }
+	}
+	path2[path2_len] = '\0';
+    }
+
+    b->len = 0;
 }
 
-/** Walk the list of messages, calling the specified functions of type
- * <code>void (*)(struct maildir_folder_walk_messages_params *params)</code>.
+/** Walk the list of messages, passing them in batches of up to
+ * MAILDIR_WALK_BATCH to the functions in \a batch_funcs and one by one to
+ * the functions in \a msgs_funcs.
  *
+ * \param batch Storage for the batches.
  * \param walk_subdirs Mask of SD_CUR, SD_NEW -- subdirs to be walked.
  */
 static void maildir_folder_walk_messages(struct maildir_folder *mdf,
-	GArray *funcs, int walk_subdirs)
+	struct walk_batch *batch, GArray *msgs_funcs, GArray *batch_funcs,
+	int walk_subdirs)
 {
     /* Prepare the path string */
     char path2[PATH_MAX];
@@ -467,45 +1389,57 @@ static void maildir_folder_walk_messages(struct maildir_folder *mdf,
 	return; /* Should we abort instead? */
     }
 
-    /* Unset dirty flag and rewind dirs */
-    if (walk_subdirs & SD_NEW) {
-	sig_fd_isset(dirfd(mdf->dir_new), SFI_CLEAR, SFI_BLOCK);
-	rewinddir(mdf->dir_new);
-    }
-    if (walk_subdirs & SD_CUR) {
-	sig_fd_isset(dirfd(mdf->dir_cur), SFI_CLEAR, SFI_BLOCK);
-	rewinddir(mdf->dir_cur);
-    }
+    mdf->walked = walk_subdirs;
 
     /* Load the list of subfolders */
     struct dirent *dent;
-    struct maildir_folder_walk_messages_params params = { .mdf = mdf };
+    struct maildir_folder_walk_batch *b = &batch->b;
     static const char subdirs[2][6] = { "/new/", "/cur/" };
 
     for (int subdir = 0; subdir < 2; subdir++) {
-	if (!(walk_subdirs & (subdir ? SD_CUR : SD_NEW)))
+	int sd = subdir ? SD_CUR : SD_NEW;
+	if (!(walk_subdirs & sd))
+	    continue;
+
+	/* Unset dirty flag and (open and) rewind dir */
+	mdf->dirty &= ~sd;
+	DIR *dir = maildir_folder_dir(mdf, sd);
+	if (!dir)
 	    continue;
+	rewinddir(dir);
 
 	strcpy(path2 + path2_len, subdirs[subdir]);
+	b->mdf = mdf;
+	b->subdir = sd;
+	b->subdir_path = path2;
+	b->len = 0;
 	while (1) {
 	    errno = 0;
-	    if ((dent = readdir(subdir ? mdf->dir_cur : mdf->dir_new)) == 0) {
+	    if ((dent = readdir(dir)) == 0) {
 		if (errno == 0)
 		    break;
-		perror("readdir"); return; /* What to do? */
+		/* Pass on what we have and leave the subdir dirty, so the
+		 * next fill walks it again and finds the rest. */
+		perror("readdir");
+		if (b->len > 0)
+		    maildir_folder_walk_batch(batch, msgs_funcs, batch_funcs,
+			    path2, path2_len + 5);
+		mdf->dirty |= sd;
+		return;
 	    }
 
+	    mdf->md->counters.dirents++;
+
 	    if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
 		continue;
 
-	    if (path2_len + 5 + strlen(dent->d_name) >= PATH_MAX) {
+	    size_t name_len = strlen(dent->d_name);
+	    if (path2_len + 5 + name_len >= PATH_MAX) {
 		fprintf(stderr, "Overlong path: %s%s%s\n", path2,
 			subdirs[subdir], dent->d_name);
 		continue; /* Should we abort instead? */
 	    }
 
-	    strcpy(path2 + path2_len + 5, dent->d_name);
-
 #if 0
 	    /* Stat the messages when walking them? This significantly
 	     * sacrifices performance but makes sure the files in new/ and
@@ -513,24 +1447,33 @@ static void maildir_folder_walk_messages(struct maildir_folder *mdf,
 
 	    struct stat st;
 	    if (stat(path2, &st)) {
-		VERBOSE(perror(path2)); continue;
+		VERBOSE(mdf->md, perror(path2)); continue;
 	    }
 
 	    if (!S_ISREG(st.st_mode))
 		continue;
 #endif
 
-	    params.msg_name = dent->d_name;
-	    params.msg_full_path = path2;
-	    for (int i = 0; i < funcs->len; i++) {
-		maildir_folder_walk_messages_func f =
-		    g_array_index(funcs, maildir_folder_walk_messages_func, i);
-		f(&params);
-	    }
+	    /* Parse the name once for all the functions. The dirent is only
+	     * valid until the next readdir, so copy the name. */
+	    int j = b->len++;
+	    memcpy(batch->names[j], dent->d_name, name_len + 1);
+	    b->names[j] = batch->names[j];
+	    b->name_lens[j] = name_len;
+	    b->d_types[j] = dent->d_type;
+	    b->inos[j] = dent->d_ino;
+	    b->flags[j] = message_parse_flags(dent->d_name, name_len);
+	    b->delivered[j] = message_parse_time(dent->d_name);
+
+	    if (b->len == MAILDIR_WALK_BATCH)
+		maildir_folder_walk_batch(batch, msgs_funcs, batch_funcs,
+			path2, path2_len + 5);
 	}
-    }
 
-    /*g_ptr_array_free(funcs, 1);*/
+	if (b->len > 0)
+	    maildir_folder_walk_batch(batch, msgs_funcs, batch_funcs,
+		    path2, path2_len + 5);
+    }
 }
 
 /** Walk all dirty subfolders, calling the specified functions:
@@ -545,38 +1488,150 @@ static void maildir_folder_walk_messages(struct maildir_folder *mdf,
 void maildirpp_folders_walk(struct maildirpp *md,
 	GArray *folder_pre_funcs, GArray *folder_post_funcs,
 	GArray *msgs_funcs, int subdirs)
+{
+    maildirpp_folders_walk_batches(md, folder_pre_funcs, folder_post_funcs,
+	    msgs_funcs, NULL, subdirs);
+}
+
+/** Like #maildirpp_folders_walk, with functions of type
+ * <code>void (*)(const struct maildir_folder_walk_batch *)</code> called
+ * for batches of up to MAILDIR_WALK_BATCH messages of each subdir (before
+ * the message functions are called for them). Either of \a msgs_funcs and
+ * \a batch_funcs may be NULL.
+ */
+void maildirpp_folders_walk_batches(struct maildirpp *md,
+	GArray *folder_pre_funcs, GArray *folder_post_funcs,
+	GArray *msgs_funcs, GArray *batch_funcs, int subdirs)
+{
+    maildirpp_folders_walk_budget(md, folder_pre_funcs, folder_post_funcs,
+	    msgs_funcs, batch_funcs, subdirs, 0);
+}
+
+/** Walk the messages of one folder, dirty or not, calling the batch
+ * functions. Nothing is filled and the folder stays dirty if it was, this
+ * is for readers of the messages themselves, like exporters.
+ * \param subdirs Mask of SD_CUR, SD_NEW -- subdirs to be walked.
+ */
+void maildir_folder_walk(struct maildir_folder *mdf, GArray *batch_funcs,
+	int subdirs)
+{
+    GArray *no_funcs = g_array_new(0, 0, sizeof(void *));
+    struct walk_batch *batch = g_new(struct walk_batch, 1);
+    int dirty = mdf->dirty, walked = mdf->walked;
+
+    notify_read(mdf->md->ctx);
+    maildir_folder_walk_messages(mdf, batch, no_funcs, batch_funcs, subdirs);
+    mdf->dirty |= dirty;
+    mdf->walked = walked;
+    maildirpp_trim_dirs(mdf->md);
+
+    g_free(batch);
+    g_array_free(no_funcs, 1);
+}
+
+/** Order of walking dirty folders: by priority, then the recently active
+ * ones, then by path. */
+static int maildirpp_compare_folder_sched(struct maildir_folder **a,
+	struct maildir_folder **b)
+{
+    if ((*a)->priority != (*b)->priority)
+	return (*a)->priority > (*b)->priority ? -1 : 1;
+    if ((*a)->active != (*b)->active)
+	return (*a)->active > (*b)->active ? -1 : 1;
+    return maildirpp_compare_folder(a, b);
+}
+
+/** Like #maildirpp_folders_walk_batches, but stop walking once \a budget
+ * microseconds have been spent (0 means no limit). At least one folder is
+ * walked. The folders left out stay dirty and get walked by the next call,
+ * before the ones of lower priority.
+ *
+ * \return The number of dirty folders left.
+ */
+int maildirpp_folders_walk_budget(struct maildirpp *md,
+	GArray *folder_pre_funcs, GArray *folder_post_funcs,
+	GArray *msgs_funcs, GArray *batch_funcs, int subdirs,
+	long long budget)
 {
     assert(md->subfolders != NULL);
 
-    /* For each folder: */
+    GArray *no_funcs = g_array_new(0, 0, sizeof(void *));
+    if (!msgs_funcs)
+	msgs_funcs = no_funcs;
+    if (!batch_funcs)
+	batch_funcs = no_funcs;
+    struct walk_batch *batch = NULL;
+    if (msgs_funcs->len > 0 || batch_funcs->len > 0)
+	batch = g_new(struct walk_batch, 1);
+
+    unsigned long scanned = md->counters.folder_scans;
+    PROBE2(walk__start, md->path, md->subfolders->len);
+
+    notify_read(md->ctx);
+
+    /* Schedule the dirty folders. */
+    GPtrArray *dirty = g_ptr_array_new();
     for (int i = 0; i < md->subfolders->len; i++) {
 	struct maildir_folder *mdf =
 	    (struct maildir_folder *) g_ptr_array_index(md->subfolders, i);
+	if (mdf->dirty)
+	    g_ptr_array_add(dirty, mdf);
+    }
+    g_ptr_array_sort(dirty, (GCompareFunc) maildirpp_compare_folder_sched);
 
-	/* For each dirty folder: */
-	if (sig_fd_isset(dirfd(mdf->dir_new), SFI_ISSET, SFI_BLOCK) ||
-		sig_fd_isset(dirfd(mdf->dir_cur), SFI_ISSET, SFI_BLOCK)) {
-	    /* Call the folder pre functions. */
-	    for (int j = 0; j < folder_pre_funcs->len; j++) {
-		maildir_folder_walk_func f =
-		    g_array_index(folder_pre_funcs,
-			    maildir_folder_walk_func, j);
-		f(mdf);
-	    }
+    long long walk_start = now_usec();
+    int left = dirty->len;
+
+    /* For each dirty folder: */
+    for (int i = 0; i < dirty->len; i++) {
+	struct maildir_folder *mdf =
+	    (struct maildir_folder *) g_ptr_array_index(dirty, i);
 
-	    /* Call the message functions. */
-	    if (msgs_funcs->len > 0)
-		maildir_folder_walk_messages(mdf, msgs_funcs, subdirs);
+	if (i > 0 && budget > 0 && now_usec() - walk_start >= budget)
+	    break;
 
-	    /* Call the folder post functions. */
-	    for (int j = 0; j < folder_post_funcs->len; j++) {
-		maildir_folder_walk_func f =
-		    g_array_index(folder_post_funcs,
-			    maildir_folder_walk_func, j);
-		f(mdf);
-	    }
+	long long start = now_usec();
+	md->counters.folder_scans++;
+	unsigned long dirents = md->counters.dirents;
+	PROBE1(folder__scan__start, mdf->path);
+
+	if (mdf->walked)
+	    mdf->active = time(0);
+
+	/* Call the folder pre functions. */
+	for (int j = 0; j < folder_pre_funcs->len; j++) {
+	    maildir_folder_walk_func f =
+		g_array_index(folder_pre_funcs, maildir_folder_walk_func, j);
+	    f(mdf);
 	}
+
+	/* Call the message functions. */
+	if (batch)
+	    maildir_folder_walk_messages(mdf, batch, msgs_funcs, batch_funcs,
+		    subdirs);
+
+	/* Call the folder post functions. */
+	for (int j = 0; j < folder_post_funcs->len; j++) {
+	    maildir_folder_walk_func f =
+		g_array_index(folder_post_funcs, maildir_folder_walk_func, j);
+	    f(mdf);
+	}
+
+	/* Stay within the fd budget. */
+	maildirpp_trim_dirs(md);
+
+	md->counters.walk_time += now_usec() - start;
+	PROBE2(folder__scan__end, mdf->path, md->counters.dirents - dirents);
+	left--;
     }
+
+    PROBE2(walk__end, md->path, md->counters.folder_scans - scanned);
+
+    g_ptr_array_free(dirty, 1);
+    g_free(batch);
+    g_array_free(no_funcs, 1);
+
+    return left;
 }
 
 /** Load the requested data for dirty folders.
@@ -584,6 +1639,17 @@ void maildirpp_folders_walk(struct maildirpp *md,
  * \param subdirs See #maildir_folder_walk_messages.
  */
 void maildirpp_folders_fill(struct maildirpp *md, int data, int subdirs)
+{
+    maildirpp_folders_fill_budget(md, data, subdirs, 0);
+}
+
+/** Load the requested data for dirty folders, within a time budget, see
+ * #maildirpp_folders_walk_budget.
+ *
+ * \return The number of dirty folders left.
+ */
+int maildirpp_folders_fill_budget(struct maildirpp *md, int data,
+	int subdirs, long long budget)
 {
     assert(md->subfolders != NULL);
 
@@ -593,12 +1659,35 @@ void maildirpp_folders_fill(struct maildirpp *md, int data, int subdirs)
 	    sizeof(maildir_folder_walk_func));
     GArray *msgs_funcs = g_array_new(0, 0,
 	    sizeof(maildir_folder_walk_messages_func));
+    GArray *batch_funcs = g_array_new(0, 0,
+	    sizeof(maildir_folder_walk_batch_func));
+
+    if (data & MFD_SIZES)
+	data |= MFD_STATS;
+    if (data & MFD_CHANGES)
+	data |= MFD_MSGS;
+
+    /* Changes are only reported by the fill that made them. */
+    for (int i = 0; i < md->subfolders->len; i++)
+	maildir_folder_changes_clear(
+		(struct maildir_folder *) g_ptr_array_index(md->subfolders, i));
 
     if (data & MFD_STATS) {
-	maildir_folder_walk_func ff = maildir_folder_stats_clear;
-	maildir_folder_walk_messages_func mf = maildir_folder_stats_message;
+	maildir_folder_walk_func ff = maildir_folder_stats_clear,
+				 ff2 = maildir_folder_stats_post;
+	maildir_folder_walk_batch_func bf = maildir_folder_stats_batch;
 	g_array_append_val(folder_pre_funcs, ff);
-	g_array_append_val(msgs_funcs, mf);
+	g_array_append_val(batch_funcs, bf);
+
+	/* The sizes must be complete before the stats are counted in. */
+	if (data & MFD_SIZES) {
+	    maildir_folder_walk_func sf = maildir_folder_sizes_prepare,
+				     sf2 = maildir_folder_sizes_post;
+	    g_array_append_val(folder_pre_funcs, sf);
+	    g_array_append_val(folder_post_funcs, sf2);
+	}
+
+	g_array_append_val(folder_post_funcs, ff2);
     }
 
     if (data & MFD_MSGS) {
@@ -608,14 +1697,25 @@ void maildirpp_folders_fill(struct maildirpp *md, int data, int subdirs)
 	g_array_append_val(folder_pre_funcs, ff);
 	g_array_append_val(msgs_funcs, mf);
 	g_array_append_val(folder_post_funcs, ff2);
+
+	if (data & MFD_CHANGES) {
+	    maildir_folder_walk_func cf = maildir_folder_changes_prepare;
+	    g_array_append_val(folder_pre_funcs, cf);
+	}
     }
 
-    maildirpp_folders_walk(md, folder_pre_funcs, folder_post_funcs,
-	    msgs_funcs, subdirs);
+    int left = maildirpp_folders_walk_budget(md, folder_pre_funcs,
+	    folder_post_funcs, msgs_funcs, batch_funcs, subdirs, budget);
+
+    if (data & MFD_MSGS)
+	maildirpp_trim_msgs(md, NULL);
 
+    g_array_free(batch_funcs, 1);
     g_array_free(msgs_funcs, 1);
     g_array_free(folder_post_funcs, 1);
     g_array_free(folder_pre_funcs, 1);
+
+    return left;
 }
 
 /** Free the current and allocate a new stats structure for a given folder
@@ -623,50 +1723,296 @@ void maildirpp_folders_fill(struct maildirpp *md, int data, int subdirs)
  */
 static void maildir_folder_stats_clear(struct maildir_folder *mdf)
 {
-    if (mdf->stats)
+    if (mdf->stats) {
+	maildir_tree_update(mdf->node, mdf->stats, -1);
 	g_slice_free(struct maildir_folder_stats, mdf->stats);
+    }
     mdf->stats = g_slice_new0(struct maildir_folder_stats);
+    mdf->stats->when = time(0);
 }
 
-/** Count in the message. */
-static void maildir_folder_stats_message(
-	struct maildir_folder_walk_messages_params *params)
+/** Finish the stats of a walked folder and count them into the hierarchy
+ * totals. */
+static void maildir_folder_stats_post(struct maildir_folder *mdf)
+{
+    maildir_folder_stats_flush(mdf);
+    maildir_tree_update(mdf->node, mdf->stats, 1);
+}
+
+/** Add (sign = 1) or subtract (sign = -1) stats. */
+void maildir_folder_stats_add(struct maildir_folder_stats *dst,
+	const struct maildir_folder_stats *src, int sign)
+{
+    dst->msgs += sign * src->msgs;
+    dst->passed += sign * src->passed;
+    dst->replied += sign * src->replied;
+    dst->seen += sign * src->seen;
+    dst->trashed += sign * src->trashed;
+    dst->draft += sign * src->draft;
+    dst->flagged += sign * src->flagged;
+    dst->new += sign * src->new;
+    dst->size += sign * src->size;
+    dst->vsize += sign * src->vsize;
+    dst->unsized += sign * src->unsized;
+}
+
+/** Count in a batch of messages. Only the number of messages with each
+ * combination of flags is counted here, see #maildir_folder_stats_flush. */
+static void maildir_folder_stats_batch(
+	const struct maildir_folder_walk_batch *batch)
+{
+    struct maildir_folder *mdf = batch->mdf;
+    struct maildir_folder_stats *stats = mdf->stats;
+    int *hist = mdf->flags_hist;
+
+    for (int i = 0; i < batch->len; i++)
+	hist[batch->flags[i]]++;
+
+    for (int i = 0; i < batch->len; i++) {
+	long long size, vsize;
+	if (message_parse_size(batch->names[i], &size, &vsize)) {
+	    stats->size += size;
+	    stats->vsize += vsize;
+	} else {
+	    stats->unsized++;
+	    if (mdf->unsized)
+		g_ptr_array_add(mdf->unsized, g_strconcat(
+			    batch->subdir == SD_NEW ? "new/" : "cur/",
+			    batch->names[i], NULL));
+	}
+    }
+
+    for (int i = 0; i < batch->len; i++)
+	if (batch->delivered[i])
+	    maildir_folder_stats_time(stats, batch->delivered[i],
+		    batch->flags[i] & MF_NEW);
+}
+
+/** Turn the flags histogram of a walked folder into the flag counts. */
+static void maildir_folder_stats_flush(struct maildir_folder *mdf)
+{
+    struct maildir_folder_stats *stats = mdf->stats;
+
+    for (int flags = 0; flags < MF_COMBINATIONS; flags++) {
+	int n = mdf->flags_hist[flags];
+	if (n)
+	    maildir_folder_stats_flags(stats, flags, n);
+    }
+
+    memset(mdf->flags_hist, 0, sizeof(mdf->flags_hist));
+}
+
+/** Count in \a n messages (negative to count them out) with the given
+ * flags. */
+static void maildir_folder_stats_flags(struct maildir_folder_stats *stats,
+	int flags, int n)
 {
-    params->mdf->stats->msgs++;
+    stats->msgs += n;
+    if (flags & MF_PASSED) stats->passed += n;
+    if (flags & MF_REPLIED) stats->replied += n;
+    if (flags & MF_SEEN) stats->seen += n;
+    if (flags & MF_TRASHED) stats->trashed += n;
+    if (flags & MF_DRAFT) stats->draft += n;
+    if (flags & MF_FLAGGED) stats->flagged += n;
+    if (flags & MF_NEW) stats->new += n;
+}
+
+/** Count in the delivery time of a message. */
+static void maildir_folder_stats_time(struct maildir_folder_stats *stats,
+	time_t t, int new)
+{
+    if (!stats->oldest || t < stats->oldest)
+	stats->oldest = t;
+    if (t > stats->newest)
+	stats->newest = t;
+    if (new) {
+	if (!stats->oldest_new || t < stats->oldest_new)
+	    stats->oldest_new = t;
+	if (t > stats->newest_new)
+	    stats->newest_new = t;
+    }
 
-    int flags = message_parse_flags(params->msg_name);
+    time_t age = stats->when > t ? stats->when - t : 0;
+    if (age / 3600 < MAILDIR_STATS_HOURS)
+	stats->hours[age / 3600]++;
+    stats->days[MIN(age / 86400, MAILDIR_STATS_DAYS - 1)]++;
+}
 
-    if (flags & MF_PASSED) params->mdf->stats->passed++; 
-    if (flags & MF_REPLIED) params->mdf->stats->replied++; 
-    if (flags & MF_SEEN) params->mdf->stats->seen++; 
-    if (flags & MF_TRASHED) params->mdf->stats->trashed++; 
-    if (flags & MF_DRAFT) params->mdf->stats->draft++; 
-    if (flags & MF_FLAGGED) params->mdf->stats->flagged++;
-    if (flags & MF_NEW) params->mdf->stats->new++;
+/** Count out the delivery time of a removed message from the histograms.
+ * The oldest and newest times are left as they were. */
+static void maildir_folder_stats_untime(struct maildir_folder_stats *stats,
+	time_t t)
+{
+    time_t age = stats->when > t ? stats->when - t : 0;
+    if (age / 3600 < MAILDIR_STATS_HOURS)
+	stats->hours[age / 3600]--;
+    stats->days[MIN(age / 86400, MAILDIR_STATS_DAYS - 1)]--;
 }
 
-/** Parse flags of a message. */
-static int message_parse_flags(const char *name)
+/** How many messages were delivered since the given time? Counted from the
+ * histograms, so it's exact to an hour for the last #MAILDIR_STATS_HOURS
+ * hours and to a day up to #MAILDIR_STATS_DAYS days, rounding up. */
+int maildir_folder_stats_since(const struct maildir_folder_stats *stats,
+	time_t since)
 {
     int ret = 0;
 
-    const char *flags = strstr(name, ":2,");
-    if (!flags)
-	return MF_NEW;
-    flags += 3;
+    if (since >= stats->when - MAILDIR_STATS_HOURS * 3600) {
+	for (int i = 0; i < MAILDIR_STATS_HOURS &&
+		stats->when - i * 3600 > since; i++)
+	    ret += stats->hours[i];
+    } else {
+	for (int i = 0; i < MAILDIR_STATS_DAYS &&
+		stats->when - i * 86400 > since; i++)
+	    ret += stats->days[i];
+    }
+
+    return ret;
+}
+
+/** Get the delivery time from a message name. Unique names start with it,
+ * as seconds since the epoch followed by a '.'.
+ * \return The time, 0 if the name doesn't start with one.
+ */
+static time_t message_parse_time(const char *name)
+{
+    time_t t = 0;
+    const char *p;
+
+    for (p = name; *p >= '0' && *p <= '9' && p - name < 12; p++)
+	t = t * 10 + (*p - '0');
 
-    for (; *flags; flags++)
-	switch (*flags) {
-	    case 'P': ret |= MF_PASSED; break;
-	    case 'R': ret |= MF_REPLIED; break;
-	    case 'S': ret |= MF_SEEN; break;
-	    case 'T': ret |= MF_TRASHED; break;
-	    case 'D': ret |= MF_DRAFT; break;
-	    case 'F': ret |= MF_FLAGGED; break;
+    return (p > name && *p == '.') ? t : 0;
+}
+
+/** Start collecting names of messages without the S= field. */
+static void maildir_folder_sizes_prepare(struct maildir_folder *mdf)
+{
+    assert(mdf->unsized == NULL);
+    mdf->unsized = g_ptr_array_new();
+}
+
+/** Stat the messages without the S= field, in one go at the end of the
+ * walk, relative to the folder dir. */
+static void maildir_folder_sizes_post(struct maildir_folder *mdf)
+{
+    int dir = -1;
+
+    if (mdf->unsized->len)
+	dir = open(mdf->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1 && mdf->unsized->len)
+	VERBOSE(mdf->md, perror(mdf->path));
+
+    for (int i = 0; dir != -1 && i < mdf->unsized->len; i++) {
+	/* "new/<name>" or "cur/<name>" */
+	const char *name = (const char *) g_ptr_array_index(mdf->unsized, i);
+	long long size;
+
+#ifdef STATX_SIZE
+	struct statx stx;
+	if (statx(dir, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+		    STATX_SIZE, &stx))
+	    continue; /* Gone. */
+	size = stx.stx_size;
+#else
+	struct stat st;
+	if (fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW))
+	    continue; /* Gone. */
+	size = st.st_size;
+#endif
+
+	mdf->stats->size += size;
+	mdf->stats->vsize += size;
+	mdf->stats->unsized--;
+    }
+
+    if (dir != -1)
+	close(dir);
+
+    g_ptr_array_foreach(mdf->unsized, (GFunc) g_free, 0);
+    g_ptr_array_free(mdf->unsized, 1);
+    mdf->unsized = NULL;
+}
+
+/** Parse the Maildir++ size fields of a message name: ",S=<size>" is the
+ * size of the file, ",W=<size>" the size with CRLF line endings.
+ * \param vsize Set to the W= size, or to the S= one if there's none.
+ * \return 1 - the S= field is there, 0 - it is not.
+ */
+static int message_parse_size(const char *name, long long *size,
+	long long *vsize)
+{
+    int ret = 0, have_vsize = 0;
+
+    /* The fields are before the info (":2,..."). */
+    for (const char *p = name; (p = strpbrk(p, ",:")) && *p == ','; p++) {
+	if ((p[1] == 'S' || p[1] == 'W') && p[2] == '=') {
+	    char *end;
+	    long long val = strtoll(p + 3, &end, 10);
+	    if (end == p + 3)
+		continue;
+
+	    if (p[1] == 'S') {
+		*size = val; ret = 1;
+	    } else {
+		*vsize = val; have_vsize = 1;
+	    }
 	}
+    }
+
+    if (ret && !have_vsize)
+	*vsize = *size;
+
+    return ret;
+}
+
+/** Maildir flag characters to MF_* flags. All letters are marked with
+ * FLAG_LETTER, so that the info can be found by scanning back over them. */
+#define FLAG_LETTER 0x80
+#define L FLAG_LETTER
+#define P MF_PASSED
+#define R MF_REPLIED
+#define S MF_SEEN
+#define T MF_TRASHED
+#define D MF_DRAFT
+#define F MF_FLAGGED
+static const unsigned char flag_table[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, L, L, L, D|L, L, F|L, L, L, L, L, L, L, L, L, L,
+    P|L, L, R|L, S|L, T|L, L, L, L, L, L, L, 0, 0, 0, 0, 0,
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L,
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, 0,
+    /* 0x80 - 0xff are zero. */
+};
+#undef L
+#undef P
+#undef R
+#undef S
+#undef T
+#undef D
+#undef F
+
+/** Parse flags of a message. The info (":2,<flags>") is at the end of the
+ * name, so we look for it from there.
+ * \param len Length of the name.
+ */
+static int message_parse_flags(const char *name, size_t len)
+{
+    const char *p = name + len;
+    int ret = 0;
+
+    while (p > name && flag_table[(unsigned char) p[-1]])
+	ret |= flag_table[(unsigned char) *--p];
+
+    if (p - name < 3 || p[-3] != ':' || p[-2] != '2' || p[-1] != ',')
+	return MF_NEW;
+    ret &= ~FLAG_LETTER;
 
     /* A message is considered new, if it's not seen nor trashed. */
-    if (! (ret & (MF_SEEN | MF_TRASHED)))
+    if (!(ret & (MF_SEEN | MF_TRASHED)))
 	ret |= MF_NEW;
 
     return ret;
@@ -674,39 +2020,339 @@ static int message_parse_flags(const char *name)
 
 /** Fill the message structure with the needed info.
  *
- * \return  0 - ok.
+ * \param fd The message opened already (closed here), -1 to open #path.
+ * \return >=0 - ok, number of header bytes read.
  *         -1 - message ceased to exist.
  */
-static int message_open(struct message *msg)
+static int message_open(struct maildirpp *md, struct message *msg, int fd)
 {
-    FILE *m = fopen(msg->path, "r");
-    if (m == NULL)
+    PROBE1(message__parse__start, msg->path);
+
+    FILE *m = NULL;
+    if (fd == -1)
+	m = fopen(msg->path, "r");
+    else if (!(m = fdopen(fd, "r")))
+	close(fd);
+    if (m == NULL) {
+	PROBE2(message__parse__end, msg->path, -1);
 	return -1;
+    }
 
-    /* Parse flags */
-    msg->flags = message_parse_flags(msg->name);
-
-    /* Parse message id, references and in-reply-tos. */
-    read_rfc822_header(m, msg);
+    /* Parse message id, references and in-reply-tos, and the extra
+     * fields. */
+    read_rfc822_header(m, msg, md->fields);
 
+    long bytes = ftell(m);
     fclose(m);
+    PROBE2(message__parse__end, msg->path, bytes);
+
+    return bytes < 0 ? 0 : bytes;
+}
+
+/** Read the headers of a message, without indexing it.
+ *
+ * \param msg The message, with #path set. The caller owns it, free the
+ *   data read with #maildirpp_message_clear.
+ * \return 0 - ok, -1 - the message is gone.
+ */
+int maildirpp_message_read(struct maildirpp *md, struct message *msg)
+{
+    return message_read_fd(md, msg, -1);
+}
+
+/** #maildirpp_message_read from a file opened already.
+ * \param fd Of the message, closed here. -1 to open #path.
+ */
+static int message_read_fd(struct maildirpp *md, struct message *msg,
+	int fd)
+{
+    struct maildirpp_counters *c = &md->counters;
+
+    long long start = now_usec();
+    int bytes = message_open(md, msg, fd);
+    c->parse_time += now_usec() - start;
+
+    if (bytes == -1) {
+	c->msgs_vanished++;
+	return -1;
+    }
+
+    c->msgs_parsed++;
+    c->hdr_bytes += bytes;
 
     return 0;
 }
 
-/** struct message destructor. */
-static void message_free(struct message *msg)
+/** Compare messages by inode number, for #messages_read_sorted. */
+static int message_compare_ino(struct message **a, struct message **b)
 {
-    if (msg->path)
-	g_free(msg->path);
-    if (msg->msg_id)
+    return (*a)->ino < (*b)->ino ? -1 : (*a)->ino > (*b)->ino;
+}
+
+/** Read the headers of messages in the order of their inode numbers, which
+ * follows their placement on the disk much better than the readdir order.
+ * The next #MAILDIR_READAHEAD messages are kept open with their headers
+ * requested by posix_fadvise, so the disk gets the reads ahead of time and
+ * mostly in ascending order. Messages which are gone are freed and
+ * replaced by NULL.
+ * \param msgs List of struct message, sorted here.
+ */
+static void messages_read_sorted(struct maildirpp *md, GPtrArray *msgs)
+{
+    int fds[MAILDIR_READAHEAD];
+    int n = msgs->len;
+
+    g_ptr_array_sort(msgs, (GCompareFunc) message_compare_ino);
+
+    for (int i = 0; i < n + MAILDIR_READAHEAD; i++) {
+	/* Read the message opened #MAILDIR_READAHEAD steps ago, freeing
+	 * its slot. */
+	if (i >= MAILDIR_READAHEAD) {
+	    int j = i - MAILDIR_READAHEAD;
+	    int fd = fds[j % MAILDIR_READAHEAD];
+	    struct message *msg = g_ptr_array_index(msgs, j);
+	    if (fd == -1)
+		md->counters.msgs_vanished++;
+	    if (fd == -1 || message_read_fd(md, msg, fd)) {
+		message_free_and_free(msg);
+		g_ptr_array_index(msgs, j) = NULL;
+	    }
+	}
+
+	if (i < n) {
+	    struct message *msg = g_ptr_array_index(msgs, i);
+	    int fd = open(msg->path, O_RDONLY | O_CLOEXEC);
+	    if (fd != -1)
+		posix_fadvise(fd, 0, MAILDIR_READAHEAD_BYTES,
+			POSIX_FADV_WILLNEED);
+	    fds[i % MAILDIR_READAHEAD] = fd;
+	}
+    }
+}
+
+/** Free what #maildirpp_message_read read, not the #path. */
+void maildirpp_message_clear(struct message *msg)
+{
+    if (msg->msg_id) {
 	g_free(msg->msg_id);
+	msg->msg_id = NULL;
+    }
     if (msg->references) {
 	g_ptr_array_foreach(msg->references, (GFunc) g_free, 0);
 	g_ptr_array_free(msg->references, 1);
+	msg->references = NULL;
+    }
+    g_free(msg->fields);
+    msg->fields = NULL;
+    msg->n_fields = 0;
+    msg->date = 0;
+}
+
+/** Have an extra header field, e.g. "Subject", read with the headers of
+ * the messages. Its value is then in message.fields. Add the fields before
+ * filling the folders, messages read before don't have them.
+ * \return Index of the field, for #maildir_message_field.
+ */
+int maildirpp_header_field(struct maildirpp *md, const char *name)
+{
+    if (!md->fields)
+	md->fields = g_ptr_array_new();
+
+    for (int i = 0; i < md->fields->len; i++)
+	if (!strcasecmp(g_ptr_array_index(md->fields, i), name))
+	    return i;
+
+    g_ptr_array_add(md->fields, g_strdup(name));
+    return md->fields->len - 1;
+}
+
+/** Get the value of an extra header field of a message.
+ * \param field Index from #maildirpp_header_field.
+ * \return The value, "" if the message has no such field, NULL if it
+ *   hasn't been read.
+ */
+const char *maildir_message_field(const struct message *msg, int field)
+{
+    const char *p = msg->fields;
+
+    if (field >= msg->n_fields)
+	return NULL;
+    while (field-- > 0)
+	p += strlen(p) + 1;
+
+    return p;
+}
+
+/** The time messages are sorted by: of the Date: field if known. */
+static time_t message_sort_date(const struct message *msg)
+{
+    return msg->date ? msg->date : msg->delivered;
+}
+
+/** Skip the "Re:"s and "Fwd:"s (and the likes) a subject starts with. */
+static const char *subject_base(const char *s)
+{
+    static const char *const prefixes[] = { "re:", "fwd:", "fw:", "aw:" };
+    int i;
+
+    if (!s)
+	return "";
+
+    do {
+	while (isspace((unsigned char) *s))
+	    s++;
+	for (i = 0; i < G_N_ELEMENTS(prefixes); i++)
+	    if (!strncasecmp(s, prefixes[i], strlen(prefixes[i]))) {
+		s += strlen(prefixes[i]);
+		break;
+	    }
+    } while (i < G_N_ELEMENTS(prefixes));
+
+    return s;
+}
+
+/** The thread of a message, the msg_id of its first message. */
+static const char *message_thread(const struct message *msg)
+{
+    if (msg->references && msg->references->len > 0)
+	return (const char *) g_ptr_array_index(msg->references, 0);
+    return msg->msg_id ? msg->msg_id : "";
+}
+
+/** Order of MV_DATE. Equal messages are ordered by their address, which
+ * doesn't change by renames. */
+static int view_compare_date(const struct message *a,
+	const struct message *b, struct maildirpp *md)
+{
+    time_t ta = message_sort_date(a), tb = message_sort_date(b);
+
+    if (ta != tb)
+	return ta < tb ? -1 : 1;
+    return a < b ? -1 : a > b;
+}
+
+/** Order of MV_FROM, then by date. */
+static int view_compare_from(const struct message *a,
+	const struct message *b, struct maildirpp *md)
+{
+    const char *fa = maildir_message_field(a, md->from_field),
+	       *fb = maildir_message_field(b, md->from_field);
+    int ret = strcasecmp(fa ? fa : "", fb ? fb : "");
+
+    return ret ? ret : view_compare_date(a, b, md);
+}
+
+/** Order of MV_SUBJECT, then by date. */
+static int view_compare_subject(const struct message *a,
+	const struct message *b, struct maildirpp *md)
+{
+    int ret = strcasecmp(
+	    subject_base(maildir_message_field(a, md->subject_field)),
+	    subject_base(maildir_message_field(b, md->subject_field)));
+
+    return ret ? ret : view_compare_date(a, b, md);
+}
+
+/** Order of MV_THREAD, then by date. */
+static int view_compare_thread(const struct message *a,
+	const struct message *b, struct maildirpp *md)
+{
+    int ret = strcmp(message_thread(a), message_thread(b));
+
+    return ret ? ret : view_compare_date(a, b, md);
+}
+
+/** The orders of the views, by enum maildir_view. */
+static const GCompareDataFunc view_compare[MV_COUNT] = {
+    [MV_DATE] = (GCompareDataFunc) view_compare_date,
+    [MV_FROM] = (GCompareDataFunc) view_compare_from,
+    [MV_SUBJECT] = (GCompareDataFunc) view_compare_subject,
+    [MV_THREAD] = (GCompareDataFunc) view_compare_thread
+};
+
+/** Keep sorted views of the messages of folders, in maildir_folder.views.
+ * They're updated as the messages are indexed and removed, so the folders
+ * needn't be sorted after each fill. The header fields the views need are
+ * added to maildirpp.fields; set the views before filling the folders.
+ * Views of folders filled already are rebuilt.
+ * \param views Mask of (1 << enum maildir_view).
+ */
+void maildirpp_set_views(struct maildirpp *md, int views)
+{
+    md->views = views & ((1 << MV_COUNT) - 1);
+
+    if (md->views & (1 << MV_FROM))
+	md->from_field = maildirpp_header_field(md, "From");
+    if (md->views & (1 << MV_SUBJECT))
+	md->subject_field = maildirpp_header_field(md, "Subject");
+    if (md->views)
+	maildirpp_header_field(md, "Date");
+
+    for (int i = 0; i < md->subfolders->len; i++) {
+	struct maildir_folder *mdf =
+	    (struct maildir_folder *) g_ptr_array_index(md->subfolders, i);
+	for (int v = 0; v < MV_COUNT; v++)
+	    if (mdf->views[v]) {
+		g_tree_destroy(mdf->views[v]);
+		mdf->views[v] = NULL;
+	    }
+	if (mdf->messages && md->views)
+	    g_tree_foreach(mdf->messages, (GTraverseFunc) message_to_views,
+		    mdf);
+    }
+}
+
+/** Add a message to the views of the folder, creating those missing. */
+static void maildir_folder_views_add(struct maildir_folder *mdf,
+	struct message *msg)
+{
+    struct maildirpp *md = mdf->md;
+
+    for (int v = 0; v < MV_COUNT; v++) {
+	if (!(md->views & (1 << v)))
+	    continue;
+	if (!mdf->views[v])
+	    mdf->views[v] = g_tree_new_full(view_compare[v], md, NULL, NULL);
+	g_tree_insert(mdf->views[v], msg, msg);
     }
 }
 
+/** Helper for #maildirpp_set_views, a g_tree_foreach function. */
+static gboolean message_to_views(char *key, struct message *value,
+	struct maildir_folder *mdf)
+{
+    maildir_folder_views_add(mdf, value);
+    return FALSE;
+}
+
+/** Index a message added to the folder's #messages: by msg_id and in the
+ * views. */
+static void maildir_folder_index(struct maildir_folder *mdf,
+	struct message *msg)
+{
+    maildirpp_msgid_add(mdf, msg);
+    if (mdf->md->views)
+	maildir_folder_views_add(mdf, msg);
+}
+
+/** Undo #maildir_folder_index, for a message leaving #messages. */
+static void maildir_folder_unindex(struct maildir_folder *mdf,
+	struct message *msg)
+{
+    maildirpp_msgid_remove(mdf, msg);
+    for (int v = 0; v < MV_COUNT; v++)
+	if (mdf->views[v])
+	    g_tree_remove(mdf->views[v], msg);
+}
+
+/** struct message destructor. */
+static void message_free(struct message *msg)
+{
+    if (msg->path)
+	g_free(msg->path);
+    maildirpp_message_clear(msg);
+}
+
 /** Destruct <code>struct message</code> and free the memory occupied by the
  * struct itself.
  */
@@ -716,33 +2362,235 @@ static void message_free_and_free(struct message *msg)
     g_slice_free(struct message, msg);
 }
 
-/** Prepare folder for message indexing:
- * Save the current #messages map to #old_messages,
- * alloc new #messages.
- */
-static void maildir_folder_messages_prepare(struct maildir_folder *mdf)
+/** Estimate the memory taken by a message in #messages, with the headers
+ * read and its share of the trees and indexes. */
+static long long message_bytes(const struct message *msg)
 {
-    mdf->old_messages = mdf->messages;
-    mdf->messages = g_tree_new_full((GCompareDataFunc) strcmp, 0,
-	    NULL, /* key is a part of the value */
-	    (GDestroyNotify) message_free_and_free);
+    long long bytes = sizeof(struct message) + MESSAGE_NODE_BYTES +
+	strlen(msg->path) + 1;
+
+    if (msg->msg_id)
+	bytes += strlen(msg->msg_id) + 1;
+    if (msg->references) {
+	bytes += sizeof(GPtrArray) + msg->references->len * sizeof(void *);
+	for (int i = 0; i < msg->references->len; i++)
+	    bytes += strlen(g_ptr_array_index(msg->references, i)) + 1;
+    }
+    const char *f = msg->fields;
+    for (int i = 0; i < msg->n_fields; i++) {
+	size_t len = strlen(f) + 1;
+	bytes += len;
+	f += len;
+    }
+
+    return bytes;
 }
 
-/** Clean up #old_messages. */
-static void maildir_folder_messages_post(struct maildir_folder *mdf)
+/** Sum up #message_bytes, g_tree_foreach helper. */
+static gboolean message_add_bytes(char *key, struct message *value,
+	long long *bytes)
 {
-    if (mdf->old_messages) {
-	g_tree_destroy(mdf->old_messages);
-	mdf->old_messages = NULL;
-    }
+    *bytes += message_bytes(value);
+    return FALSE;
 }
 
-/** Message indexing walker. */
-static void maildir_folder_messages_msg(
-	struct maildir_folder_walk_messages_params *params)
+/** Count bytes in (or out) the folder's #msgs_bytes and the maildir's
+ * total. */
+static void maildir_folder_account(struct maildir_folder *mdf,
+	long long delta)
+{
+    mdf->msgs_bytes += delta;
+    mdf->md->msgs_bytes += delta;
+}
+
+/** Move the folder to the end of the #msgs_lru list (or add it there). */
+static void maildir_folder_touch(struct maildir_folder *mdf)
+{
+    struct maildirpp *md = mdf->md;
+
+    if (mdf->msgs_lru.data)
+	g_queue_unlink(&md->msgs_lru, &mdf->msgs_lru);
+    mdf->msgs_lru.data = mdf;
+    g_queue_push_tail_link(&md->msgs_lru, &mdf->msgs_lru);
+}
+
+/** Free the folder's #messages and views, taking the messages out of the
+ * msg_id index and the folder out of the #msgs_lru list. */
+static void maildir_folder_messages_free(struct maildir_folder *mdf)
+{
+    struct maildirpp *md = mdf->md;
+
+    for (int v = 0; v < MV_COUNT; v++)
+	if (mdf->views[v]) {
+	    g_tree_destroy(mdf->views[v]);
+	    mdf->views[v] = NULL;
+	}
+    if (mdf->messages) {
+	if (md->msgid_index)
+	    g_tree_foreach(mdf->messages, (GTraverseFunc) message_unindex,
+		    mdf);
+	g_tree_destroy(mdf->messages);
+	mdf->messages = NULL;
+    }
+    maildir_folder_account(mdf, -mdf->msgs_bytes);
+    if (mdf->msgs_lru.data) {
+	g_queue_unlink(&md->msgs_lru, &mdf->msgs_lru);
+	mdf->msgs_lru.data = NULL;
+    }
+}
+
+/** Drop the folder's #messages to save memory, until
+ * #maildir_folder_messages needs them again. The changes of the last fill
+ * go with them. Just the names are kept, in #evicted_names, so that the
+ * next fill can tell what has changed. */
+static void maildir_folder_evict(struct maildir_folder *mdf)
+{
+    maildir_folder_changes_clear(mdf);
+    /* If it has been reloaded since the last fill, the older names are the
+     * ones to compare with. */
+    if (!mdf->evicted_names) {
+	mdf->evicted_names = g_hash_table_new_full(
+		(GHashFunc) message_unique_hash,
+		(GEqualFunc) message_unique_equal, g_free, NULL);
+	g_tree_foreach(mdf->messages, (GTraverseFunc) message_to_names,
+		mdf->evicted_names);
+    }
+    maildir_folder_messages_free(mdf);
+    mdf->evicted = mdf->walked;
+    mdf->md->counters.folder_evictions++;
+}
+
+/** Read the evicted messages of a folder again. The folder stays as dirty
+ * as it was, what has changed since the last fill is up to the next one to
+ * find: if it's dirty, #evicted_names stay for it to compare with. */
+static void maildir_folder_reload(struct maildir_folder *mdf)
+{
+    int dirty = mdf->dirty, walked = mdf->walked;
+    GHashTable *names = mdf->evicted_names;
+    GArray *no_funcs = g_array_new(0, 0, sizeof(void *));
+    GArray *msgs_funcs = g_array_new(0, 0,
+	    sizeof(maildir_folder_walk_messages_func));
+    maildir_folder_walk_messages_func mf = maildir_folder_messages_msg;
+    struct walk_batch *batch = g_new(struct walk_batch, 1);
+
+    g_array_append_val(msgs_funcs, mf);
+    mdf->md->counters.folder_reloads++;
+
+    mdf->evicted_names = NULL;
+    maildir_folder_messages_prepare(mdf);
+    maildir_folder_walk_messages(mdf, batch, msgs_funcs, no_funcs,
+	    mdf->evicted);
+    maildir_folder_messages_post(mdf);
+    maildirpp_trim_dirs(mdf->md);
+
+    mdf->dirty |= dirty;
+    mdf->walked = walked;
+    if (mdf->dirty)
+	mdf->evicted_names = names;
+    else if (names)
+	g_hash_table_destroy(names);
+
+    g_free(batch);
+    g_array_free(msgs_funcs, 1);
+    g_array_free(no_funcs, 1);
+}
+
+/** Evict the messages of the least recently used folders until they fit in
+ * maildirpp_options.msgs_budget. Folders of a priority above 0 (the INBOX),
+ * \a keep and the folders with changes not yet seen by the caller stay.
+ */
+static void maildirpp_trim_msgs(struct maildirpp *md,
+	struct maildir_folder *keep)
+{
+    if (md->opts.msgs_budget <= 0)
+	return;
+
+    GList *l = md->msgs_lru.head;
+    while (l && md->msgs_bytes > md->opts.msgs_budget) {
+	struct maildir_folder *mdf = (struct maildir_folder *) l->data;
+	l = l->next;
+
+	if (mdf == keep || mdf->priority > 0 ||
+		(mdf->changes && mdf->changes->len > 0))
+	    continue;
+	maildir_folder_evict(mdf);
+    }
+}
+
+/** Get the messages of a folder filled with MFD_MSGS, reading them again
+ * if they have been evicted to stay within maildirpp_options.msgs_budget,
+ * and mark the folder as recently used. With a budget, use this rather
+ * than #messages, which is NULL while evicted (and the evicted messages
+ * aren't in the views).
+ * \return The folder's #messages, NULL if it hasn't been filled with
+ *   MFD_MSGS.
+ */
+GTree *maildir_folder_messages(struct maildir_folder *mdf)
+{
+    if (mdf->evicted)
+	maildir_folder_reload(mdf);
+    if (mdf->messages) {
+	maildir_folder_touch(mdf);
+	maildirpp_trim_msgs(mdf->md, mdf);
+    }
+
+    return mdf->messages;
+}
+
+/** Prepare folder for message indexing:
+ * Save the current #messages map to #old_messages,
+ * alloc new #messages.
+ */
+static void maildir_folder_messages_prepare(struct maildir_folder *mdf)
+{
+    mdf->old_messages = mdf->messages;
+    mdf->messages = g_tree_new_full((GCompareDataFunc) strcmp, 0,
+	    NULL, /* key is a part of the value */
+	    (GDestroyNotify) message_free_and_free);
+    mdf->unmatched = g_ptr_array_new();
+}
+
+/** Match the renamed messages, index the new ones and clean up
+ * #old_messages. */
+static void maildir_folder_messages_post(struct maildir_folder *mdf)
+{
+    maildir_folder_messages_match(mdf);
+    g_ptr_array_free(mdf->unmatched, 1);
+    mdf->unmatched = NULL;
+
+    /* Evicted since the last fill: all the messages have just been read,
+     * the changes are those from the names kept. */
+    if (mdf->evicted_names) {
+	if (mdf->changes) {
+	    maildir_folder_changes_clear(mdf);
+	    mdf->changes = g_array_new(0, 0, sizeof(struct maildir_change));
+	    maildir_folder_changes_evicted(mdf);
+	}
+	g_hash_table_destroy(mdf->evicted_names);
+	mdf->evicted_names = NULL;
+    }
+
+    if (mdf->old_messages) {
+	g_tree_destroy(mdf->old_messages);
+	mdf->old_messages = NULL;
+    }
+
+    long long bytes = 0;
+    g_tree_foreach(mdf->messages, (GTraverseFunc) message_add_bytes, &bytes);
+    maildir_folder_account(mdf, bytes - mdf->msgs_bytes);
+    mdf->evicted = 0;
+    maildir_folder_touch(mdf);
+}
+
+/** Message indexing walker. Messages found in #old_messages under the
+ * same name are moved over, the others are left to
+ * #maildir_folder_messages_match. */
+static void maildir_folder_messages_msg(
+	struct maildir_folder_walk_messages_params *params)
 {
     char *key;
     struct message *value;
+    struct maildirpp_counters *c = &params->mdf->md->counters;
 
     if (params->mdf->old_messages &&
 	    g_tree_lookup_extended(params->mdf->old_messages,
@@ -751,17 +2599,1007 @@ static void maildir_folder_messages_msg(
 	 * changed since. */
 	g_tree_steal(params->mdf->old_messages, key);
 	g_tree_insert(params->mdf->messages, key, value);
+	c->msgs_reused++;
     } else {
-	/* New message, index it. */
+	/* New or renamed message, match it later. */
 	value = g_slice_new0(struct message);
 	value->path = g_strdup(params->msg_full_path);
 	value->name = value->path +
 	    strlen(params->msg_full_path) - strlen(params->msg_name);
-	key = value->name;
+	value->flags = params->msg_flags;
+	value->subdir = params->msg_subdir;
+	value->delivered = params->msg_delivered;
+	value->ino = params->msg_ino;
+	g_ptr_array_add(params->mdf->unmatched, value);
+    }
+}
+
+/** Hash the unique part of a message name, up to the ':'. */
+static guint message_unique_hash(const char *name)
+{
+    guint h = 5381;
+    for (; *name && *name != ':'; name++)
+	h = h * 33 + (unsigned char) *name;
+    return h;
+}
+
+/** Compare the unique parts of message names. */
+static gboolean message_unique_equal(const char *a, const char *b)
+{
+    for (; *a == *b; a++, b++)
+	if (!*a || *a == ':')
+	    return TRUE;
+    return (!*a || *a == ':') && (!*b || *b == ':');
+}
+
+/** Remove a message from the msg_id index, g_tree_foreach helper. */
+static gboolean message_unindex(char *key, struct message *value,
+	struct maildir_folder *mdf)
+{
+    maildirpp_msgid_remove(mdf, value);
+    return FALSE;
+}
+
+/** Add a message to a hash, g_tree_foreach helper. */
+static gboolean message_to_hash(char *key, struct message *value,
+	GHashTable *hash)
+{
+    g_hash_table_insert(hash, key, value);
+    return FALSE;
+}
+
+/** Add a message to an array, g_tree_foreach helper. */
+static gboolean message_to_array(char *key, struct message *value,
+	GPtrArray *array)
+{
+    g_ptr_array_add(array, value);
+    return FALSE;
+}
+
+/** Add the name and subdir of a message to a hash, g_tree_foreach
+ * helper. */
+static gboolean message_to_names(char *key, struct message *value,
+	GHashTable *names)
+{
+    g_hash_table_insert(names, g_strdup(key),
+	    GINT_TO_POINTER(value->subdir));
+    return FALSE;
+}
+
+/** Sort out the messages not found by name: Those renamed (found by the
+ * unique part of the name among the messages left in #old_messages) take
+ * over the old message's headers, the rest is indexed. What's left in
+ * #old_messages then is gone.
+ *
+ * Only the changed messages are looked at here, as all the others have
+ * been moved from #old_messages to #messages by the walker.
+ */
+static void maildir_folder_messages_match(struct maildir_folder *mdf)
+{
+    struct maildirpp_counters *c = &mdf->md->counters;
+    GHashTable *gone = NULL;
+    GPtrArray *added = g_ptr_array_new();
+
+    if (mdf->unmatched->len > 0 && mdf->old_messages &&
+	    g_tree_nnodes(mdf->old_messages) > 0) {
+	gone = g_hash_table_new((GHashFunc) message_unique_hash,
+		(GEqualFunc) message_unique_equal);
+	g_tree_foreach(mdf->old_messages, (GTraverseFunc) message_to_hash,
+		gone);
+    }
 
-	if (message_open(value) == -1)
+    for (int i = 0; i < mdf->unmatched->len; i++) {
+	struct message *value =
+	    (struct message *) g_ptr_array_index(mdf->unmatched, i);
+	struct message *old = gone ?
+	    (struct message *) g_hash_table_lookup(gone, value->name) : NULL;
+
+	if (old) {
+	    /* Renamed: the headers are still the same. */
+	    g_hash_table_remove(gone, old->name);
+	    g_tree_steal(mdf->old_messages, old->name);
+	    maildir_folder_unindex(mdf, old);
+	    value->msg_id = old->msg_id;
+	    value->references = old->references;
+	    value->fields = old->fields;
+	    value->n_fields = old->n_fields;
+	    value->date = old->date;
+	    old->msg_id = NULL;
+	    old->references = NULL;
+	    old->fields = NULL;
+	    g_tree_insert(mdf->messages, value->name, value);
+	    maildir_folder_index(mdf, value);
+	    c->msgs_reused++;
+
+	    int type = (value->subdir != old->subdir ? MC_MOVED : 0) |
+		((value->flags & ~MF_NEW) != (old->flags & ~MF_NEW) ?
+		 MC_FLAGS : 0);
+	    if (mdf->changes && type)
+		maildir_folder_changes_add(mdf, type, value, old);
+	    else
+		message_free_and_free(old);
+	    continue;
+	}
+
+	/* New message, read it (now or in the inode order) and index it. */
+	if (mdf->md->opts.flags & MDO_INODE_ORDER)
+	    g_ptr_array_add(added, value);
+	else if (maildirpp_message_read(mdf->md, value))
 	    message_free_and_free(value);
 	else
-	    g_tree_insert(params->mdf->messages, key, value);
+	    g_ptr_array_add(added, value);
+    }
+
+    if (gone)
+	g_hash_table_destroy(gone);
+
+    if (mdf->md->opts.flags & MDO_INODE_ORDER)
+	messages_read_sorted(mdf->md, added);
+    for (int i = 0; i < added->len; i++) {
+	struct message *value =
+	    (struct message *) g_ptr_array_index(added, i);
+	if (!value)
+	    continue;
+	g_tree_insert(mdf->messages, value->name, value);
+	maildir_folder_index(mdf, value);
+	if (mdf->changes)
+	    maildir_folder_changes_add(mdf, MC_ADDED, value, NULL);
+    }
+    g_ptr_array_free(added, 1);
+
+    /* The rest is gone. */
+    if ((mdf->changes || mdf->md->msgid_index || mdf->md->views) &&
+	    mdf->old_messages) {
+	GPtrArray *removed = g_ptr_array_new();
+	g_tree_foreach(mdf->old_messages, (GTraverseFunc) message_to_array,
+		removed);
+	for (int i = 0; i < removed->len; i++) {
+	    struct message *old =
+		(struct message *) g_ptr_array_index(removed, i);
+	    maildir_folder_unindex(mdf, old);
+	    if (mdf->changes) {
+		g_tree_steal(mdf->old_messages, old->name);
+		maildir_folder_changes_add(mdf, MC_REMOVED, NULL, old);
+	    }
+	}
+	g_ptr_array_free(removed, 1);
+    }
+}
+
+/** Start recording the changes of a folder's messages. */
+static void maildir_folder_changes_prepare(struct maildir_folder *mdf)
+{
+    maildir_folder_changes_clear(mdf);
+    mdf->changes = g_array_new(0, 0, sizeof(struct maildir_change));
+}
+
+/** Free the list of changes. */
+static void maildir_folder_changes_clear(struct maildir_folder *mdf)
+{
+    if (!mdf->changes)
+	return;
+
+    for (int i = 0; i < mdf->changes->len; i++) {
+	struct maildir_change *ch =
+	    &g_array_index(mdf->changes, struct maildir_change, i);
+	if (ch->old)
+	    message_free_and_free(ch->old);
+    }
+    g_array_free(mdf->changes, 1);
+    mdf->changes = NULL;
+}
+
+/** Record a change, taking over \a old. */
+static void maildir_folder_changes_add(struct maildir_folder *mdf, int type,
+	struct message *msg, struct message *old)
+{
+    struct maildir_change ch = { .type = type, .msg = msg, .old = old };
+    g_array_append_val(mdf->changes, ch);
+}
+
+/** Make a message of the given name, without the headers, for a change of
+ * an evicted message. */
+static struct message *message_from_name(struct maildir_folder *mdf,
+	const char *name, int subdir)
+{
+    struct message *msg = g_slice_new0(struct message);
+
+    msg->path = g_strconcat(mdf->path, subdir == SD_NEW ? "/new/" :
+	    "/cur/", name, NULL);
+    msg->name = msg->path + strlen(msg->path) - strlen(name);
+    msg->flags = message_parse_flags(name, strlen(name));
+    msg->subdir = subdir;
+    msg->delivered = message_parse_time(name);
+    return msg;
+}
+
+/** Record the changes of a folder read again after an eviction, by
+ * comparing its #messages with the #evicted_names. The old messages of the
+ * changes have no headers. */
+static void maildir_folder_changes_evicted(struct maildir_folder *mdf)
+{
+    GPtrArray *msgs = g_ptr_array_new();
+    char *name;
+    void *subdir;
+
+    g_tree_foreach(mdf->messages, (GTraverseFunc) message_to_array, msgs);
+    for (int i = 0; i < msgs->len; i++) {
+	struct message *msg = (struct message *) g_ptr_array_index(msgs, i);
+
+	if (!g_hash_table_lookup_extended(mdf->evicted_names, msg->name,
+		    (void **) &name, &subdir)) {
+	    maildir_folder_changes_add(mdf, MC_ADDED, msg, NULL);
+	    continue;
+	}
+
+	struct message *old = message_from_name(mdf, name,
+		GPOINTER_TO_INT(subdir));
+	int type = (msg->subdir != old->subdir ? MC_MOVED : 0) |
+	    ((msg->flags & ~MF_NEW) != (old->flags & ~MF_NEW) ? MC_FLAGS : 0);
+	if (type)
+	    maildir_folder_changes_add(mdf, type, msg, old);
+	else
+	    message_free_and_free(old);
+	g_hash_table_remove(mdf->evicted_names, msg->name);
+    }
+    g_ptr_array_free(msgs, 1);
+
+    /* The rest is gone. */
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, mdf->evicted_names);
+    while (g_hash_table_iter_next(&iter, (void **) &name, &subdir))
+	maildir_folder_changes_add(mdf, MC_REMOVED, NULL,
+		message_from_name(mdf, name, GPOINTER_TO_INT(subdir)));
+}
+
+/** Add an entry to a set of expected changes, see #maildir_folder_expect.
+ * The notifications so far are processed before the set is created. */
+static void expect_add(struct maildirpp_ctx *ctx, GHashTable **expected,
+	const char *name, int mask)
+{
+    if (!*expected) {
+	notify_read(ctx);
+	*expected = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 0);
+    }
+
+    mask |= GPOINTER_TO_INT(g_hash_table_lookup(*expected, name));
+    g_hash_table_insert(*expected, g_strdup(name), GINT_TO_POINTER(mask));
+}
+
+/** Process the notifications of the expected changes and forget them. */
+static void expect_end(struct maildirpp_ctx *ctx, GHashTable **expected)
+{
+    if (!*expected)
+	return;
+
+    notify_read(ctx);
+    g_hash_table_destroy(*expected);
+    *expected = NULL;
+}
+
+/** Don't let the notifications of a change of the entry \a name in the
+ * given subdir make the folder dirty. For changes made by the library
+ * itself, which keeps the folder's data up to date. The notifications so
+ * far are processed first, so that only ours are ignored; call
+ * #maildir_folder_expect_end once the changes are done.
+ */
+void maildir_folder_expect(struct maildir_folder *mdf, const char *name,
+	int subdir)
+{
+    expect_add(mdf->md->ctx, &mdf->expected, name, subdir);
+}
+
+/** Swallow the notifications of the changes announced by
+ * #maildir_folder_expect. */
+void maildir_folder_expect_end(struct maildir_folder *mdf)
+{
+    expect_end(mdf->md->ctx, &mdf->expected);
+}
+
+/** Like #maildir_folder_expect, for the entry \a name of the maildir++
+ * itself, e.g. the maildirsize file. */
+void maildirpp_expect(struct maildirpp *md, const char *name)
+{
+    expect_add(md->ctx, &md->expected, name, 1);
+}
+
+/** Swallow the notifications of the changes announced by
+ * #maildirpp_expect. */
+void maildirpp_expect_end(struct maildirpp *md)
+{
+    expect_end(md->ctx, &md->expected);
+}
+
+/** Count a message in (sign = 1) or out (sign = -1) of a stats delta, by
+ * its name. Its delivery time goes to (or from) the folder's histograms
+ * right away, if the folder has stats. */
+static void maildir_folder_stats_msg(struct maildir_folder *mdf,
+	const char *name, struct maildir_folder_stats *delta, int sign)
+{
+    int flags = message_parse_flags(name, strlen(name));
+    time_t delivered = message_parse_time(name);
+    long long size, vsize;
+
+    maildir_folder_stats_flags(delta, flags, sign);
+    if (message_parse_size(name, &size, &vsize)) {
+	delta->size += sign * size;
+	delta->vsize += sign * vsize;
+    } else
+	delta->unsized += sign;
+
+    if (mdf->stats && delivered) {
+	if (sign > 0)
+	    maildir_folder_stats_time(mdf->stats, delivered, flags & MF_NEW);
+	else
+	    maildir_folder_stats_untime(mdf->stats, delivered);
+    }
+}
+
+/** Put a message which has just appeared in a subdir of the folder to its
+ * #messages and the msg_id index, if the folder has them.
+ * \param msg The message as it was in another folder, taken out of there,
+ *   or NULL to read the headers. It's the folder's (or freed) now.
+ * \return 0 - ok, -1 - the message is gone.
+ */
+static int maildir_folder_put_message(struct maildir_folder *mdf,
+	const char *name, int subdir, struct message *msg)
+{
+    size_t len = strlen(name);
+
+    if (!mdf->messages || g_tree_lookup(mdf->messages, name)) {
+	if (msg)
+	    message_free_and_free(msg);
+	return 0;
+    }
+
+    int read = !msg;
+    if (read) {
+	msg = g_slice_new0(struct message);
+	msg->flags = message_parse_flags(name, len);
+	msg->delivered = message_parse_time(name);
+    } else
+	g_free(msg->path);
+    msg->path = g_strconcat(mdf->path, subdir == SD_NEW ? "/new/" : "/cur/",
+	    name, NULL);
+    msg->name = msg->path + strlen(msg->path) - len;
+    msg->subdir = subdir;
+
+    if (read && maildirpp_message_read(mdf->md, msg)) {
+	message_free_and_free(msg);
+	return -1;
+    }
+    g_tree_insert(mdf->messages, msg->name, msg);
+    maildir_folder_index(mdf, msg);
+    maildir_folder_account(mdf, message_bytes(msg));
+
+    return 0;
+}
+
+/** Take a message out of the folder's #messages and the msg_id index.
+ * \return The message (the caller's now), NULL if it isn't there.
+ */
+static struct message *maildir_folder_steal_message(
+	struct maildir_folder *mdf, const char *name)
+{
+    struct message *msg = mdf->messages ?
+	g_tree_lookup(mdf->messages, name) : NULL;
+
+    if (msg) {
+	g_tree_steal(mdf->messages, msg->name);
+	maildir_folder_unindex(mdf, msg);
+	maildir_folder_account(mdf, -message_bytes(msg));
+    }
+
+    return msg;
+}
+
+/** Count a message just delivered to the folder's new/ in its stats and add
+ * it to its #messages (reading the headers), if the folder has them. The
+ * delivery should be announced by #maildir_folder_expect.
+ * \return 0 - ok, -1 - the message is gone.
+ */
+int maildir_folder_add_message(struct maildir_folder *mdf, const char *name)
+{
+    if (maildir_folder_put_message(mdf, name, SD_NEW, NULL))
+	return -1;
+
+    if (mdf->stats) {
+	struct maildir_folder_stats delta = { 0 };
+
+	maildir_folder_stats_msg(mdf, name, &delta, 1);
+	maildir_folder_stats_add(mdf->stats, &delta, 1);
+	maildir_tree_update(mdf->node, &delta, 1);
+    }
+
+    return 0;
+}
+
+/** Parse Maildir flag letters, e.g. "ST".
+ * \return Mask of MF_* flags, -1 if there's an unknown letter.
+ */
+int maildir_flags_parse(const char *letters)
+{
+    int ret = 0;
+
+    for (; *letters; letters++) {
+	int f = flag_table[(unsigned char) *letters] & ~FLAG_LETTER;
+	if (!f)
+	    return -1;
+	ret |= f;
+    }
+
+    return ret;
+}
+
+/** Maildir flag characters, indexed by the bit of the MF_* flag. */
+static const char flag_letters[] = "PRSTDF";
+
+/** Make the name of a message with some flags set and others cleared. The
+ * other letters of the info are kept, all in ASCII order.
+ * \return The new name (g_free it), NULL if the name has some other info
+ *   than ":2,".
+ */
+static char *message_flags_name(const char *name, int set, int clear)
+{
+    size_t len = strlen(name);
+    const char *p = name + len;
+    size_t unique_len;
+
+    while (p > name && flag_table[(unsigned char) p[-1]])
+	p--;
+    if (p - name >= 3 && p[-3] == ':' && p[-2] == '2' && p[-1] == ',')
+	unique_len = p - 3 - name;
+    else if (strchr(name, ':'))
+	return NULL;
+    else
+	unique_len = len, p = name + len;
+
+    char letters[256] = { 0 };
+    for (; *p; p++)
+	letters[(unsigned char) *p] = 1;
+    for (int i = 0; flag_letters[i]; i++) {
+	if (clear & (1 << i))
+	    letters[(unsigned char) flag_letters[i]] = 0;
+	if (set & (1 << i))
+	    letters[(unsigned char) flag_letters[i]] = 1;
+    }
+
+    GString *s = g_string_sized_new(unique_len + 16);
+    g_string_append_len(s, name, unique_len);
+    g_string_append(s, ":2,");
+    for (int c = 0; c < 256; c++)
+	if (letters[c])
+	    g_string_append_c(s, c);
+
+    return g_string_free(s, FALSE);
+}
+
+/** Find the messages of a folder matching \a match and add them to \a todo
+ * (of struct bulk_msg). The folder's messages are used if they're up to
+ * date, the subdirs are read otherwise.
+ * \return 0 - ok, -1 - error.
+ */
+static int maildir_folder_select(struct maildir_folder *mdf,
+	bulk_match_func match, void *data, GArray *todo)
+{
+    struct bulk_msg r = { 0 };
+
+    if (mdf->messages && !mdf->dirty) {
+	GPtrArray *msgs = g_ptr_array_new();
+	g_tree_foreach(mdf->messages, (GTraverseFunc) message_to_array, msgs);
+	for (int i = 0; i < msgs->len; i++) {
+	    struct message *msg = (struct message *) g_ptr_array_index(msgs, i);
+	    if (!match(msg->flags, msg->delivered, data))
+		continue;
+	    r.subdir = msg->subdir;
+	    r.name = g_strdup(msg->name);
+	    g_array_append_val(todo, r);
+	}
+	g_ptr_array_free(msgs, 1);
+	return 0;
+    }
+
+    for (int sd = SD_NEW; sd <= SD_CUR; sd <<= 1) {
+	DIR *dir = maildir_folder_dir(mdf, sd);
+	struct dirent *dent;
+
+	if (!dir)
+	    return -1;
+	rewinddir(dir);
+
+	while (1) {
+	    errno = 0;
+	    if ((dent = readdir(dir)) == 0) {
+		if (errno == 0)
+		    break;
+		perror("readdir"); return -1;
+	    }
+
+	    if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+		continue;
+	    if (!match(message_parse_flags(dent->d_name, strlen(dent->d_name)),
+			message_parse_time(dent->d_name), data))
+		continue;
+
+	    r.subdir = sd;
+	    r.name = g_strdup(dent->d_name);
+	    g_array_append_val(todo, r);
+	}
+    }
+
+    return 0;
+}
+
+/** Add the messages of the given names to \a todo (of struct bulk_msg),
+ * finding out which subdir they're in.
+ * \return 0 - ok, -1 - error.
+ */
+static int maildir_folder_select_names(struct maildir_folder *mdf,
+	const char *const *names, int n_names, GArray *todo)
+{
+    struct bulk_msg r = { 0 };
+    DIR *cur = maildir_folder_dir(mdf, SD_CUR);
+
+    if (!cur)
+	return -1;
+
+    for (int i = 0; i < n_names; i++) {
+	struct message *msg = mdf->messages ?
+	    g_tree_lookup(mdf->messages, names[i]) : NULL;
+	struct stat st;
+
+	if (msg)
+	    r.subdir = msg->subdir;
+	else
+	    r.subdir = fstatat(dirfd(cur), names[i], &st,
+		    AT_SYMLINK_NOFOLLOW) ? SD_NEW : SD_CUR;
+	r.name = g_strdup(names[i]);
+	g_array_append_val(todo, r);
+    }
+
+    return 0;
+}
+
+static void bulk_msgs_free(GArray *todo)
+{
+    for (int i = 0; i < todo->len; i++) {
+	struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, i);
+	g_free(r->name);
+	g_free(r->new_name);
+    }
+    g_array_free(todo, 1);
+}
+
+/** Select the messages without MF_SEEN. */
+static int match_unread(int flags, time_t delivered, void *data)
+{
+    return !(flags & MF_SEEN);
+}
+
+/** Select all messages. */
+static int match_all(int flags, time_t delivered, void *data)
+{
+    return 1;
+}
+
+/** Update the folder's messages and the stats delta after a message has
+ * been renamed by #maildir_folder_set_flags. */
+static void maildir_folder_flags_renamed(struct maildir_folder *mdf,
+	const struct bulk_msg *r, struct maildir_folder_stats *delta)
+{
+    int old_flags = message_parse_flags(r->name, strlen(r->name));
+    int new_flags = message_parse_flags(r->new_name, strlen(r->new_name));
+
+    maildir_folder_stats_flags(delta, old_flags, -1);
+    maildir_folder_stats_flags(delta, new_flags, 1);
+
+    struct message *msg = mdf->messages ?
+	g_tree_lookup(mdf->messages, r->name) : NULL;
+    if (!msg)
+	return;
+
+    /* The struct stays the same, so does its place in the msg_id index. */
+    g_tree_steal(mdf->messages, msg->name);
+    maildir_folder_account(mdf, -message_bytes(msg));
+    g_free(msg->path);
+    msg->path = g_strconcat(mdf->path, "/cur/", r->new_name, NULL);
+    msg->name = msg->path + strlen(msg->path) - strlen(r->new_name);
+    msg->flags = new_flags;
+    msg->subdir = SD_CUR;
+    g_tree_insert(mdf->messages, msg->name, msg);
+    maildir_folder_account(mdf, message_bytes(msg));
+}
+
+/** Set and clear flags of messages of a folder, e.g. mark it all read.
+ * The messages are renamed to cur/ in batches, and the folder's #messages
+ * and #stats are updated in place, so the folder doesn't get dirty by our
+ * renames and doesn't need to be walked again. Of the stats, #oldest_new
+ * and #newest_new are left as they were.
+ *
+ * \param select One of enum maildir_select.
+ * \param names For MS_NAMES, the names of the messages (without the
+ *   subdir), \a n_names of them.
+ * \param set Mask of MF_* flags to be set.
+ * \param clear Mask of MF_* flags to be cleared.
+ * \return The number of renamed messages, -1 on error.
+ */
+int maildir_folder_set_flags(struct maildir_folder *mdf, int select,
+	const char *const *names, int n_names, int set, int clear)
+{
+    GArray *todo = g_array_new(0, 0, sizeof(struct bulk_msg));
+    struct maildir_folder_stats delta = { 0 };
+    int ret = -1;
+
+    set &= MF_NEW - 1;
+    clear &= MF_NEW - 1;
+
+    if (select == MS_NAMES ?
+	    maildir_folder_select_names(mdf, names, n_names, todo) :
+	    maildir_folder_select(mdf, select == MS_UNREAD ? match_unread :
+		match_all, NULL, todo))
+	goto out;
+
+    DIR *dirs[2] = { maildir_folder_dir(mdf, SD_NEW),
+		     maildir_folder_dir(mdf, SD_CUR) };
+    if (!dirs[0] || !dirs[1])
+	goto out;
+    int cur_fd = dirfd(dirs[1]);
+
+    ret = 0;
+    for (int i = 0; i < todo->len; i += MAILDIR_WALK_BATCH) {
+	int end = MIN(todo->len, i + MAILDIR_WALK_BATCH);
+
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    char *new_name = message_flags_name(r->name, set, clear);
+
+	    if (!new_name || (r->subdir == SD_CUR &&
+			!strcmp(new_name, r->name))) {
+		g_free(new_name);
+		continue;
+	    }
+
+	    maildir_folder_expect(mdf, r->name, r->subdir);
+	    maildir_folder_expect(mdf, new_name, SD_CUR);
+
+	    if (renameat(dirfd(dirs[r->subdir == SD_CUR]), r->name, cur_fd,
+			new_name)) {
+		/* Gone already is fine, the walk will see that. */
+		if (errno != ENOENT)
+		    perror(r->name);
+		g_free(new_name);
+		continue;
+	    }
+	    r->new_name = new_name;
+	    r->done = 1;
+	}
+
+	maildir_folder_expect_end(mdf);
+
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    if (r->done) {
+		maildir_folder_flags_renamed(mdf, r, &delta);
+		ret++;
+	    }
+	}
     }
+
+    if (mdf->stats) {
+	maildir_folder_stats_add(mdf->stats, &delta, 1);
+	maildir_tree_update(mdf->node, &delta, 1);
+    }
+
+out:
+    bulk_msgs_free(todo);
+    maildirpp_trim_dirs(mdf->md);
+
+    return ret;
+}
+
+/** Select the messages for #maildir_folder_expunge. */
+static int match_expunge(int flags, time_t delivered, void *data)
+{
+    struct expunge_match *m = (struct expunge_match *) data;
+
+    return (flags & m->flags) == m->flags &&
+	(!m->before || (delivered && delivered < m->before));
+}
+
+/** Unlink a batch of messages, in a worker thread. Messages without the S=
+ * field are stat-ed first, the quota needs their size. */
+static void expunge_batch_run(struct expunge_batch *b, void *unused)
+{
+    for (int i = 0; i < b->len; i++) {
+	struct bulk_msg *r = &b->msgs[i];
+	int fd = b->dir_fds[r->subdir == SD_CUR];
+	long long vsize;
+	struct stat st;
+	if (!message_parse_size(r->name, &r->size, &vsize))
+	    r->size = fstatat(fd, r->name, &st, 0) ? 0 : st.st_size;
+	if (!unlinkat(fd, r->name, 0))
+	    r->done = 1;
+	else if (errno != ENOENT)
+	    perror(r->name);
+    }
+}
+
+/** Remove an unlinked message from the folder's messages and count it out
+ * of the stats delta (and the delivery time histograms). */
+static void maildir_folder_expunged(struct maildir_folder *mdf,
+	const struct bulk_msg *r, struct maildir_folder_stats *delta)
+{
+    maildir_folder_stats_msg(mdf, r->name, delta, -1);
+
+    struct message *msg = maildir_folder_steal_message(mdf, r->name);
+    if (msg)
+	message_free_and_free(msg);
+}
+
+/** Remove the messages of a folder which have all the given flags (e.g.
+ * MF_TRASHED) and, optionally, were delivered before the given time. The
+ * messages are unlinked in batches by #maildirpp_options.io_threads
+ * threads, and the folder's #messages and #stats are updated in place, like
+ * with #maildir_folder_set_flags. Messages of unknown delivery time are
+ * kept if \a before is given. The freed size and count go to the
+ * maildirsize file, if there's one.
+ *
+ * \param flags Mask of MF_* flags, 0 to select by the time only.
+ * \param before Expunge messages delivered before this, 0 for all.
+ * \return The number of removed messages, -1 on error.
+ */
+int maildir_folder_expunge(struct maildir_folder *mdf, int flags,
+	time_t before)
+{
+    GArray *todo = g_array_new(0, 0, sizeof(struct bulk_msg));
+    struct maildir_folder_stats delta = { 0 };
+    struct expunge_match m = { .flags = flags, .before = before };
+    struct expunge_batch batches[MAILDIR_BULK_CHUNK / MAILDIR_WALK_BATCH];
+    struct maildirpp_ctx *ctx = mdf->md->ctx;
+    int threads = mdf->md->opts.io_threads > 0 ? mdf->md->opts.io_threads :
+	ctx->io_threads > 0 ? ctx->io_threads : MAILDIR_IO_THREADS;
+    long long freed = 0;
+    int ret = -1;
+
+    if (maildir_folder_select(mdf, match_expunge, &m, todo))
+	goto out;
+
+    DIR *dirs[2] = { maildir_folder_dir(mdf, SD_NEW),
+		     maildir_folder_dir(mdf, SD_CUR) };
+    if (!dirs[0] || !dirs[1])
+	goto out;
+
+    /* Work by chunks, so our notifications don't overflow the inotify
+     * queue (and get lost, along with the others). */
+    ret = 0;
+    for (int i = 0; i < todo->len; i += MAILDIR_BULK_CHUNK) {
+	int end = MIN(todo->len, i + MAILDIR_BULK_CHUNK);
+	int n = 0;
+
+	for (int j = i; j < end; j += MAILDIR_WALK_BATCH, n++) {
+	    batches[n].dir_fds[0] = dirfd(dirs[0]);
+	    batches[n].dir_fds[1] = dirfd(dirs[1]);
+	    batches[n].msgs = &g_array_index(todo, struct bulk_msg, j);
+	    batches[n].len = MIN(end - j, MAILDIR_WALK_BATCH);
+	}
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    maildir_folder_expect(mdf, r->name, r->subdir);
+	}
+
+	ctx_run(ctx, threads, (GFunc) expunge_batch_run, batches,
+		sizeof(batches[0]), n);
+
+	maildir_folder_expect_end(mdf);
+
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    if (r->done) {
+		maildir_folder_expunged(mdf, r, &delta);
+		freed += r->size;
+		ret++;
+	    }
+	}
+    }
+
+    if (mdf->stats) {
+	maildir_folder_stats_add(mdf->stats, &delta, 1);
+	maildir_tree_update(mdf->node, &delta, 1);
+    }
+    if (ret > 0)
+	maildirpp_quota_add(mdf->md, -freed, -ret);
+
+out:
+    bulk_msgs_free(todo);
+    maildirpp_trim_dirs(mdf->md);
+
+    return ret;
+}
+
+/** Select the messages for #maildir_folder_archive. Those of unknown
+ * delivery time are selected if their Date: is to be looked at. */
+static int match_archive(int flags, time_t delivered, void *data)
+{
+    struct archive_match *m = (struct archive_match *) data;
+
+    if (!delivered)
+	return m->date_header;
+    return !m->before || delivered < m->before;
+}
+
+/** Get the time of a message from its Date: field. */
+static time_t message_read_date(struct maildir_folder *mdf,
+	const struct bulk_msg *r)
+{
+    char *path = g_strconcat(mdf->path, r->subdir == SD_NEW ? "/new/" :
+	    "/cur/", r->name, NULL);
+    FILE *f = fopen(path, "r");
+    time_t ret = 0;
+
+    if (f) {
+	ret = read_rfc822_date(f);
+	mdf->md->counters.msgs_parsed++;
+	mdf->md->counters.hdr_bytes += MAX(ftell(f), 0);
+	fclose(f);
+    }
+    g_free(path);
+
+    return ret;
+}
+
+/** Move messages of a folder to another one, keeping their names and
+ * subdirs, and update both folders in place.
+ * \param todo List of struct bulk_msg.
+ * \param delta The stats delta of #mdf.
+ * \return The number of moved messages, -1 on error.
+ */
+static int maildir_folder_move(struct maildir_folder *mdf,
+	struct maildir_folder *dst, GArray *todo,
+	struct maildir_folder_stats *delta)
+{
+    struct maildir_folder_stats dst_delta = { 0 };
+    int ret = 0;
+
+    DIR *dirs[2] = { maildir_folder_dir(mdf, SD_NEW),
+		     maildir_folder_dir(mdf, SD_CUR) };
+    DIR *dst_dirs[2] = { maildir_folder_dir(dst, SD_NEW),
+			 maildir_folder_dir(dst, SD_CUR) };
+    if (!dirs[0] || !dirs[1] || !dst_dirs[0] || !dst_dirs[1])
+	return -1;
+
+    for (int i = 0; i < todo->len; i += MAILDIR_WALK_BATCH) {
+	int end = MIN(todo->len, i + MAILDIR_WALK_BATCH);
+
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    int cur = r->subdir == SD_CUR;
+
+	    maildir_folder_expect(mdf, r->name, r->subdir);
+	    maildir_folder_expect(dst, r->name, r->subdir);
+
+	    if (renameat(dirfd(dirs[cur]), r->name, dirfd(dst_dirs[cur]),
+			r->name)) {
+		if (errno != ENOENT)
+		    perror(r->name);
+		continue;
+	    }
+	    r->done = 1;
+	}
+
+	maildir_folder_expect_end(mdf);
+	maildir_folder_expect_end(dst);
+
+	for (int j = i; j < end; j++) {
+	    struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, j);
+	    if (!r->done)
+		continue;
+
+	    maildir_folder_stats_msg(mdf, r->name, delta, -1);
+	    maildir_folder_stats_msg(dst, r->name, &dst_delta, 1);
+	    maildir_folder_put_message(dst, r->name, r->subdir,
+		    maildir_folder_steal_message(mdf, r->name));
+	    ret++;
+	}
+    }
+
+    if (dst->stats) {
+	maildir_folder_stats_add(dst->stats, &dst_delta, 1);
+	maildir_tree_update(dst->node, &dst_delta, 1);
+    }
+
+    return ret;
+}
+
+/** Move the messages of one partition to their archive folder, a
+ * g_tree_foreach function of #maildir_folder_archive. */
+static gboolean archive_to(char *name, GArray *msgs, struct archive_state *st)
+{
+    struct maildir_folder *dst =
+	maildirpp_folder_create(st->mdf->md, name, st->data);
+    if (!dst) {
+	st->ret = -1; return TRUE;
+    }
+    if (dst == st->mdf)
+	return FALSE;
+
+    int moved = maildir_folder_move(st->mdf, dst, msgs, &st->delta);
+    if (moved < 0) {
+	st->ret = -1; return TRUE;
+    }
+    st->ret += moved;
+
+    return FALSE;
+}
+
+/** Move old messages of a folder to archive folders by their delivery
+ * time, e.g. to "Archive.2025" or "Archive.2025.03". The time comes from
+ * the unique names (and optionally the Date: field), so the messages
+ * needn't be stat'ed. The archive folders are created as needed, without
+ * a reload of the subfolders list, and the messages are renamed in
+ * batches. The #messages and #stats of both folders are updated in place,
+ * like with #maildir_folder_set_flags, so neither gets dirty.
+ *
+ * \param prefix Name of the archive folders' parent, e.g.
+ *   #MAILDIR_ARCHIVE_PREFIX.
+ * \param flags Mask of enum maildir_archive_flags.
+ * \param before Archive messages delivered before this, 0 for all.
+ * \return The number of moved messages, -1 on error.
+ */
+int maildir_folder_archive(struct maildir_folder *mdf, const char *prefix,
+	int flags, time_t before)
+{
+    GArray *todo = g_array_new(0, 0, sizeof(struct bulk_msg));
+    struct archive_match m = { .before = before,
+	.date_header = !!(flags & MA_DATE_HEADER) };
+    GTree *dsts = g_tree_new_full((GCompareDataFunc) strcmp, 0, g_free,
+	    (GDestroyNotify) bulk_msgs_free);
+    int data = (mdf->stats ? MFD_STATS : 0) | (mdf->messages ? MFD_MSGS : 0);
+    int ret = -1;
+
+    if (maildir_folder_select(mdf, match_archive, &m, todo))
+	goto out;
+
+    /* Partition the messages by the archive folder. */
+    for (int i = 0; i < todo->len; i++) {
+	struct bulk_msg *r = &g_array_index(todo, struct bulk_msg, i);
+	time_t t = message_parse_time(r->name);
+	struct tm tm;
+
+	if (!t)
+	    t = message_read_date(mdf, r);
+	if (!t || (before && t >= before) || !localtime_r(&t, &tm)) {
+	    g_free(r->name);
+	    continue;
+	}
+
+	char *name = flags & MA_MONTHS ?
+	    g_strdup_printf("%s.%04d.%02d", prefix, tm.tm_year + 1900,
+		    tm.tm_mon + 1) :
+	    g_strdup_printf("%s.%04d", prefix, tm.tm_year + 1900);
+	GArray *msgs = g_tree_lookup(dsts, name);
+	if (!msgs) {
+	    msgs = g_array_new(0, 0, sizeof(struct bulk_msg));
+	    g_tree_insert(dsts, name, msgs);
+	} else
+	    g_free(name);
+	g_array_append_val(msgs, *r);
+    }
+    /* The names belong to the partitions now. */
+    g_array_set_size(todo, 0);
+
+    struct archive_state st = { .mdf = mdf, .data = data };
+    g_tree_foreach(dsts, (GTraverseFunc) archive_to, &st);
+    ret = st.ret;
+
+    if (mdf->stats) {
+	maildir_folder_stats_add(mdf->stats, &st.delta, 1);
+	maildir_tree_update(mdf->node, &st.delta, 1);
+    }
+
+out:
+    g_tree_destroy(dsts);
+    bulk_msgs_free(todo);
+    maildirpp_trim_dirs(mdf->md);
+
+    return ret;
 }
@@ -8,57 +8,275 @@
 #include <dirent.h>
 #include <glib.h>
 #include <linux/limits.h>
+#include <stdio.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <time.h>
+
+/** Instrumentation counters, cumulative since #maildirpp_open or
+ * #maildirpp_counters_reset. Times are in microseconds. */
+struct maildirpp_counters {
+    unsigned long dirents, ///< Directory entries scanned.
+		  msgs_parsed, ///< Message headers read.
+		  msgs_reused, ///< Messages reused from the previous fill.
+		  msgs_vanished, ///< Messages gone before we opened them.
+		  hdr_bytes, ///< Bytes of headers read.
+		  notifications, ///< Inotify events received.
+		  folder_scans, ///< Folders rescanned.
+		  subfolder_reloads, ///< Reloads of the list of subfolders.
+		  folder_evictions, ///< Messages of folders evicted.
+		  folder_reloads; ///< Evicted messages read again.
+    long long walk_time, ///< Time spent walking dirty folders.
+	      parse_time, ///< Part of #walk_time spent reading headers.
+	      reload_time; ///< Time spent reloading the list of subfolders.
+};
+
+/** A library context: the inotify instance watching the maildirs opened in
+ * it, its settings and the worker pool of bulk operations. There's no state
+ * shared by contexts, so maildirs of different contexts may be used by
+ * different threads at once (a context and its maildirs by one thread at a
+ * time). Maildirs opened without a context use the default one. */
+struct maildirpp_ctx {
+    int notify_fd; ///< The inotify instance, -1 until a maildir is opened.
+    GHashTable *watches; ///< Map of watch descriptors to struct watch.
+    GPtrArray *maildirs; ///< List of struct maildirpp opened in the context.
+    int verbose;
+    int io_threads; /**< Max. threads of #pool, #MAILDIR_IO_THREADS by
+		     *   default. */
+    GThreadPool *pool; ///< Workers of bulk operations, started on demand.
+};
+
+/** Options for #maildirpp_open_opts. Zero-filled means the defaults. */
+struct maildirpp_options {
+    int flags; ///< Mask of enum maildirpp_open_flags.
+    int fd_budget; /**< Max. number of folder dir streams kept open between
+		    *   walks, with MDO_LAZY_DIRS. */
+    int io_threads; /**< Threads doing the unlinks of bulk operations,
+		     *   maildirpp_ctx.io_threads by default. */
+    struct maildirpp_ctx *ctx; /**< Context to open the maildir in, NULL
+				*   for the default one. */
+    long long msgs_budget; /**< Max. bytes of folders' #messages (an
+			    *   estimate), 0 for no limit. See
+			    *   #maildir_folder_messages. Not with
+			    *   MDO_MSGID_INDEX. */
+};
+
+enum maildirpp_open_flags {
+    MDO_LAZY_DIRS = 1 << 0, /**< Don't keep dir streams of all folders open,
+			     *   only up to #fd_budget of them. */
+    MDO_NESTED	  = 1 << 1, /**< Look for folders in subdirectories too, up
+			     *   to #MAILDIR_MAX_DEPTH levels deep. */
+    MDO_MSGID_INDEX = 1 << 2, /**< Index the messages of folders filled with
+			       *   MFD_MSGS by msg_id, see msgid.h. */
+    MDO_INODE_ORDER = 1 << 3 /**< Read the headers of new messages in the
+			      *   order of their inode numbers, with
+			      *   readahead. Faster with cold caches on
+			      *   disks, where readdir order is random. */
+};
+
+/** Default priority of the INBOX, see maildir_folder.priority. */
+#define MAILDIR_PRIO_INBOX 100
+
+/** Default number of threads of bulk operations, see
+ * maildirpp_options.io_threads. */
+#define MAILDIR_IO_THREADS 4
+
+/** With MDO_INODE_ORDER, this many messages are opened ahead of the one
+ * being read, with the first #MAILDIR_READAHEAD_BYTES of each requested. */
+#define MAILDIR_READAHEAD 32
+#define MAILDIR_READAHEAD_BYTES 16384
+
+/** Bulk operations announce and process the notifications of their changes
+ * by this many messages, which stays well below the inotify queue size. */
+#define MAILDIR_BULK_CHUNK 4096
+
+/** Max. depth of nested folders, see MDO_NESTED. */
+#define MAILDIR_MAX_DEPTH 16
+
+/** Sizes of the delivery time histograms in #maildir_folder_stats. */
+#define MAILDIR_STATS_HOURS 24
+#define MAILDIR_STATS_DAYS 32
+
+struct maildir_folder_stats {
+    int msgs, passed, replied, seen, trashed, draft, flagged, new;
+    long long size, ///< Total size of messages, from the S= field.
+	      vsize; ///< Total size with CRLF line endings (W=).
+    int unsized; /**< Messages of unknown size, not counted in #size.
+		  *   (MFD_SIZES stats these.) */
+
+    /* Delivery times, taken from the message names. Not summed up in the
+     * hierarchy totals. */
+    time_t when; ///< When the folder was walked.
+    time_t oldest, newest, ///< 0 if there are no messages.
+	   oldest_new, newest_new; ///< Of MF_NEW messages.
+    int hours[MAILDIR_STATS_HOURS]; /**< Messages delivered 0-1, 1-2, ...
+				     *   hours before #when. */
+    int days[MAILDIR_STATS_DAYS]; /**< Messages delivered 0-1, 1-2, ... days
+				   *   before #when, the last one counts the
+				   *   older ones, too. */
+};
+
+/** A node of the folder hierarchy. Folder names are split to components
+ * at '.' and '/', the INBOX is the root. Nodes exist for all prefixes of
+ * folder names, even if there's no such folder. */
+struct maildir_tree {
+    char *name; ///< Full name, components joined by '.'. "" for the root.
+    struct maildir_tree *parent;
+    GPtrArray *children; ///< List of struct maildir_tree.
+    struct maildir_folder *mdf; ///< The folder of this name, if any.
+    struct maildir_folder_stats total; /**< Sum of the stats of all walked
+					*   folders in the subtree (except
+					*   the delivery times). */
+};
 
 struct maildirpp {
+    struct maildirpp_ctx *ctx;
     char path[PATH_MAX];
-    DIR *dir;
+    int wd; ///< Inotify watch of #path.
+    int dirty; ///< Has the list of subfolders changed?
     GPtrArray *subfolders; ///< List of struct maildir_folder.
-    GPtrArray *subdirs; ///< List of DIR. (watching wannabe folders)
+    GArray *subdirs; /**< List of inotify watches (int) of wannabe
+		      *   folders (and folders, with MDO_NESTED). */
+    struct maildir_tree *tree; ///< The folder hierarchy.
+    struct maildirpp_options opts;
+    GQueue dirs_lru; /**< Folders with open dir streams, least recently
+		      *   used first. */
+    int dirs_open; ///< Number of open folder dir streams.
+    GQueue msgs_lru; /**< Folders with #messages, least recently used
+		      *   first. */
+    long long msgs_bytes; ///< Sum of maildir_folder.msgs_bytes.
+    struct maildirpp_counters counters;
+    GHashTable *msgid_index; /**< Map of msg_id to GArray of struct
+			      *   maildir_msg_location, with
+			      *   MDO_MSGID_INDEX. */
+    GHashTable *msgid_dups; /**< The entries of #msgid_index with more than
+			     *   one location. */
+    GHashTable *expected; /**< Folders created by us, see
+			   *   maildir_folder.expected. */
+    GPtrArray *fields; /**< Names of the extra header fields read with the
+			*   messages, see #maildirpp_header_field. */
+    int views; /**< Mask of (1 << enum maildir_view), the views kept for
+		*   folders with #messages. */
+    int from_field, subject_field; ///< Indexes in #fields, for the views.
+    void *walk_data; /**< Data of the walk in progress, for walker
+		      *   functions which need more than the folder. */
+};
+
+/** Sort orders of the views of folders' messages, see #maildirpp_set_views.
+ * Messages which compare equal are ordered by their address. */
+enum maildir_view {
+    MV_DATE,	///< By the Date: field, the delivery time if there's none.
+    MV_FROM,	///< By the From: field, ignoring case.
+    MV_SUBJECT,	///< Ditto, without the "Re:"s and "Fwd:"s.
+    MV_THREAD,	/**< By the thread (the first of the references), then by
+		 *   date. */
+    MV_COUNT
 };
 
-struct maildir_folder_stats;
+enum message_flags {
+    MF_PASSED	= 1 << 0,
+    MF_REPLIED	= 1 << 1,
+    MF_SEEN	= 1 << 2,
+    MF_TRASHED	= 1 << 3,
+    MF_DRAFT	= 1 << 4,
+    MF_FLAGGED	= 1 << 5,
+    MF_NEW	= 1 << 6, ///< Not Maildir flag, this is our flag.
+    MF_COMBINATIONS = 1 << 7 ///< Number of possible values of the flags.
+};
 
 struct maildir_folder {
     struct maildirpp *md;
+    struct maildir_tree *node; ///< Our place in the hierarchy.
 
     char path[PATH_MAX];
-    DIR *dir_new, *dir_cur;
+    int wd_new, wd_cur; ///< Inotify watches of the new and cur subdirs.
+    int dirty; ///< Mask of SD_NEW, SD_CUR -- which subdirs have changed.
+    DIR *dir_new, *dir_cur; ///< Opened on demand, may be NULL.
+    GList lru; ///< Link in maildirpp.dirs_lru.
+    int walked; ///< Mask of SD_NEW, SD_CUR -- subdirs walked last time.
+    int priority; /**< Dirty folders of higher priority are walked first.
+		   *   The INBOX gets MAILDIR_PRIO_INBOX, others 0. */
+    time_t active; /**< When changes were last found in the folder (not
+		    *   counting the first walk), 0 if never. Among folders
+		    *   of the same priority, recently active go first. */
+    int flags_hist[MF_COMBINATIONS]; /**< Messages by flags, during a walk
+				      *   with MFD_STATS. */
 
     /* Non-mandatory fields: */
     struct maildir_folder_stats *stats;
     GTree *messages; /**< Map of <code>char *</code> (filename) to
 		      *   <code>struct message</code> */
+    long long msgs_bytes; ///< Memory taken by #messages, an estimate.
+    GList msgs_lru; /**< Link in maildirpp.msgs_lru, data is NULL if not
+		     *   linked. */
+    int evicted; /**< Mask of SD_NEW, SD_CUR -- subdirs of the #messages
+		  *   evicted to stay within maildirpp_options.msgs_budget,
+		  *   0 if not evicted. */
+    GHashTable *evicted_names; /**< The names of the evicted messages (or
+				*   of the messages of the last fill, if
+				*   they've been reloaded since), mapped to
+				*   their subdirs. The next fill finds its
+				*   changes against them. */
     GTree *old_messages;
-};
-
-struct maildir_folder_stats {
-    int msgs, passed, replied, seen, trashed, draft, flagged, new;
+    GPtrArray *unsized; /**< Messages without the S= field, during a walk
+			 *   with MFD_SIZES. */
+    GPtrArray *unmatched; /**< New messages not found in #old_messages by
+			   *   name, during a walk with MFD_MSGS. */
+    GArray *changes; /**< List of struct maildir_change, the changes of
+		      *   #messages made by the last fill. NULL unless it
+		      *   was with MFD_CHANGES and walked the folder. */
+    GHashTable *expected; /**< Entries renamed by us, whose notifications
+			   *   are not to make the folder dirty. Maps names
+			   *   to masks of SD_NEW, SD_CUR. */
+    GTree *views[MV_COUNT]; /**< Sorted views of #messages, by enum
+			     *   maildir_view. Sets of struct message (the
+			     *   keys), NULL unless enabled. */
 };
 
 struct message {
     char *path, ///< Full path.
 	 *name; ///< Msg name. Pointer to the #path array.
     int flags;
+    int subdir; ///< SD_NEW or SD_CUR.
+    time_t delivered; ///< From the name, 0 if unknown.
+    ino_t ino; ///< From readdir when found, 0 if unknown.
     char *msg_id; ///< The message ID.
     GPtrArray *references; /**< List of <code>char *</code>. Already merged
 			    *   with In-Reply-To:s. */
+    char *fields; /**< Values of the extra header fields, in the order of
+		   *   maildirpp.fields, each NUL-terminated ("" if
+		   *   missing). See #maildir_message_field. */
+    int n_fields; ///< Number of values in #fields.
+    time_t date; ///< From the Date: field, if it's read, 0 otherwise.
 };
 
-enum message_flags {
-    MF_PASSED	= 1 << 0,
-    MF_REPLIED	= 1 << 1,
-    MF_SEEN	= 1 << 2,
-    MF_TRASHED	= 1 << 3,
-    MF_DRAFT	= 1 << 4,
-    MF_FLAGGED	= 1 << 5,
-    MF_NEW	= 1 << 6 ///< Not Maildir flag, this is our flag.
-};
 
 enum maildir_folder_data {
     MFD_STATS	= 1 << 0,
-    MFD_MSGS	= 1 << 1
+    MFD_MSGS	= 1 << 1,
+    MFD_SIZES	= 1 << 2, /**< MFD_STATS, stat messages without the S= field
+			   *   to get their sizes. */
+    MFD_CHANGES	= 1 << 3 /**< MFD_MSGS, record the changes of the messages
+			  *   of each folder in its #changes. */
+};
+
+enum maildir_change_type {
+    MC_ADDED	= 1 << 0,
+    MC_REMOVED	= 1 << 1,
+    MC_FLAGS	= 1 << 2, ///< Renamed with different flags.
+    MC_MOVED	= 1 << 3 ///< Moved from new/ to cur/ (or back).
+};
+
+/** A change of a folder's messages. Messages are matched by the unique
+ * part of their names (up to the ':'), so a renamed message is reported as
+ * MC_FLAGS and/or MC_MOVED rather than removed and added. */
+struct maildir_change {
+    int type; ///< Mask of enum maildir_change_type.
+    struct message *msg; /**< The message in #messages, NULL if
+			  *   MC_REMOVED. */
+    struct message *old; /**< The message as it was before (without the
+			  *   msg_id and references), NULL if MC_ADDED.
+			  *   Owned by the change list. */
 };
 
 enum fill_subdirs {
@@ -66,27 +284,116 @@ enum fill_subdirs {
     SD_CUR	= 1 << 1
 };
 
+/** Which messages #maildir_folder_set_flags changes. */
+enum maildir_select {
+    MS_ALL,
+    MS_UNREAD, ///< Those without MF_SEEN.
+    MS_NAMES ///< The given ones.
+};
+
+/** How #maildir_folder_archive partitions the messages. */
+enum maildir_archive_flags {
+    MA_MONTHS	   = 1 << 0, ///< To Archive.YYYY.MM rather than Archive.YYYY.
+    MA_DATE_HEADER = 1 << 1 /**< Take the time from the Date: field of
+			     *   messages whose names don't have it. */
+};
+
+/** Default folder prefix of #maildir_folder_archive. */
+#define MAILDIR_ARCHIVE_PREFIX "Archive"
+
 /** Params for walker functions. */
 struct maildir_folder_walk_messages_params {
     struct maildir_folder *mdf;
     const char *msg_name, *msg_full_path;
+    int msg_subdir; ///< SD_NEW or SD_CUR.
+    int msg_flags; ///< Parsed from #msg_name by the walker.
+    time_t msg_delivered; ///< Ditto.
+    ino_t msg_ino; ///< From readdir.
+};
+
+/** Max. number of messages passed to a batch walker function at once. */
+#define MAILDIR_WALK_BATCH 256
+
+/** A batch of messages of one subdir, for batch walker functions. The
+ * names are only valid during the call. */
+struct maildir_folder_walk_batch {
+    struct maildir_folder *mdf;
+    int subdir; ///< SD_NEW or SD_CUR.
+    const char *subdir_path; ///< Full path of the subdir, with trailing '/'.
+    int len; ///< Number of messages in the batch.
+    const char *names[MAILDIR_WALK_BATCH];
+    size_t name_lens[MAILDIR_WALK_BATCH];
+    unsigned char d_types[MAILDIR_WALK_BATCH]; /**< From readdir, DT_UNKNOWN
+						*   if the fs doesn't say. */
+    int flags[MAILDIR_WALK_BATCH]; ///< Parsed from #names by the walker.
+    time_t delivered[MAILDIR_WALK_BATCH]; ///< Ditto.
+    ino_t inos[MAILDIR_WALK_BATCH]; ///< From readdir.
 };
 
 typedef void (*maildir_folder_walk_messages_func)
     (struct maildir_folder_walk_messages_params *params);
+typedef void (*maildir_folder_walk_batch_func)
+    (const struct maildir_folder_walk_batch *batch);
 typedef void (*maildir_folder_walk_func)
     (struct maildir_folder *mdf);
 
+struct maildirpp_ctx *maildirpp_ctx_new(void);
+void maildirpp_ctx_free(struct maildirpp_ctx *ctx);
+struct maildirpp_ctx *maildirpp_ctx_default(void);
+void maildirpp_ctx_set_verbose(struct maildirpp_ctx *ctx, int verbose);
+int maildirpp_ctx_wait(struct maildirpp_ctx *ctx, int timeout);
 int maildirpp_open(struct maildirpp *md, const char *path);
+int maildirpp_open_opts(struct maildirpp *md, const char *path,
+	const struct maildirpp_options *opts);
 void maildirpp_close(struct maildirpp *md);
 int maildirpp_dirty(struct maildirpp *md, int dont_block);
 int maildirpp_dirty_subfolders(struct maildirpp *md, int dont_block);
 void maildirpp_pause_if_not_dirty(struct maildirpp *md);
 int maildirpp_refresh_subfolders_list(struct maildirpp *md);
 void maildirpp_set_verbose(int new_verbose);
+void maildirpp_counters_reset(struct maildirpp *md);
+void maildirpp_counters_print(struct maildirpp *md, FILE *f);
 void maildirpp_folders_walk(struct maildirpp *md,
 	GArray *folder_pre_funcs, GArray *folder_post_funcs,
 	GArray *msgs_funcs, int subdirs);
+void maildirpp_folders_walk_batches(struct maildirpp *md,
+	GArray *folder_pre_funcs, GArray *folder_post_funcs,
+	GArray *msgs_funcs, GArray *batch_funcs, int subdirs);
+int maildirpp_folders_walk_budget(struct maildirpp *md,
+	GArray *folder_pre_funcs, GArray *folder_post_funcs,
+	GArray *msgs_funcs, GArray *batch_funcs, int subdirs,
+	long long budget);
+void maildir_folder_walk(struct maildir_folder *mdf, GArray *batch_funcs,
+	int subdirs);
 void maildirpp_folders_fill(struct maildirpp *md, int data, int subdirs);
+int maildirpp_folders_fill_budget(struct maildirpp *md, int data,
+	int subdirs, long long budget);
+int maildirpp_message_read(struct maildirpp *md, struct message *msg);
+void maildirpp_message_clear(struct message *msg);
+int maildirpp_header_field(struct maildirpp *md, const char *name);
+const char *maildir_message_field(const struct message *msg, int field);
+void maildirpp_set_views(struct maildirpp *md, int views);
+GTree *maildir_folder_messages(struct maildir_folder *mdf);
+struct maildir_tree *maildirpp_tree_lookup(struct maildirpp *md,
+	const char *name);
+struct maildir_folder *maildirpp_folder_create(struct maildirpp *md,
+	const char *name, int data);
+void maildir_folder_stats_add(struct maildir_folder_stats *dst,
+	const struct maildir_folder_stats *src, int sign);
+void maildir_folder_expect(struct maildir_folder *mdf, const char *name,
+	int subdir);
+void maildir_folder_expect_end(struct maildir_folder *mdf);
+void maildirpp_expect(struct maildirpp *md, const char *name);
+void maildirpp_expect_end(struct maildirpp *md);
+int maildir_folder_add_message(struct maildir_folder *mdf, const char *name);
+int maildir_folder_set_flags(struct maildir_folder *mdf, int select,
+	const char *const *names, int n_names, int set, int clear);
+int maildir_folder_expunge(struct maildir_folder *mdf, int flags,
+	time_t before);
+int maildir_folder_archive(struct maildir_folder *mdf, const char *prefix,
+	int flags, time_t before);
+int maildir_flags_parse(const char *letters);
+int maildir_folder_stats_since(const struct maildir_folder_stats *stats,
+	time_t since);
 
 #endif /* MAILDIR_H */
@@ -0,0 +1,131 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "maildir.h"
+
+static const char *prefix = MAILDIR_ARCHIVE_PREFIX;
+static int flags = 0;
+static long days = 365; ///< Archive messages older than this.
+static time_t before = 0;
+
+static int archive(struct maildir_folder *mdf)
+{
+    int n = maildir_folder_archive(mdf, prefix, flags, before);
+
+    if (n < 0)
+	return -1;
+    if (n > 0)
+	printf("%s: %d\n", mdf->node->name[0] ? mdf->node->name : "INBOX",
+		n);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *maildir;
+    int ret = 0;
+
+    /* Parse cmdline options */
+    while (1) {
+	char c, *end;
+
+	if ((c = getopt(argc, argv, "a:dhmp:")) == -1)
+	    break;
+
+	switch (c) {
+	    case 'a':
+		days = strtol(optarg, &end, 10);
+		if (end == optarg || *end || days < 0) {
+		    fprintf(stderr, "Bad number of days: %s\n", optarg);
+		    return -1;
+		}
+		break;
+
+	    case 'd':
+		flags |= MA_DATE_HEADER;
+		break;
+
+	    case 'm':
+		flags |= MA_MONTHS;
+		break;
+
+	    case 'p':
+		prefix = optarg;
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options] [<maildir location> "
+			"[<folder>...]]\n", argv[0]);
+		fprintf(stderr, "Moves messages of the folders (the INBOX by "
+			"default, \"INBOX\" for it) to\n"
+			"<prefix>.YYYY folders by their delivery time.\n");
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -a <days> - only messages delivered more "
+			"than <days> ago (default 365,\n"
+			"    0 for all)\n");
+		fprintf(stderr, " -d - use the Date: of messages whose names "
+			"don't tell the time\n");
+		fprintf(stderr, " -m - to <prefix>.YYYY.MM folders\n");
+		fprintf(stderr, " -p <prefix> - archive folder prefix "
+			"(default %s)\n", MAILDIR_ARCHIVE_PREFIX);
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return -1;
+	}
+    }
+
+    if (days)
+	before = time(0) - days * 86400;
+
+    /* Maildir location specified? Use the default otherwise. */
+    if (optind < argc)
+	maildir = g_strdup(argv[optind++]);
+    else {
+	char *home = getenv("HOME");
+	if (!home) abort();
+	maildir = g_strconcat(home, "/Mail", NULL);
+    }
+
+    struct maildirpp md;
+    if (maildirpp_open(&md, maildir) != 0)
+	abort();
+
+    /* Archiving creates folders, so look them all up first. */
+    GPtrArray *folders = g_ptr_array_new();
+    if (optind == argc)
+	g_ptr_array_add(folders, maildirpp_tree_lookup(&md, "")->mdf);
+    for (; optind < argc; optind++) {
+	const char *name = strcmp(argv[optind], "INBOX") ?
+	    argv[optind] : "";
+	struct maildir_tree *node = maildirpp_tree_lookup(&md, name);
+	if (!node || !node->mdf) {
+	    fprintf(stderr, "No such folder: %s\n", argv[optind]);
+	    ret = -1;
+	    continue;
+	}
+	g_ptr_array_add(folders, node->mdf);
+    }
+
+    for (int i = 0; i < folders->len; i++) {
+	struct maildir_folder *mdf =
+	    (struct maildir_folder *) g_ptr_array_index(folders, i);
+	if (mdf && archive(mdf))
+	    ret = -1;
+    }
+
+    g_ptr_array_free(folders, 1);
+    maildirpp_close(&md);
+    g_free(maildir);
+
+    return ret;
+}
@@ -0,0 +1,227 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "deliver.h"
+
+static int batch = MAILDIR_DELIVER_BATCH;
+static int nul_separated = 0;
+static const char *spool = NULL;
+
+/** Commit if there's a full batch pending, or if \a force. */
+static int commit(struct maildir_deliver *d, int force)
+{
+    if (!force && d->pending->len < batch)
+	return 0;
+
+    return maildir_deliver_commit(d) < 0 ? -1 : 1;
+}
+
+/** Deliver NUL separated messages from stdin. */
+static int deliver_stdin(struct maildir_deliver *d)
+{
+    char buf[65536];
+    ssize_t len;
+
+    while ((len = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+	if (len == -1) {
+	    perror("read"); return -1;
+	}
+
+	for (char *p = buf, *end = buf + len; p < end; ) {
+	    char *nul = memchr(p, 0, end - p);
+	    char *stop = nul ? nul : end;
+
+	    /* A message starts with its first byte, so empty ones (and the
+	     * trailing NUL) are skipped. */
+	    if (stop > p) {
+		if (!d->writing && maildir_deliver_begin(d, 0))
+		    return -1;
+		if (maildir_deliver_write(d, p, stop - p))
+		    return -1;
+	    }
+	    if (nul && d->writing) {
+		maildir_deliver_end(d);
+		if (commit(d, 0) < 0)
+		    return -1;
+	    }
+	    p = nul ? nul + 1 : end;
+	}
+    }
+
+    if (d->writing)
+	maildir_deliver_end(d);
+
+    return 0;
+}
+
+/** Remove the spool files of the messages delivered by the last commit.
+ * Those which failed stay for the next run.
+ * \param names Of the files of the committed batch, in its order.
+ */
+static void spool_remove(struct maildir_deliver *d, int dir_fd,
+	GPtrArray *names)
+{
+    for (int i = 0; i < d->delivered->len; i++) {
+	char *name = (char *) g_ptr_array_index(names,
+		g_array_index(d->delivered, int, i));
+	if (unlinkat(dir_fd, name, 0))
+	    perror(name);
+    }
+    g_array_set_size(d->delivered, 0);
+    g_ptr_array_foreach(names, (GFunc) g_free, 0);
+    g_ptr_array_set_size(names, 0);
+}
+
+/** Deliver the files of a spool directory, removing them once they're
+ * committed. */
+static int deliver_spool(struct maildir_deliver *d)
+{
+    DIR *dir = opendir(spool);
+    GPtrArray *names = g_ptr_array_new();
+    struct dirent *dent;
+    int ret = -1;
+
+    d->delivered = g_array_new(0, 0, sizeof(int));
+
+    if (!dir) {
+	perror(spool); goto out;
+    }
+
+    while ((dent = readdir(dir))) {
+	if (dent->d_name[0] == '.')
+	    continue;
+
+	int fd = openat(dirfd(dir), dent->d_name, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1) {
+	    perror(dent->d_name); continue;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+	    close(fd); continue;
+	}
+
+	int r = maildir_deliver_fd(d, fd);
+	close(fd);
+	if (r)
+	    goto out;
+	g_ptr_array_add(names, g_strdup(dent->d_name));
+
+	r = commit(d, 0);
+	if (r)
+	    spool_remove(d, dirfd(dir), names);
+	if (r < 0)
+	    goto out;
+    }
+
+    int r = commit(d, 1);
+    spool_remove(d, dirfd(dir), names);
+    if (r < 0)
+	goto out;
+    ret = 0;
+
+out:
+    /* Whatever is left was not delivered, keep it in the spool, and don't
+     * let the close deliver it. */
+    maildir_deliver_abort_pending(d);
+    g_ptr_array_foreach(names, (GFunc) g_free, 0);
+    g_ptr_array_free(names, 1);
+    g_array_free(d->delivered, 1);
+    d->delivered = NULL;
+    if (dir)
+	closedir(dir);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char *folder;
+    int flags = 0;
+
+    /* Parse cmdline options */
+    while (1) {
+	char c;
+
+	if ((c = getopt(argc, argv, "0hn:Ns:")) == -1)
+	    break;
+
+	switch (c) {
+	    case '0':
+		nul_separated = 1;
+		break;
+
+	    case 'n':
+		batch = atoi(optarg);
+		if (batch < 1)
+		    batch = 1;
+		break;
+
+	    case 'N':
+		flags |= MDD_NO_SYNC;
+		break;
+
+	    case 's':
+		spool = optarg;
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options] [<maildir folder>]\n",
+			argv[0]);
+		fprintf(stderr, "Delivers the message on stdin.\n");
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -0 - stdin has more messages, separated "
+			"by NUL bytes\n");
+		fprintf(stderr, " -n <n> - fsync every <n> messages "
+			"(default %d)\n", MAILDIR_DELIVER_BATCH);
+		fprintf(stderr, " -N - don't fsync at all\n");
+		fprintf(stderr, " -s <dir> - deliver (and remove) the files "
+			"in <dir>\n");
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return EX_USAGE;
+	}
+    }
+
+    /* Maildir location specified? Use the default otherwise. */
+    if (optind < argc)
+	folder = g_strdup(argv[optind]);
+    else {
+	char *home = getenv("HOME");
+	if (!home) abort();
+	folder = g_strconcat(home, "/Mail", NULL);
+    }
+
+    struct maildir_deliver d;
+    int ret;
+
+    if (maildir_deliver_open(&d, folder, NULL, flags))
+	return EX_TEMPFAIL;
+
+    if (spool)
+	ret = deliver_spool(&d);
+    else if (nul_separated)
+	ret = deliver_stdin(&d);
+    else
+	ret = maildir_deliver_fd(&d, STDIN_FILENO);
+
+    /* Closing commits the rest. Tell the MTA to retry if anything failed,
+     * duplicates are better than lost mail. */
+    if (maildir_deliver_close(&d) < 0)
+	ret = -1;
+
+    g_free(folder);
+
+    return ret ? EX_TEMPFAIL : 0;
+}
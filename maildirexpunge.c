@@ -0,0 +1,127 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "maildir.h"
+
+static int flags = MF_TRASHED;
+static time_t before = 0;
+static struct maildirpp_options opts;
+
+static int expunge(struct maildir_folder *mdf)
+{
+    int n = maildir_folder_expunge(mdf, flags, before);
+
+    if (n < 0)
+	return -1;
+    if (n > 0)
+	printf("%s: %d\n", mdf->node->name[0] ? mdf->node->name : "INBOX",
+		n);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *maildir;
+    int ret = 0;
+
+    /* Parse cmdline options */
+    while (1) {
+	char c, *end;
+	long days;
+
+	if ((c = getopt(argc, argv, "a:f:hj:")) == -1)
+	    break;
+
+	switch (c) {
+	    case 'a':
+		days = strtol(optarg, &end, 10);
+		if (end == optarg || *end || days < 0) {
+		    fprintf(stderr, "Bad number of days: %s\n", optarg);
+		    return -1;
+		}
+		before = time(0) - days * 86400;
+		break;
+
+	    case 'f':
+		flags = maildir_flags_parse(optarg);
+		if (flags < 0) {
+		    fprintf(stderr, "Unknown flags: %s\n", optarg);
+		    return -1;
+		}
+		break;
+
+	    case 'j':
+		opts.io_threads = atoi(optarg);
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options] [<maildir location> "
+			"[<folder>...]]\n", argv[0]);
+		fprintf(stderr, "Removes messages from the folders (all by "
+			"default, the INBOX is \"INBOX\").\n");
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -a <days> - only messages delivered more "
+			"than <days> ago\n");
+		fprintf(stderr, " -f <flags> - messages with these flags "
+			"(default T), \"\" for any (needs -a)\n");
+		fprintf(stderr, " -j <n> - unlink in <n> threads\n");
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return -1;
+	}
+    }
+
+    /* Any flags and any time would be all the messages. */
+    if (!flags && !before) {
+	fprintf(stderr, "-f \"\" needs -a\n");
+	return -1;
+    }
+
+    /* Maildir location specified? Use the default otherwise. */
+    if (optind < argc)
+	maildir = g_strdup(argv[optind++]);
+    else {
+	char *home = getenv("HOME");
+	if (!home) abort();
+	maildir = g_strconcat(home, "/Mail", NULL);
+    }
+
+    struct maildirpp md;
+    if (maildirpp_open_opts(&md, maildir, &opts) != 0)
+	abort();
+
+    if (optind < argc) {
+	for (; optind < argc; optind++) {
+	    const char *name = strcmp(argv[optind], "INBOX") ?
+		argv[optind] : "";
+	    struct maildir_tree *node = maildirpp_tree_lookup(&md, name);
+	    if (!node || !node->mdf) {
+		fprintf(stderr, "No such folder: %s\n", argv[optind]);
+		ret = -1;
+		continue;
+	    }
+	    if (expunge(node->mdf))
+		ret = -1;
+	}
+    } else {
+	for (int i = 0; i < md.subfolders->len; i++)
+	    if (expunge((struct maildir_folder *)
+			g_ptr_array_index(md.subfolders, i)))
+		ret = -1;
+    }
+
+    maildirpp_close(&md);
+    g_free(maildir);
+
+    return ret;
+}
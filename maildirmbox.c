@@ -0,0 +1,499 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Converts between mbox files (the mboxrd flavour: lines matching
+ * "^>*From " get one more '>' in the mbox) and maildir folders.
+ *
+ * Export writes the From_ line and then the message. If the message needs
+ * no quoting, the file is copied with copy_file_range (or sendfile, if the
+ * output is a pipe) and never goes through us.
+ *
+ * Import maps the mbox and splits it by looking for "\nFrom " with memmem,
+ * which glibc vectorises. The dates of the From_ lines go to the names of
+ * the messages, as their delivery times (the time of the import if they
+ * can't be parsed). Messages needing no unquoting are copied into
+ * the maildir with copy_file_range too, and delivered in batches (see
+ * deliver.h). Each batch is counted in the quota as it's committed, with
+ * one line in the maildirsize file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "deliver.h"
+
+static int export = 0;
+static int by_name = 0;
+static int batch = MAILDIR_DELIVER_BATCH;
+static int deliver_flags = 0;
+
+/** A message to be exported. */
+struct export_msg {
+    int subdir; ///< SD_NEW or SD_CUR.
+    time_t delivered;
+    char *name;
+};
+
+static GArray *export_msgs; ///< List of struct export_msg.
+
+/* Output of the export, buffered between the zero-copy parts. */
+static int out_fd;
+static int out_append; ///< Is the output O_APPEND? No zero-copy then.
+static GString *out;
+
+/** Find the next line matching "^>*From " (with at least \a min_quotes
+ * '>'s), looking for "From " from \a scan on.
+ * \param start Start of the message, a line start.
+ * \param from Set to the "From " found.
+ * \return The start of the line, NULL if there's none.
+ */
+static const char *next_from(const char *scan, const char *start,
+	const char *end, int min_quotes, const char **from)
+{
+    while (scan < end) {
+	const char *f = memmem(scan, end - scan, "From ", 5);
+	if (!f)
+	    return NULL;
+
+	const char *l = f;
+	while (l > start && l[-1] == '>')
+	    l--;
+	if ((l == start || l[-1] == '\n') && f - l >= min_quotes) {
+	    *from = f;
+	    return l;
+	}
+	scan = f + 5;
+    }
+
+    return NULL;
+}
+
+static int out_flush(void)
+{
+    for (size_t done = 0; done < out->len; ) {
+	ssize_t r = write(out_fd, out->str + done, out->len - done);
+	if (r == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror("write"); return -1;
+	}
+	done += r;
+    }
+    g_string_truncate(out, 0);
+
+    return 0;
+}
+
+/** Copy \a len bytes from the current position of \a fd to the output:
+ * by copy_file_range, sendfile if the output is not a file (a pipe), or
+ * read and write if it's O_APPEND, which neither of them takes. */
+static int out_copy(int fd, size_t len)
+{
+    enum { COPY, SENDFILE, READ } how = out_append ? READ : COPY;
+    char buf[65536];
+
+    if (out_flush())
+	return -1;
+
+    while (len > 0) {
+	ssize_t r;
+
+	if (how == COPY) {
+	    r = copy_file_range(fd, NULL, out_fd, NULL, len, 0);
+	    if (r == -1 && (errno == EINVAL || errno == EXDEV ||
+			errno == ENOSYS || errno == EOPNOTSUPP)) {
+		/* Not a file, probably a pipe. */
+		how = SENDFILE;
+		continue;
+	    }
+	} else if (how == SENDFILE) {
+	    r = sendfile(out_fd, fd, NULL, len);
+	    if (r == -1 && errno == EINVAL) {
+		how = READ;
+		continue;
+	    }
+	} else {
+	    r = read(fd, buf, MIN(len, sizeof(buf)));
+	    for (ssize_t done = 0, w; r > 0 && done < r; done += w)
+		while ((w = write(out_fd, buf + done, r - done)) == -1)
+		    if (errno != EINTR) {
+			perror("write"); return -1;
+		    }
+	}
+
+	if (r == 0) {
+	    fprintf(stderr, "Unexpected end of file\n");
+	    return -1;
+	}
+	if (r == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror("write"); return -1;
+	}
+	len -= r;
+    }
+
+    return 0;
+}
+
+static void export_batch(const struct maildir_folder_walk_batch *b)
+{
+    for (int i = 0; i < b->len; i++) {
+	struct export_msg m = { .subdir = b->subdir,
+	    .delivered = b->delivered[i],
+	    .name = g_strndup(b->names[i], b->name_lens[i]) };
+	g_array_append_val(export_msgs, m);
+    }
+}
+
+static int compare_export_msg(const struct export_msg *a,
+	const struct export_msg *b)
+{
+    if (!by_name && a->delivered != b->delivered)
+	return a->delivered < b->delivered ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+/** Write one message to the mbox. */
+static int export_msg(int dir_fd, const struct export_msg *m)
+{
+    int fd = openat(dir_fd, m->name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char date[64];
+    int ret = -1;
+
+    if (fd == -1) {
+	/* Gone since the walk, never mind. */
+	if (errno == ENOENT)
+	    return 0;
+	perror(m->name); return -1;
+    }
+    if (fstat(fd, &st)) {
+	perror(m->name); goto out;
+    }
+
+    time_t t = m->delivered ? m->delivered : st.st_mtime;
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y", gmtime(&t));
+    g_string_append_printf(out, "From MAILER-DAEMON %s\n", date);
+
+    if (st.st_size == 0) {
+	g_string_append_c(out, '\n');
+	ret = 0;
+	goto out;
+    }
+
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+	perror(m->name); goto out;
+    }
+    const char *end = map + st.st_size, *from;
+    const char *l = next_from(map, map, end, 0, &from);
+
+    if (!l)
+	ret = out_copy(fd, st.st_size);
+    else {
+	/* Quote the From_ lines. */
+	const char *p = map;
+	for (; l; l = next_from(from + 5, map, end, 0, &from)) {
+	    g_string_append_len(out, p, l - p);
+	    g_string_append_c(out, '>');
+	    p = l;
+	}
+	g_string_append_len(out, p, end - p);
+	ret = 0;
+    }
+
+    /* Messages are separated by an empty line. */
+    if (end[-1] != '\n')
+	g_string_append_c(out, '\n');
+    g_string_append_c(out, '\n');
+
+    munmap((void *) map, st.st_size);
+    if (!ret && out->len >= 65536)
+	ret = out_flush();
+
+out:
+    close(fd);
+    return ret;
+}
+
+static int export_folder(struct maildir_folder *mdf, const char *mbox)
+{
+    GArray *funcs = g_array_new(0, 0, sizeof(maildir_folder_walk_batch_func));
+    maildir_folder_walk_batch_func bf = export_batch;
+    int dir_fds[2] = { -1, -1 };
+    int ret = -1;
+
+    g_array_append_val(funcs, bf);
+    export_msgs = g_array_new(0, 0, sizeof(struct export_msg));
+    maildir_folder_walk(mdf, funcs, SD_NEW | SD_CUR);
+    g_array_sort(export_msgs, (GCompareFunc) compare_export_msg);
+
+    if (!strcmp(mbox, "-"))
+	out_fd = STDOUT_FILENO;
+    else {
+	out_fd = open(mbox, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out_fd == -1) {
+	    perror(mbox); goto out;
+	}
+    }
+    int fl = fcntl(out_fd, F_GETFL);
+    out_append = fl != -1 && (fl & O_APPEND);
+    out = g_string_sized_new(65536);
+
+    for (int i = 0; i < 2; i++) {
+	char *path = g_strconcat(mdf->path, i ? "/cur" : "/new", NULL);
+	dir_fds[i] = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fds[i] == -1)
+	    perror(path);
+	g_free(path);
+	if (dir_fds[i] == -1)
+	    goto out;
+    }
+
+    for (int i = 0; i < export_msgs->len; i++) {
+	struct export_msg *m =
+	    &g_array_index(export_msgs, struct export_msg, i);
+	if (export_msg(dir_fds[m->subdir == SD_CUR], m))
+	    goto out;
+    }
+    ret = out_flush();
+
+out:
+    for (int i = 0; i < 2; i++)
+	if (dir_fds[i] != -1)
+	    close(dir_fds[i]);
+    if (out)
+	g_string_free(out, TRUE);
+    if (out_fd > STDOUT_FILENO && close(out_fd)) {
+	perror(mbox);
+	ret = -1;
+    }
+    for (int i = 0; i < export_msgs->len; i++)
+	g_free(g_array_index(export_msgs, struct export_msg, i).name);
+    g_array_free(export_msgs, 1);
+    g_array_free(funcs, 1);
+    return ret;
+}
+
+/** Get the date of a From_ line, "From sender Tue Jul  1 10:52:37 2003",
+ * taken as UTC (as exported).
+ * \return The time, 0 if it can't be parsed.
+ */
+static time_t from_line_date(const char *p, const char *eol)
+{
+    char line[128];
+    struct tm tm = { 0 };
+
+    snprintf(line, sizeof(line), "%.*s", (int) (eol - p), p);
+    char *date = line + 5 + strcspn(line + 5, " \t");
+    if (!strptime(date, " %a %b %d %H:%M:%S %Y", &tm))
+	return 0;
+
+    time_t t = timegm(&tm);
+    return t == -1 ? 0 : t;
+}
+
+/** Deliver one message of the mbox, unquoting its From_ lines.
+ * \param when Its date, from the From_ line, 0 if unknown.
+ */
+static int import_msg(struct maildir_deliver *d, int fd, const char *map,
+	const char *start, const char *end, time_t when)
+{
+    const char *from;
+    const char *l = next_from(start, start, end, 1, &from);
+
+    if (maildir_deliver_begin(d, when))
+	return -1;
+
+    if (!l) {
+	if (maildir_deliver_range(d, fd, start - map, end - start))
+	    return -1;
+    } else {
+	const char *p = start;
+	for (; l; l = next_from(from + 5, start, end, 1, &from)) {
+	    /* Drop the first '>'. */
+	    if (maildir_deliver_write(d, p, l - p))
+		return -1;
+	    p = l + 1;
+	}
+	if (maildir_deliver_write(d, p, end - p))
+	    return -1;
+    }
+
+    return maildir_deliver_end(d);
+}
+
+static int import_mbox(struct maildir_folder *mdf, const char *mbox)
+{
+    struct maildir_deliver d;
+    struct stat st;
+    int ret = -1, n = 0;
+
+    int fd = open(mbox, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+	perror(mbox); return -1;
+    }
+    if (fstat(fd, &st)) {
+	perror(mbox); goto err1;
+    }
+    if (st.st_size == 0) {
+	ret = 0; goto err1;
+    }
+
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+	perror(mbox); goto err1;
+    }
+    madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+    const char *end = map + st.st_size;
+
+    if (st.st_size < 5 || memcmp(map, "From ", 5)) {
+	fprintf(stderr, "%s: Not an mbox\n", mbox);
+	goto err2;
+    }
+
+    if (maildir_deliver_open(&d, NULL, mdf, deliver_flags))
+	goto err2;
+
+    for (const char *p = map; p < end; ) {
+	/* Skip the From_ line. */
+	const char *start = memchr(p, '\n', end - p);
+	start = start ? start + 1 : end;
+
+	const char *next = memmem(start - 1, end - start + 1, "\nFrom ", 6);
+	next = next ? next + 1 : end;
+
+	/* Drop the empty line separating the messages. */
+	const char *msg_end = next;
+	if (msg_end - start >= 2 && msg_end[-1] == '\n' && msg_end[-2] == '\n')
+	    msg_end--;
+
+	if (import_msg(&d, fd, map, start, msg_end,
+		    from_line_date(p, start - 1)))
+	    goto err3;
+	n++;
+	if (d.pending->len >= batch && maildir_deliver_commit(&d) < 0)
+	    goto err3;
+
+	p = next;
+    }
+    ret = 0;
+
+err3:
+    if (maildir_deliver_close(&d) < 0)
+	ret = -1;
+    if (!ret)
+	fprintf(stderr, "%d messages imported\n", n);
+err2:
+    munmap((void *) map, st.st_size);
+err1:
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char *maildir;
+    const char *mbox, *folder = "";
+    struct maildirpp md;
+    int ret;
+
+    /* Parse cmdline options */
+    while (1) {
+	char c;
+
+	if ((c = getopt(argc, argv, "ehn:No:")) == -1)
+	    break;
+
+	switch (c) {
+	    case 'e':
+		export = 1;
+		break;
+
+	    case 'n':
+		batch = atoi(optarg);
+		if (batch < 1)
+		    batch = 1;
+		break;
+
+	    case 'N':
+		deliver_flags |= MDD_NO_SYNC;
+		break;
+
+	    case 'o':
+		if (!strcmp(optarg, "name"))
+		    by_name = 1;
+		else if (!strcmp(optarg, "date"))
+		    by_name = 0;
+		else {
+		    fprintf(stderr, "Unknown order: %s\n", optarg);
+		    return -1;
+		}
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options] <mbox> [<maildir "
+			"location> [<folder>]]\n", argv[0]);
+		fprintf(stderr, "Imports the mbox to the folder (the INBOX "
+			"by default).\n");
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -e - export the folder to the mbox instead "
+			"(\"-\" for stdout)\n");
+		fprintf(stderr, " -n <n> - fsync every <n> imported messages "
+			"(default %d)\n", MAILDIR_DELIVER_BATCH);
+		fprintf(stderr, " -N - don't fsync at all\n");
+		fprintf(stderr, " -o <order> - export order: date (default) "
+			"or name\n");
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return -1;
+	}
+    }
+
+    if (optind >= argc) {
+	fprintf(stderr, "Use %s -h for help\n", argv[0]);
+	return -1;
+    }
+    mbox = argv[optind++];
+
+    /* Maildir location specified? Use the default otherwise. */
+    if (optind < argc)
+	maildir = g_strdup(argv[optind++]);
+    else {
+	char *home = getenv("HOME");
+	if (!home) abort();
+	maildir = g_strconcat(home, "/Mail", NULL);
+    }
+    if (optind < argc && strcmp(argv[optind], "INBOX"))
+	folder = argv[optind];
+
+    if (maildirpp_open(&md, maildir) != 0)
+	abort();
+
+    struct maildir_tree *node = maildirpp_tree_lookup(&md, folder);
+    if (!node || !node->mdf) {
+	fprintf(stderr, "No such folder: %s\n", folder);
+	ret = -1;
+    } else if (export)
+	ret = export_folder(node->mdf, mbox);
+    else
+	ret = import_mbox(node->mdf, mbox);
+
+    maildirpp_close(&md);
+    g_free(maildir);
+
+    return ret ? 1 : 0;
+}
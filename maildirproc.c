@@ -4,27 +4,323 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
 #include "maildir.h"
+#include "msgid.h"
+#include "search.h"
 
 static volatile int signalled = 0;
+static int stats = 0;
+static int changes = 0;
+static int streaming = 0;
+static int duplicates = 0;
+static const char *index_path = NULL;
+static const char *query = NULL;
+static struct maildirpp_options opts;
 
-static gboolean msg(char *key, struct message *value)
+/* Output formats. */
+enum format {
+    FMT_TEXT,
+    FMT_NDJSON,
+    FMT_BINARY
+};
+
+static enum format format = FMT_TEXT;
+
+/* The binary format is a sequence of records, after the magic "MDP1":
+ *
+ *   'F' <str path>                  -- a folder, its messages follow
+ *   'M' <str name> <byte flags> <num delivered> <str msg_id>
+ *       <num count> <str reference>... -- a message
+ *   'E'                             -- end of the dump
+ *
+ * <num> is an unsigned LEB128 varint, <str> is a <num> length followed by
+ * the bytes (no NUL). flags is the mask of enum message_flags, msg_id is
+ * empty if unknown. */
+
+/* Output buffer, flushed by large writes. */
+#define OUT_BUF_SIZE (1 << 20)
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len = 0;
+
+static void out_write(const char *p, size_t len)
+{
+    while (len > 0) {
+	ssize_t r = write(STDOUT_FILENO, p, len);
+	if (r == -1) {
+	    perror("write"); exit(1);
+	}
+	p += r;
+	len -= r;
+    }
+}
+
+static void out_flush(void)
+{
+    out_write(out_buf, out_len);
+    out_len = 0;
+}
+
+static void out_bytes(const void *p, size_t len)
 {
-    printf("  %s: %s\n", key, value->msg_id ? value->msg_id : "<unknown>");
-    for (int i = 0; i < value->references->len; i++)
-	printf("    %s\n",
-		(char *) g_ptr_array_index(value->references, i));
+    if (out_len + len > OUT_BUF_SIZE) {
+	out_flush();
+	if (len > OUT_BUF_SIZE) {
+	    out_write(p, len); return;
+	}
+    }
+    memcpy(out_buf + out_len, p, len);
+    out_len += len;
+}
+
+static void out_str(const char *s)
+{
+    out_bytes(s, strlen(s));
+}
+
+static void out_char(char c)
+{
+    if (out_len == OUT_BUF_SIZE)
+	out_flush();
+    out_buf[out_len++] = c;
+}
+
+static void out_num(unsigned long long n)
+{
+    do {
+	out_char((n & 0x7f) | (n > 0x7f ? 0x80 : 0));
+	n >>= 7;
+    } while (n);
+}
+
+/* Binary length-prefixed string. */
+static void out_bin_str(const char *s)
+{
+    size_t len = s ? strlen(s) : 0;
+    out_num(len);
+    out_bytes(s, len);
+}
+
+/* JSON string, with the quotes. Bytes which aren't a part of valid UTF-8
+ * (Latin-1 subjects, odd file names) are taken as Latin-1, so the output is
+ * always valid JSON. */
+static void out_json_str(const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out_char('"');
+    for (const char *p = s; *p; ) {
+	const char *end;
+	g_utf8_validate(p, -1, &end);
+
+	for (; p < end; p++) {
+	    unsigned char c = *p;
+	    if (c == '"' || c == '\\') {
+		out_char('\\'); out_char(c);
+	    } else if (c < 0x20) {
+		out_str("\\u00");
+		out_char(hex[c >> 4]); out_char(hex[c & 0xf]);
+	    } else
+		out_char(c);
+	}
+
+	if (*p) {
+	    unsigned char c = *p++;
+	    out_str("\\u00");
+	    out_char(hex[c >> 4]); out_char(hex[c & 0xf]);
+	}
+    }
+    out_char('"');
+}
+
+static void out_start(void)
+{
+    if (format == FMT_TEXT)
+	out_str("Dump:\n");
+    else if (format == FMT_BINARY)
+	out_str("MDP1");
+}
+
+static void out_end(void)
+{
+    if (format == FMT_TEXT)
+	out_str("Dump END.\n");
+    else if (format == FMT_BINARY)
+	out_char('E');
+    out_flush();
+}
+
+static void out_folder(struct maildir_folder *mdf)
+{
+    switch (format) {
+	case FMT_TEXT:
+	    out_str(mdf->path);
+	    out_str(":\n");
+	    break;
+
+	case FMT_NDJSON:
+	    out_str("{\"type\":\"folder\",\"path\":");
+	    out_json_str(mdf->path);
+	    out_str("}\n");
+	    break;
+
+	case FMT_BINARY:
+	    out_char('F');
+	    out_bin_str(mdf->path);
+	    break;
+    }
+}
+
+static void out_message(struct maildir_folder *mdf, struct message *value)
+{
+    /* Maildir flag letters, in the order of enum message_flags. */
+    static const char letters[] = "PRSTDF";
+    char flags[sizeof(letters)], *f = flags;
+    char num[24];
+
+    switch (format) {
+	case FMT_TEXT:
+	    out_str("  ");
+	    out_str(value->name);
+	    out_str(": ");
+	    out_str(value->msg_id ? value->msg_id : "<unknown>");
+	    out_char('\n');
+	    for (int i = 0; i < value->references->len; i++) {
+		out_str("    ");
+		out_str((char *) g_ptr_array_index(value->references, i));
+		out_char('\n');
+	    }
+	    break;
+
+	case FMT_NDJSON:
+	    for (int i = 0; letters[i]; i++)
+		if (value->flags & (1 << i))
+		    *f++ = letters[i];
+	    *f = 0;
+
+	    out_str("{\"type\":\"message\",\"folder\":");
+	    out_json_str(mdf->path);
+	    out_str(",\"name\":");
+	    out_json_str(value->name);
+	    out_str(",\"flags\":");
+	    out_json_str(flags);
+	    out_str(value->flags & MF_NEW ? ",\"new\":true" : ",\"new\":false");
+	    snprintf(num, sizeof(num), "%lld", (long long) value->delivered);
+	    out_str(",\"delivered\":");
+	    out_str(num);
+	    out_str(",\"msg_id\":");
+	    if (value->msg_id)
+		out_json_str(value->msg_id);
+	    else
+		out_str("null");
+	    out_str(",\"references\":[");
+	    for (int i = 0; i < value->references->len; i++) {
+		if (i)
+		    out_char(',');
+		out_json_str((char *) g_ptr_array_index(value->references, i));
+	    }
+	    out_str("]}\n");
+	    break;
+
+	case FMT_BINARY:
+	    out_char('M');
+	    out_bin_str(value->name);
+	    out_char(value->flags);
+	    out_num(value->delivered > 0 ? value->delivered : 0);
+	    out_bin_str(value->msg_id);
+	    out_num(value->references->len);
+	    for (int i = 0; i < value->references->len; i++)
+		out_bin_str((char *) g_ptr_array_index(value->references, i));
+	    break;
+    }
+}
 
+static gboolean msg(char *key, struct message *value,
+	struct maildir_folder *mdf)
+{
+    out_message(mdf, value);
     return FALSE;
 }
 
 static void mailbox(struct maildir_folder *mdf)
 {
-    printf("%s:\n", mdf->path);
-    g_tree_foreach(mdf->messages, (GTraverseFunc) msg, 0);
+    out_folder(mdf);
+    g_tree_foreach(maildir_folder_messages(mdf), (GTraverseFunc) msg, mdf);
+}
+
+/* Streaming mode: print the folder as soon as it is walked... */
+static void stream_folder(struct maildir_folder *mdf)
+{
+    out_folder(mdf);
+}
+
+/* Don't hold the output of a walked folder back. */
+static void stream_folder_post(struct maildir_folder *mdf)
+{
+    out_flush();
+}
+
+/* ... and its messages as soon as they are read, keeping none of them. */
+static void stream_batch(const struct maildir_folder_walk_batch *batch)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(batch->subdir_path);
+
+    memcpy(path, batch->subdir_path, len);
+    for (int i = 0; i < batch->len; i++) {
+	struct message m = { .path = path, .name = path + len,
+	    .flags = batch->flags[i], .subdir = batch->subdir,
+	    .delivered = batch->delivered[i] };
+
+	memcpy(path + len, batch->names[i], batch->name_lens[i] + 1);
+	if (maildirpp_message_read(batch->mdf->md, &m))
+	    continue;
+	out_message(batch->mdf, &m);
+	maildirpp_message_clear(&m);
+    }
+}
+
+/* Print groups of messages with the same msg_id. */
+static void print_duplicates(struct maildirpp *md)
+{
+    GPtrArray *dups = maildirpp_msgid_duplicates(md);
+
+    for (int i = 0; i < dups->len; i++) {
+	const GArray *locs = (const GArray *) g_ptr_array_index(dups, i);
+
+	printf("%s:\n", g_array_index(locs, struct maildir_msg_location,
+		    0).msg->msg_id);
+	for (int j = 0; j < locs->len; j++)
+	    printf("  %s\n", g_array_index(locs, struct maildir_msg_location,
+			j).msg->path);
+    }
+
+    g_ptr_array_free(dups, 1);
+}
+
+/* Print what has changed in the folder since the last fill. */
+static void mailbox_changes(struct maildir_folder *mdf)
+{
+    if (!mdf->changes)
+	return;
+
+    for (int i = 0; i < mdf->changes->len; i++) {
+	struct maildir_change *ch =
+	    &g_array_index(mdf->changes, struct maildir_change, i);
+
+	if (ch->type & MC_ADDED)
+	    printf("+ %s: %s\n", ch->msg->path,
+		    ch->msg->msg_id ? ch->msg->msg_id : "<unknown>");
+	else if (ch->type & MC_REMOVED)
+	    printf("- %s\n", ch->old->path);
+	else
+	    printf("%c%c %s -> %s\n", ch->type & MC_MOVED ? 'M' : ' ',
+		    ch->type & MC_FLAGS ? 'F' : ' ', ch->old->path,
+		    ch->msg->name);
+    }
 }
 
 static void sighandler(int sig)
@@ -40,14 +336,86 @@ int main(int argc, char *argv[])
     while (1) {
 	char c;
 
-	if ((c = getopt(argc, argv, "nhw")) == -1)
+	if ((c = getopt(argc, argv, "cdf:im:no:q:hsvwx:")) == -1)
 	    break;
 
 	switch (c) {
+	    case 'c':
+		changes = 1;
+		break;
+
+	    case 'o':
+		if (!strcmp(optarg, "text"))
+		    format = FMT_TEXT;
+		else if (!strcmp(optarg, "ndjson"))
+		    format = FMT_NDJSON;
+		else if (!strcmp(optarg, "binary"))
+		    format = FMT_BINARY;
+		else {
+		    fprintf(stderr, "Unknown output format: %s\n", optarg);
+		    return -1;
+		}
+		break;
+
+	    case 's':
+		streaming = 1;
+		break;
+
+	    case 'x':
+		index_path = optarg;
+		break;
+
+	    case 'q':
+		query = optarg;
+		break;
+
+	    case 'd':
+		duplicates = 1;
+		opts.flags |= MDO_MSGID_INDEX;
+		break;
+
+	    case 'i':
+		opts.flags |= MDO_INODE_ORDER;
+		break;
+
+	    case 'm':
+		opts.msgs_budget = atoll(optarg) * 1024;
+		break;
+
+	    case 'f':
+		opts.flags |= MDO_LAZY_DIRS;
+		opts.fd_budget = atoi(optarg);
+		break;
+
+	    case 'v':
+		stats = 1;
+		maildirpp_set_verbose(1);
+		break;
+
 	    case 'h':
 		fprintf(stderr, "Usage: %s [options] [<maildir location>]\n",
 			argv[0]);
 		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -c - keep watching the maildir and print "
+			"the changes (with -x, keep the index up to date)\n");
+		fprintf(stderr, " -d - print messages with the same "
+			"Message-ID\n");
+		fprintf(stderr, " -f <n> - keep at most <n> folder dirs "
+			"open\n");
+		fprintf(stderr, " -i - read the messages in inode order "
+			"(faster on disks with cold caches)\n");
+		fprintf(stderr, " -m <KiB> - keep at most about <KiB> of "
+			"messages in memory (not with -d)\n");
+		fprintf(stderr, " -o <format> - output format: text "
+			"(default), ndjson or binary\n");
+		fprintf(stderr, " -q <query> - search the index given by "
+			"-x\n");
+		fprintf(stderr, " -s - print messages as they are read, in "
+			"directory order, without keeping them in memory\n");
+		fprintf(stderr, " -v - be verbose and print statistics at "
+			"exit\n");
+		fprintf(stderr, " -x <file> - update the search index in "
+			"<file>\n");
 		return 0;
 
 	    case ':':
@@ -67,12 +435,46 @@ int main(int argc, char *argv[])
 	maildir = g_strconcat(home, "/Mail", NULL);
     }
 
+    /* Evicted messages would be missing from the Message-ID index. */
+    if (duplicates && opts.msgs_budget) {
+	fprintf(stderr, "-d can't be used with -m\n");
+	return -1;
+    }
+
+    /* Queries need just the index. */
+    if (query) {
+	if (!index_path) {
+	    fprintf(stderr, "-q needs the index, use -x\n");
+	    return -1;
+	}
+
+	struct maildir_search *s = maildir_search_open(index_path);
+	if (!s)
+	    return 1;
+
+	GPtrArray *paths = maildir_search_query(s, query);
+	if (!paths) {
+	    fprintf(stderr, "Bad query: %s\n", query);
+	    maildir_search_close(s);
+	    return -1;
+	}
+	for (int i = 0; i < paths->len; i++) {
+	    printf("%s/%s\n", maildir, (char *) g_ptr_array_index(paths, i));
+	    g_free(g_ptr_array_index(paths, i));
+	}
+	g_ptr_array_free(paths, 1);
+	maildir_search_close(s);
+	g_free(maildir);
+
+	return 0;
+    }
+
     /* And the fun begins here. */
     struct maildirpp md;
 
     signal(SIGINT, sighandler);
     signal(SIGTERM, sighandler);
-    if (maildirpp_open(&md, maildir) != 0)
+    if (maildirpp_open_opts(&md, maildir, &opts) != 0)
 	abort();
 
     do {
@@ -80,18 +482,69 @@ int main(int argc, char *argv[])
 	if (maildirpp_dirty(&md, 0))
 	    maildirpp_refresh_subfolders_list(&md);
 
+	/* The index update walks the dirty folders itself, so with -c it
+	 * keeps the index up to date rather than printing the changes. */
+	if (index_path) {
+	    if (maildirpp_search_update(&md, index_path))
+		break;
+	    if (!changes)
+		break;
+	    maildirpp_pause_if_not_dirty(&md);
+	    continue;
+	}
+
+	if (changes) {
+	    maildirpp_folders_fill(&md, MFD_CHANGES, SD_NEW | SD_CUR);
+	    g_ptr_array_foreach(md.subfolders, (GFunc) mailbox_changes, 0);
+	    fflush(stdout);
+	    maildirpp_pause_if_not_dirty(&md);
+	    continue;
+	}
+
+	if (duplicates) {
+	    maildirpp_folders_fill(&md, MFD_MSGS, SD_NEW | SD_CUR);
+	    print_duplicates(&md);
+	    break;
+	}
+
+	if (streaming) {
+	    GArray *pre = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+	    GArray *post = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+	    GArray *batch = g_array_new(0, 0,
+		    sizeof(maildir_folder_walk_batch_func));
+	    maildir_folder_walk_func ff = stream_folder,
+				     ff2 = stream_folder_post;
+	    maildir_folder_walk_batch_func bf = stream_batch;
+	    g_array_append_val(pre, ff);
+	    g_array_append_val(post, ff2);
+	    g_array_append_val(batch, bf);
+
+	    out_start();
+	    maildirpp_folders_walk_batches(&md, pre, post, NULL, batch,
+		    SD_NEW | SD_CUR);
+	    out_end();
+
+	    g_array_free(batch, 1);
+	    g_array_free(post, 1);
+	    g_array_free(pre, 1);
+	    break;
+	}
+
 	maildirpp_folders_fill(&md, MFD_MSGS,
 		SD_NEW | SD_CUR);
 
-	puts("Dump:");
+	out_start();
 	g_ptr_array_foreach(md.subfolders, (GFunc) mailbox, 0);
-	puts("Dump END.");
+	out_end();
 
 	break;
 
 	maildirpp_pause_if_not_dirty(&md);
     } while (!signalled);
 
+    if (stats)
+	maildirpp_counters_print(&md, stderr);
+
     maildirpp_close(&md);
 
     g_free(maildir);
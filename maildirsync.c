@@ -0,0 +1,501 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Makes one maildir++ a copy of another. Both are walked (just the
+ * directory listings, nothing is stat-ed or opened), and messages are
+ * matched by the unique parts of their names, so a message whose flags
+ * changed is renamed rather than copied again. Missing messages are
+ * hardlinked if both are on the same filesystem, copied with
+ * copy_file_range otherwise. The files which give the flags and folders
+ * their meaning (dovecot-keywords, the subscriptions) are copied as well.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "maildir.h"
+
+/** A message, in the index of its folder by the unique part of the name. */
+struct sync_msg {
+    int subdir; ///< SD_NEW or SD_CUR.
+    char *name;
+};
+
+/** One of the maildirs. */
+struct sync_side {
+    struct maildirpp md;
+    GHashTable *folders; /**< Map of folder path, relative to the maildir
+			  *   (e.g. "." or ".lists"), to a map of unique
+			  *   names to struct sync_msg. */
+};
+
+static int dry_run = 0;
+static int verbose = 0;
+static int remove_extra = 0;
+static int copy_only = 0;
+static int no_sync = 0;
+
+/** Files copied along with the messages of each folder. */
+static const char *const folder_files[] = { "dovecot-keywords", NULL };
+/** Files copied along with the messages of the INBOX (the maildir++). */
+static const char *const root_files[] = { "dovecot-keywords",
+    "subscriptions", "courierimapsubscribed", NULL };
+
+static struct sync_side src, dst;
+static struct sync_side *walked; ///< The side being walked.
+static GHashTable *walked_folder; ///< Its folder being walked.
+static int added, renamed, removed, errors;
+
+static void sync_msg_free(struct sync_msg *m)
+{
+    g_free(m->name);
+    g_slice_free(struct sync_msg, m);
+}
+
+static GHashTable *folder_index_new(void)
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    (GDestroyNotify) sync_msg_free);
+}
+
+/** Path of a folder relative to its maildir. */
+static const char *folder_rel_path(struct maildirpp *md,
+	struct maildir_folder *mdf)
+{
+    const char *rel = mdf->path + strlen(md->path);
+
+    while (*rel == '/')
+	rel++;
+    return rel;
+}
+
+static void index_folder(struct maildir_folder *mdf)
+{
+    walked_folder = folder_index_new();
+    g_hash_table_insert(walked->folders,
+	    g_strdup(folder_rel_path(&walked->md, mdf)), walked_folder);
+}
+
+static void index_batch(const struct maildir_folder_walk_batch *batch)
+{
+    for (int i = 0; i < batch->len; i++) {
+	struct sync_msg *m = g_slice_new(struct sync_msg);
+	m->subdir = batch->subdir;
+	m->name = g_strndup(batch->names[i], batch->name_lens[i]);
+	g_hash_table_insert(walked_folder,
+		g_strndup(m->name, strcspn(m->name, ":")), m);
+    }
+}
+
+/** Open a maildir and index the messages of all its folders. */
+static int side_index(struct sync_side *side, const char *path)
+{
+    if (maildirpp_open(&side->md, path))
+	return -1;
+    side->folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    (GDestroyNotify) g_hash_table_destroy);
+
+    GArray *pre = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+    GArray *post = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+    GArray *batch = g_array_new(0, 0,
+	    sizeof(maildir_folder_walk_batch_func));
+    maildir_folder_walk_func ff = index_folder;
+    maildir_folder_walk_batch_func bf = index_batch;
+    g_array_append_val(pre, ff);
+    g_array_append_val(batch, bf);
+
+    walked = side;
+    maildirpp_folders_walk_batches(&side->md, pre, post, NULL, batch,
+	    SD_NEW | SD_CUR);
+
+    g_array_free(batch, 1);
+    g_array_free(post, 1);
+    g_array_free(pre, 1);
+    return 0;
+}
+
+static void side_close(struct sync_side *side)
+{
+    g_hash_table_destroy(side->folders);
+    maildirpp_close(&side->md);
+}
+
+/** Make a directory, and sync its parent, so that it's there after a
+ * crash.
+ * \return 0 - ok (or it was there), -1 - error.
+ */
+static int make_dir(const char *path)
+{
+    if (mkdir(path, 0700))
+	return errno == EEXIST ? 0 : -1;
+    if (no_sync)
+	return 0;
+
+    char *parent = g_strconcat(path, "/..", NULL);
+    int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC), ret = 0;
+    if (fd == -1 || fsync(fd))
+	ret = -1;
+    if (fd != -1)
+	close(fd);
+    g_free(parent);
+    return ret;
+}
+
+/** Open the subdirs of a folder, creating them if asked to.
+ * \param fds Filled with the fds of new, cur, tmp and the folder itself.
+ * \param create Create the folder, 2 - it's a subfolder of a maildir++,
+ *   mark it with the maildirfolder file.
+ */
+static int folder_open(const char *path, int fds[4], int create)
+{
+    static const char *const subdirs[3] = { "new", "cur", "tmp" };
+    int dir_fd;
+
+    if (create && make_dir(path)) {
+	perror(path); return -1;
+    }
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+	perror(path); return -1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+	if (create && mkdirat(dir_fd, subdirs[i], 0700) && errno != EEXIST)
+	    fds[i] = -1;
+	else
+	    fds[i] = openat(dir_fd, subdirs[i],
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fds[i] == -1) {
+	    fprintf(stderr, "%s/%s: %s\n", path, subdirs[i],
+		    strerror(errno));
+	    goto err;
+	}
+    }
+
+    if (create == 2) {
+	int fd = openat(dir_fd, "maildirfolder",
+		O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+	if (fd == -1) {
+	    fprintf(stderr, "%s/maildirfolder: %s\n", path, strerror(errno));
+	    goto err;
+	}
+	close(fd);
+    }
+    if (create && !no_sync && fsync(dir_fd)) {
+	perror(path); goto err;
+    }
+
+    fds[3] = dir_fd;
+    return 0;
+
+err:
+    for (int i = 0; i < 3 && fds[i] != -1; i++) {
+	close(fds[i]);
+	fds[i] = -1;
+    }
+    close(dir_fd);
+    return -1;
+}
+
+static void folder_close(int fds[4])
+{
+    for (int i = 0; i < 4; i++)
+	if (fds[i] != -1)
+	    close(fds[i]);
+}
+
+/** Copy a message through the destination's tmp/. */
+static int copy_msg(int src_fd, const char *name, int tmp_fd, int dst_fd)
+{
+    char buf[65536];
+    int copy = 1, ret = -1;
+    ssize_t r;
+
+    int in = openat(src_fd, name, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+	return -1;
+    int out = openat(tmp_fd, name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+	    0600);
+    if (out == -1)
+	goto err1;
+
+    while (1) {
+	if (copy) {
+	    r = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+	    if (r == -1 && (errno == EINVAL || errno == EXDEV ||
+			errno == ENOSYS || errno == EOPNOTSUPP)) {
+		copy = 0;
+		continue;
+	    }
+	} else {
+	    r = read(in, buf, sizeof(buf));
+	    for (ssize_t done = 0, w; r > 0 && done < r; done += w)
+		if ((w = write(out, buf + done, r - done)) == -1)
+		    goto err2;
+	}
+	if (r == 0)
+	    break;
+	if (r == -1 && errno != EINTR)
+	    goto err2;
+    }
+
+    if (!no_sync && fdatasync(out))
+	goto err2;
+    if (renameat(tmp_fd, name, dst_fd, name))
+	goto err2;
+    ret = 0;
+
+err2:
+    if (ret)
+	unlinkat(tmp_fd, name, 0);
+    close(out);
+err1:
+    close(in);
+    return ret;
+}
+
+/** Copy the given files of a folder (those which are there), unless the
+ * destination has them already: of the same size, and not older.
+ * \return Whether anything was copied, -1 on error.
+ */
+static int copy_files(const char *rel, const char *src_path,
+	const char *dst_path, int src_fds[4], int dst_fds[4],
+	const char *const *names)
+{
+    int ret = 0;
+
+    for (; *names; names++) {
+	char *s_path = g_strconcat(src_path, "/", *names, NULL),
+	     *d_path = g_strconcat(dst_path, "/", *names, NULL);
+	struct stat ss, ds;
+	int copy = !stat(s_path, &ss) && (stat(d_path, &ds) ||
+		ds.st_size != ss.st_size || ds.st_mtime < ss.st_mtime);
+	g_free(d_path);
+	g_free(s_path);
+	if (!copy)
+	    continue;
+
+	if (dry_run || verbose)
+	    printf("+ %s/%s\n", rel, *names);
+	if (dry_run)
+	    continue;
+	if (copy_msg(src_fds[3], *names, dst_fds[2], dst_fds[3])) {
+	    perror(*names);
+	    ret = -1;
+	} else if (ret == 0)
+	    ret = 1;
+    }
+
+    return ret;
+}
+
+/** Make the destination folder a copy of the source one.
+ * \param sf Index of the source folder, NULL if there's none.
+ * \param df Index of the destination folder, NULL if there's none. The
+ *   matched messages are removed from it.
+ */
+static void sync_folder(const char *rel, GHashTable *sf, GHashTable *df)
+{
+    char *src_path = g_strconcat(src.md.path, "/", rel, NULL),
+	 *dst_path = g_strconcat(dst.md.path, "/", rel, NULL);
+    int src_fds[4] = { -1, -1, -1, -1 }, dst_fds[4] = { -1, -1, -1, -1 };
+    int root = !strcmp(rel, "."), changed = 0;
+
+    if (!dry_run) {
+	if ((sf && folder_open(src_path, src_fds, 0)) ||
+		folder_open(dst_path, dst_fds, df ? 0 : root ? 1 : 2)) {
+	    errors++;
+	    goto out;
+	}
+    }
+
+    /* The keywords first, the flags of the messages refer to them. */
+    if (sf) {
+	int r = copy_files(rel, src_path, dst_path, src_fds, dst_fds,
+		root ? root_files : folder_files);
+	if (r < 0)
+	    errors++;
+	else if (r > 0)
+	    changed = 1;
+    }
+
+    GHashTableIter iter;
+    char *unique;
+    struct sync_msg *s;
+    if (sf)
+	g_hash_table_iter_init(&iter, sf);
+    while (sf && g_hash_table_iter_next(&iter, (void **) &unique,
+		(void **) &s)) {
+	struct sync_msg *d = df ? g_hash_table_lookup(df, unique) : NULL;
+	int s_fd = src_fds[s->subdir == SD_CUR];
+
+	if (d) {
+	    if (d->subdir != s->subdir || strcmp(d->name, s->name)) {
+		/* Flags changed, or moved to cur/. */
+		if (dry_run || verbose)
+		    printf("R %s/%s/%s -> %s/%s\n", rel,
+			    d->subdir == SD_NEW ? "new" : "cur", d->name,
+			    s->subdir == SD_NEW ? "new" : "cur", s->name);
+		if (!dry_run && renameat(dst_fds[d->subdir == SD_CUR],
+			    d->name, dst_fds[s->subdir == SD_CUR], s->name)) {
+		    perror(d->name);
+		    errors++;
+		} else
+		    renamed++, changed = 1;
+	    }
+	    g_hash_table_remove(df, unique);
+	    continue;
+	}
+
+	if (dry_run || verbose)
+	    printf("+ %s/%s/%s\n", rel, s->subdir == SD_NEW ? "new" : "cur",
+		    s->name);
+	if (dry_run) {
+	    added++;
+	    continue;
+	}
+
+	int d_fd = dst_fds[s->subdir == SD_CUR];
+	if (!copy_only && !linkat(s_fd, s->name, d_fd, s->name, 0)) {
+	    added++, changed = 1;
+	    continue;
+	}
+	if (!copy_only && errno != EXDEV && errno != EPERM) {
+	    perror(s->name);
+	    errors++;
+	    continue;
+	}
+	/* Another filesystem, don't try linking again. */
+	copy_only = 1;
+	if (copy_msg(s_fd, s->name, dst_fds[2], d_fd)) {
+	    perror(s->name);
+	    errors++;
+	} else
+	    added++, changed = 1;
+    }
+
+    /* The rest is not in the source. */
+    if (remove_extra && df) {
+	struct sync_msg *d;
+	g_hash_table_iter_init(&iter, df);
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &d)) {
+	    if (dry_run || verbose)
+		printf("- %s/%s/%s\n", rel,
+			d->subdir == SD_NEW ? "new" : "cur", d->name);
+	    if (!dry_run && unlinkat(dst_fds[d->subdir == SD_CUR], d->name,
+			0)) {
+		perror(d->name);
+		errors++;
+	    } else
+		removed++, changed = 1;
+	}
+    }
+
+    /* Make the new names durable. */
+    if (changed && !dry_run && !no_sync)
+	for (int i = 0; i < 4; i++)
+	    if (i != 2)
+		fsync(dst_fds[i]);
+
+out:
+    folder_close(src_fds);
+    folder_close(dst_fds);
+    g_free(dst_path);
+    g_free(src_path);
+}
+
+int main(int argc, char *argv[])
+{
+    /* Parse cmdline options */
+    while (1) {
+	char c;
+
+	if ((c = getopt(argc, argv, "cdhnNv")) == -1)
+	    break;
+
+	switch (c) {
+	    case 'c':
+		copy_only = 1;
+		break;
+
+	    case 'd':
+		remove_extra = 1;
+		break;
+
+	    case 'n':
+		dry_run = 1;
+		break;
+
+	    case 'N':
+		no_sync = 1;
+		break;
+
+	    case 'v':
+		verbose = 1;
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options] <source maildir> "
+			"<destination maildir>\n", argv[0]);
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -c - copy messages, don't hardlink them\n");
+		fprintf(stderr, " -d - delete messages not in the source\n");
+		fprintf(stderr, " -n - just print the differences\n");
+		fprintf(stderr, " -N - don't fsync\n");
+		fprintf(stderr, " -v - print the changes made\n");
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return -1;
+	}
+    }
+
+    if (argc - optind != 2) {
+	fprintf(stderr, "Use %s -h for help\n", argv[0]);
+	return -1;
+    }
+
+    /* The destination may be a new one. */
+    if (!dry_run && make_dir(argv[optind + 1])) {
+	perror(argv[optind + 1]);
+	return -1;
+    }
+
+    if (side_index(&src, argv[optind]) || side_index(&dst, argv[optind + 1]))
+	return -1;
+
+    /* Sorted, so that the output is stable. */
+    GList *rels = g_list_sort(g_hash_table_get_keys(src.folders),
+	    (GCompareFunc) strcmp);
+    for (GList *l = rels; l; l = l->next)
+	sync_folder((char *) l->data,
+		g_hash_table_lookup(src.folders, l->data),
+		g_hash_table_lookup(dst.folders, l->data));
+    g_list_free(rels);
+
+    if (remove_extra) {
+	rels = g_list_sort(g_hash_table_get_keys(dst.folders),
+		(GCompareFunc) strcmp);
+	for (GList *l = rels; l; l = l->next)
+	    if (!g_hash_table_lookup(src.folders, l->data))
+		sync_folder((char *) l->data, NULL,
+			g_hash_table_lookup(dst.folders, l->data));
+	g_list_free(rels);
+    }
+
+    fprintf(stderr, "%d added, %d renamed, %d removed, %d errors\n",
+	    added, renamed, removed, errors);
+
+    side_close(&dst);
+    side_close(&src);
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Index of messages by msg_id, across all folders of a maildir++. It is
+ * kept with MDO_MSGID_INDEX, and updated by the message indexing walker as
+ * messages enter and leave the folders' #messages trees, so it covers the
+ * folders filled with MFD_MSGS.
+ *
+ * Each msg_id maps to the list of its locations. Those with more than one
+ * location are also kept in a second table, so duplicates are found
+ * without looking at the unique ones.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include "msgid.h"
+
+/** Find the locations of messages with the given msg_id.
+ * \return List of struct maildir_msg_location, NULL if there are none (or
+ *   the maildir++ was not opened with MDO_MSGID_INDEX). Valid until the
+ *   next fill.
+ */
+const GArray *maildirpp_msgid_lookup(struct maildirpp *md,
+	const char *msg_id)
+{
+    if (!md->msgid_index)
+	return NULL;
+
+    return g_hash_table_lookup(md->msgid_index, msg_id);
+}
+
+/** List the msg_ids found in more than one place.
+ * \return List of <code>const GArray *</code> of struct
+ *   maildir_msg_location, as returned by #maildirpp_msgid_lookup. Free it
+ *   with <code>g_ptr_array_free(dups, 1)</code>.
+ */
+GPtrArray *maildirpp_msgid_duplicates(struct maildirpp *md)
+{
+    GPtrArray *dups = g_ptr_array_new();
+
+    if (md->msgid_dups) {
+	GHashTableIter iter;
+	void *locs;
+
+	g_hash_table_iter_init(&iter, md->msgid_dups);
+	while (g_hash_table_iter_next(&iter, NULL, &locs))
+	    g_ptr_array_add(dups, locs);
+    }
+
+    return dups;
+}
+
+/** Free the list of locations of a msg_id. */
+static void msgid_locations_free(GArray *locs)
+{
+    g_array_free(locs, 1);
+}
+
+/** Index a message that has entered the #messages of a folder. */
+void maildirpp_msgid_add(struct maildir_folder *mdf, struct message *msg)
+{
+    struct maildirpp *md = mdf->md;
+
+    if (!(md->opts.flags & MDO_MSGID_INDEX) || !msg->msg_id)
+	return;
+
+    if (!md->msgid_index) {
+	md->msgid_index = g_hash_table_new_full(g_str_hash, g_str_equal,
+		g_free, (GDestroyNotify) msgid_locations_free);
+	md->msgid_dups = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    char *key;
+    GArray *locs;
+    if (!g_hash_table_lookup_extended(md->msgid_index, msg->msg_id,
+		(void **) &key, (void **) &locs)) {
+	key = g_strdup(msg->msg_id);
+	locs = g_array_sized_new(0, 0, sizeof(struct maildir_msg_location),
+		1);
+	g_hash_table_insert(md->msgid_index, key, locs);
+    }
+
+    struct maildir_msg_location loc = { .mdf = mdf, .msg = msg };
+    g_array_append_val(locs, loc);
+    if (locs->len == 2)
+	g_hash_table_insert(md->msgid_dups, key, locs);
+}
+
+/** Remove a message leaving the #messages of a folder from the index. */
+void maildirpp_msgid_remove(struct maildir_folder *mdf, struct message *msg)
+{
+    struct maildirpp *md = mdf->md;
+
+    if (!md->msgid_index || !msg->msg_id)
+	return;
+
+    char *key;
+    GArray *locs;
+    if (!g_hash_table_lookup_extended(md->msgid_index, msg->msg_id,
+		(void **) &key, (void **) &locs))
+	return;
+
+    for (int i = 0; i < locs->len; i++)
+	if (g_array_index(locs, struct maildir_msg_location, i).msg == msg) {
+	    g_array_remove_index_fast(locs, i);
+	    break;
+	}
+
+    if (locs->len == 1)
+	g_hash_table_remove(md->msgid_dups, key);
+    else if (locs->len == 0)
+	g_hash_table_remove(md->msgid_index, key);
+}
+
+/** Free the index. */
+void maildirpp_msgid_free(struct maildirpp *md)
+{
+    if (md->msgid_index) {
+	g_hash_table_destroy(md->msgid_dups);
+	g_hash_table_destroy(md->msgid_index);
+	md->msgid_dups = md->msgid_index = NULL;
+    }
+}
@@ -0,0 +1,25 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#ifndef MSGID_H
+#define MSGID_H
+
+#define _GNU_SOURCE
+#include "maildir.h"
+
+/** Where a message with a given msg_id is, see #maildirpp_msgid_lookup. */
+struct maildir_msg_location {
+    struct maildir_folder *mdf;
+    struct message *msg;
+};
+
+const GArray *maildirpp_msgid_lookup(struct maildirpp *md,
+	const char *msg_id);
+GPtrArray *maildirpp_msgid_duplicates(struct maildirpp *md);
+
+/* Used by the message indexing walker. */
+void maildirpp_msgid_add(struct maildir_folder *mdf, struct message *msg);
+void maildirpp_msgid_remove(struct maildir_folder *mdf, struct message *msg);
+void maildirpp_msgid_free(struct maildirpp *md);
+
+#endif /* MSGID_H */
@@ -0,0 +1,31 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT static tracepoints of the "maildirpp" provider. With sys/sdt.h
+ * available (HAVE_SDT), each of them compiles to a single nop and a note in
+ * the binary, which perf, bpftrace or systemtap can attach to, e.g.:
+ *
+ *   bpftrace -e 'usdt:./libmaildirpp.so:maildirpp:message__parse__end
+ *       { @bytes = hist(arg1); }'
+ *
+ * Without sys/sdt.h they are left out. Probe arguments must not have side
+ * effects. */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE0(name) STAP_PROBE(maildirpp, name)
+#define PROBE1(name, a) STAP_PROBE1(maildirpp, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(maildirpp, name, a, b)
+#define PROBE3(name, a, b, c) STAP_PROBE3(maildirpp, name, a, b, c)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { (void) (a); } while (0)
+#define PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c) \
+    do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif
+
+#endif /* PROBES_H */
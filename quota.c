@@ -0,0 +1,219 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Maildir++ quota: the maildirsize file in the maildir++ has the quota
+ * definition (e.g. "1000000S,1000C") on the first line. Each following line
+ * has two numbers, a size and a message count. They are deltas, the usage is
+ * their sum. Deliveries append a line, readers sum them up, and once the file
+ * grows over 5120 bytes, it's rewritten with a single line of totals.
+ *
+ * The usage comes from the hierarchy totals of the walked folders, see
+ * #maildirpp_quota_update, so no messages need to be stat-ed for it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "quota.h"
+
+/** Rewrite the file once it's bigger than this. (Maildir++ says so.) */
+#define QUOTA_FILE_MAX 5120
+
+static char *quota_path(struct maildirpp *md);
+
+static char *quota_path(struct maildirpp *md)
+{
+    return g_strconcat(md->path, "/maildirsize", NULL);
+}
+
+/** Read the maildirsize file.
+ * \return 0 - ok, 1 - there's no maildirsize file (no quota), -1 - error.
+ */
+int maildirpp_quota_read(struct maildirpp *md, struct maildir_quota *q)
+{
+    char *path = quota_path(md);
+    char line[256];
+
+    memset(q, 0, sizeof(struct maildir_quota));
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+	int ret = errno == ENOENT ? 1 : -1;
+	if (ret == -1)
+	    perror(path);
+	g_free(path);
+	return ret;
+    }
+
+    /* The definition */
+    if (fgets(line, sizeof(line), f)) {
+	for (char *p = line; *p; ) {
+	    char *end;
+	    long long val = strtoll(p, &end, 10);
+	    if (end == p)
+		break;
+	    if (*end == 'S')
+		q->size_limit = val;
+	    else if (*end == 'C')
+		q->count_limit = val;
+	    else
+		break;
+	    p = end + 1;
+	    if (*p == ',')
+		p++;
+	}
+    }
+
+    /* The usage */
+    while (fgets(line, sizeof(line), f)) {
+	long long size, count;
+	if (sscanf(line, "%lld %lld", &size, &count) == 2) {
+	    q->size += size;
+	    q->count += count;
+	}
+    }
+
+    q->file_size = ftell(f);
+    fclose(f);
+    g_free(path);
+
+    return 0;
+}
+
+/** Write a new maildirsize file with the given definition and usage. It's
+ * written to tmp/ and renamed, so readers never see it half-written. The
+ * rename is expected, so it doesn't make the maildir++ dirty.
+ * \return 0 - ok, -1 - error.
+ */
+int maildirpp_quota_write(struct maildirpp *md,
+	const struct maildir_quota *q)
+{
+    char *path = quota_path(md);
+    char *tmp = g_strdup_printf("%s/tmp/%ld.%d.maildirsize", md->path,
+	    (long) time(0), (int) getpid());
+    int ret = -1;
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+	perror(tmp); goto out;
+    }
+
+    if (q->size_limit)
+	fprintf(f, "%lldS", q->size_limit);
+    if (q->size_limit && q->count_limit)
+	fputc(',', f);
+    if (q->count_limit)
+	fprintf(f, "%lldC", q->count_limit);
+    fprintf(f, "\n%12lld %12lld\n", q->size, q->count);
+
+    if (fclose(f)) {
+	perror(tmp); unlink(tmp); goto out;
+    }
+
+    maildirpp_expect(md, "maildirsize");
+    if (rename(tmp, path)) {
+	perror(path); unlink(tmp); maildirpp_expect_end(md); goto out;
+    }
+    maildirpp_expect_end(md);
+
+    ret = 0;
+
+out:
+    g_free(tmp);
+    g_free(path);
+    return ret;
+}
+
+/** Record a change of usage, e.g. after a delivery, by appending a line to
+ * the maildirsize file. Does nothing if there's no such file.
+ * \return 0 - ok, -1 - error.
+ */
+int maildirpp_quota_add(struct maildirpp *md, long long size,
+	long long count)
+{
+    return maildir_quota_add(md->path, size, count);
+}
+
+/** Like #maildirpp_quota_add, for those who don't have the maildir++ open.
+ * \param root Path of the maildir++.
+ * \return 0 - ok, -1 - error.
+ */
+int maildir_quota_add(const char *root, long long size, long long count)
+{
+    char *path = g_strconcat(root, "/maildirsize", NULL);
+    char line[64];
+    int ret = 0;
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1) {
+	if (errno != ENOENT) {
+	    perror(path); ret = -1;
+	}
+	g_free(path);
+	return ret;
+    }
+
+    /* One write, so that concurrent appends don't mix. */
+    int len = snprintf(line, sizeof(line), "%lld %lld\n", size, count);
+    if (write(fd, line, len) != len) {
+	perror(path); ret = -1;
+    }
+
+    close(fd);
+    g_free(path);
+
+    return ret;
+}
+
+/** Bring the maildirsize file up to date with the stats of the maildir++:
+ * append the difference between the usage it records and the totals of the
+ * folder hierarchy, or rewrite it if it has grown too big. The totals are
+ * maintained incrementally by #maildirpp_folders_fill, so this costs
+ * O(size of the maildirsize file), not O(messages).
+ *
+ * All folders must have been filled with MFD_SIZES (or all messages must
+ * have the S= field), walking both SD_NEW and SD_CUR. Until then, nothing
+ * is done.
+ *
+ * \return 0 - ok, 1 - there's no maildirsize file, 2 - the totals are not
+ *   complete yet, -1 - error.
+ */
+int maildirpp_quota_update(struct maildirpp *md)
+{
+    struct maildir_quota q;
+    int ret;
+
+    assert(md->tree != NULL);
+    const struct maildir_folder_stats *total = &md->tree->total;
+
+    for (int i = 0; i < md->subfolders->len; i++) {
+	struct maildir_folder *mdf =
+	    (struct maildir_folder *) g_ptr_array_index(md->subfolders, i);
+	if (!mdf->stats || mdf->walked != (SD_NEW | SD_CUR))
+	    return 2;
+    }
+
+    if (total->unsized)
+	return 2;
+
+    if ((ret = maildirpp_quota_read(md, &q)))
+	return ret;
+
+    long long dsize = total->size - q.size, dcount = total->msgs - q.count;
+    if (!dsize && !dcount)
+	return 0;
+
+    if (q.file_size + 64 > QUOTA_FILE_MAX) {
+	q.size = total->size;
+	q.count = total->msgs;
+	return maildirpp_quota_write(md, &q);
+    }
+
+    return maildirpp_quota_add(md, dsize, dcount);
+}
@@ -0,0 +1,25 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#define _GNU_SOURCE
+#include "maildir.h"
+
+/** Maildir++ quota, as recorded in the maildirsize file. */
+struct maildir_quota {
+    long long size_limit, count_limit; ///< 0 - no limit.
+    long long size, count; ///< Current usage.
+    long file_size; ///< Size of the maildirsize file.
+};
+
+int maildirpp_quota_read(struct maildirpp *md, struct maildir_quota *q);
+int maildirpp_quota_write(struct maildirpp *md,
+	const struct maildir_quota *q);
+int maildirpp_quota_add(struct maildirpp *md, long long size,
+	long long count);
+int maildir_quota_add(const char *root, long long size, long long count);
+int maildirpp_quota_update(struct maildirpp *md);
+
+#endif /* QUOTA_H */
@@ -39,6 +39,9 @@ static void ptr_array_append(GPtrArray *dest, GPtrArray *src);
 struct rfc822_header;
 static void parse_rfc822_line (struct rfc822_header *hdr, char *line,
 	char *p);
+static void parse_extra_field (struct rfc822_header *hdr, const char *line,
+	const char *p);
+static char *join_fields (char **values, int n);
 
 
 #define STRING 256
@@ -211,8 +214,43 @@ struct rfc822_header {
     char *msg_id; ///< The message ID.
     GPtrArray *references, ///< List of <code>char *</code>.
 	      *in_reply_tos; ///< List of <code>char *</code>.
+    const GPtrArray *fields; ///< Names of the extra fields, may be NULL.
+    char **values; ///< Of the extra fields, NULL if not found (yet).
 };
 
+/** Keep the value of an extra field, the first one if it's repeated. */
+static void parse_extra_field (struct rfc822_header *hdr, const char *line,
+	const char *p)
+{
+  for (int i = 0; i < hdr->fields->len; i++)
+    if (!hdr->values[i] &&
+	!strcasecmp (line, g_ptr_array_index (hdr->fields, i)))
+    {
+      hdr->values[i] = g_strdup (p);
+      break;
+    }
+}
+
+/** Join the values of the extra fields to one block, for
+ * message.fields. */
+static char *join_fields (char **values, int n)
+{
+  size_t len = 0;
+  char *ret, *p;
+
+  for (int i = 0; i < n; i++)
+    len += (values[i] ? strlen (values[i]) : 0) + 1;
+
+  ret = p = g_malloc (len);
+  for (int i = 0; i < n; i++)
+  {
+    p = stpcpy (p, values[i] ? values[i] : "") + 1;
+    g_free (values[i]);
+  }
+
+  return ret;
+}
+
 static void parse_rfc822_line (struct rfc822_header *hdr, char *line, char *p)
 {
   switch (tolower ((int) line[0]))
@@ -246,7 +284,12 @@ static void parse_rfc822_line (struct rfc822_header *hdr, char *line, char *p)
   }
 }
 
-void read_rfc822_header (FILE *f, struct message *msg)
+/** Read the header of a message: the msg_id and references, and the
+ * given extra fields to message.fields (if any). The Date: is parsed to
+ * message.date, if it's among them.
+ */
+void read_rfc822_header (FILE *f, struct message *msg,
+	const GPtrArray *fields)
 {
   char *line = g_malloc (LONG_STRING);
   char *p;
@@ -256,6 +299,8 @@ void read_rfc822_header (FILE *f, struct message *msg)
   hdr.msg_id = NULL;
   hdr.references = g_ptr_array_new ();
   hdr.in_reply_tos = g_ptr_array_new ();
+  hdr.fields = fields && fields->len ? fields : NULL;
+  hdr.values = hdr.fields ? g_new0 (char *, fields->len) : NULL;
 
   while (*(line = read_rfc822_line (f, line, &linelen)) != 0)
   {
@@ -272,6 +317,9 @@ void read_rfc822_header (FILE *f, struct message *msg)
     if (!*p)
       continue; /* skip empty header fields */
 
+    /* Before the line gets chopped by the parsers. */
+    if (hdr.fields)
+      parse_extra_field (&hdr, line, p);
     parse_rfc822_line (&hdr, line, p);
 
   }
@@ -282,5 +330,97 @@ void read_rfc822_header (FILE *f, struct message *msg)
   ptr_array_append (msg->references, hdr.in_reply_tos);
   g_ptr_array_free (hdr.in_reply_tos, 1);
 
+  if (hdr.fields)
+  {
+    for (int i = 0; i < fields->len; i++)
+      if (hdr.values[i] &&
+	  !strcasecmp (g_ptr_array_index (fields, i), "date"))
+	msg->date = parse_rfc822_date (hdr.values[i]);
+    msg->fields = join_fields (hdr.values, fields->len);
+    msg->n_fields = fields->len;
+    g_free (hdr.values);
+  }
+
+  g_free (line);
+}
+
+/** Parse the value of a Date: field, like "Tue, 1 Jul 2003 10:52:37 +0200".
+ * The day of the week, the seconds and the zone (UTC then) may be missing,
+ * two digit years are taken as RFC 2822 says.
+ *
+ * \return The time, 0 if it can't be parsed.
+ */
+time_t parse_rfc822_date (const char *s)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  struct tm tm = { 0 };
+  char mon[4];
+  int year, n;
+  long offset = 0;
+  time_t t;
+
+  SKIPWS (s);
+  while (isalpha ((int) *s))
+    s++;
+  if (*s == ',')
+    s++;
+
+  if (sscanf (s, "%d %3s %d %d:%d%n", &tm.tm_mday, mon, &year,
+	      &tm.tm_hour, &tm.tm_min, &n) != 5)
+    return 0;
+  s += n;
+  if (*s == ':' && sscanf (s, ":%d%n", &tm.tm_sec, &n) == 1)
+    s += n;
+
+  for (tm.tm_mon = 0; tm.tm_mon < 12; tm.tm_mon++)
+    if (!strncasecmp (mon, months + 3 * tm.tm_mon, 3))
+      break;
+  if (tm.tm_mon == 12)
+    return 0;
+
+  if (year < 50)
+    year += 2000;
+  else if (year < 1000)
+    year += 1900;
+  tm.tm_year = year - 1900;
+
+  /* Numeric zones only, the obsolete names are rare enough. */
+  SKIPWS (s);
+  if ((*s == '+' || *s == '-') && isdigit ((int) s[1]))
+  {
+    int zone = atoi (s + 1);
+    offset = (zone / 100 * 60 + zone % 100) * 60;
+    if (*s == '-')
+      offset = -offset;
+  }
+
+  t = timegm (&tm);
+  return t == -1 ? 0 : t - offset;
+}
+
+/** Read the headers up to the Date: field.
+ *
+ * \return The date, 0 if there's none or it can't be parsed.
+ */
+time_t read_rfc822_date (FILE *f)
+{
+  size_t linelen = LONG_STRING;
+  char *line = g_malloc (linelen);
+  char *p;
+  time_t ret = 0;
+
+  while (*(line = read_rfc822_line (f, line, &linelen)) != 0)
+  {
+    if ((p = strchr (line, ':')) == NULL)
+      continue;
+    *p = 0;
+    if (!strcasecmp (line, "date"))
+    {
+      ret = parse_rfc822_date (p + 1);
+      break;
+    }
+  }
+
   g_free (line);
+  return ret;
 }
@@ -6,8 +6,12 @@
 
 #define _GNU_SOURCE
 #include <glib.h>
+#include <time.h>
 #include "maildir.h"
 
-void read_rfc822_header (FILE *f, struct message *msg);
+void read_rfc822_header (FILE *f, struct message *msg,
+	const GPtrArray *fields);
+time_t parse_rfc822_date (const char *s);
+time_t read_rfc822_date (FILE *f);
 
 #endif /* RFC822_H */
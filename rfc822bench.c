@@ -0,0 +1,327 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Microbenchmark and golden-corpus check for the rfc822 header parser.
+ *
+ * Every corpus entry is fed through read_rfc822_header from memory in a tight
+ * loop. The first pass over each entry compares the results against the
+ * golden msg_id and references, so an optimisation of the parser can be
+ * checked for both speed and correctness with a single run.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rfc822.h"
+
+#define MAX_REFS 8
+
+/** A corpus entry and its golden result. */
+struct corpus_entry {
+    const char *name;
+    char *header; ///< Generated entries are filled in by #corpus_init.
+    const char *msg_id; ///< NULL if none is expected.
+    const char *refs[MAX_REFS]; ///< NULL terminated.
+};
+
+static struct corpus_entry corpus[] = {
+    { "simple",
+	"From: Joe <joe@example.org>\n"
+	"To: list@example.org\n"
+	"Subject: Hello\n"
+	"Message-ID: <20070101120000.GA1234@example.org>\n"
+	"\n"
+	"Body.\n",
+	"<20070101120000.GA1234@example.org>",
+	{ NULL } },
+
+    { "folded-references",
+	"Message-ID: <reply3.20070102@example.org>\n"
+	"References: <root.20070101@example.org>\n"
+	"\t<reply1.20070101@example.org>\n"
+	"  <reply2.20070102@example.org>\n"
+	"In-Reply-To: <reply2.20070102@example.org>\n"
+	"Subject: Re: Hello\n"
+	"\n",
+	"<reply3.20070102@example.org>",
+	/* In-Reply-To:s are appended as they are, even if already present
+	 * in References. */
+	{ "<root.20070101@example.org>", "<reply1.20070101@example.org>",
+	    "<reply2.20070102@example.org>", "<reply2.20070102@example.org>",
+	    NULL } },
+
+    { "split-ids",
+	"Message-ID: <split.20070103@example.org>\n"
+	"References: <first-half\n"
+	" second-half@example.org> <whole.20070103@example.org>\n"
+	"In-Reply-To: <broken.20070103\n"
+	" @example.org>\n"
+	"\n",
+	"<split.20070103@example.org>",
+	{ "<first-halfsecond-half@example.org>",
+	    "<whole.20070103@example.org>",
+	    "<broken.20070103@example.org>", NULL } },
+
+    { "in-reply-to-garbage",
+	"Message-Id: <garbage.20070104@example.org>\n"
+	"In-Reply-To: <joe@example.org>; from joe@example.org on Thu\n"
+	"References: not-an-id <no-at-sign> <two@at@signs>\n"
+	"\n",
+	"<garbage.20070104@example.org>",
+	{ NULL } },
+
+    { "resent-message-id",
+	"Resent-Message-ID: <resent.20070105@example.org>\n"
+	"References: <dup.20070105@example.org> <dup.20070105@example.org>\n"
+	"In-Reply-To: <dup.20070105@example.org>\n"
+	"\n",
+	"<resent.20070105@example.org>",
+	{ "<dup.20070105@example.org>", "<dup.20070105@example.org>", NULL } },
+
+    { "crlf",
+	"Return-Path: <joe@example.org>\r\n"
+	"Message-ID: <crlf.20070106@example.org>\r\n"
+	"References: <root.20070106@example.org>\r\n"
+	" <parent.20070106@example.org>\r\n"
+	"Subject: CRLF\r\n"
+	"\r\n"
+	"Body.\r\n",
+	"<crlf.20070106@example.org>",
+	{ "<root.20070106@example.org>", "<parent.20070106@example.org>",
+	    NULL } },
+
+    { "missing-blank-line",
+	"Subject: No body\n"
+	"Message-ID: <nobody.20070107@example.org>\n",
+	"<nobody.20070107@example.org>",
+	{ NULL } },
+
+    { "no-message-id",
+	"From: Joe <joe@example.org>\n"
+	"Subject: Anonymous\n"
+	"X-Empty:\n"
+	"\n",
+	NULL,
+	{ NULL } },
+
+    /* Generated entries follow. */
+    { "received-chain", NULL,
+	"<received.20070108@example.org>",
+	{ "<root.20070108@example.org>", NULL } },
+
+    { "long-references", NULL,
+	"<long.20070109@example.org>",
+	{ "<ref0.20070109@example.org>", "<ref1.20070109@example.org>",
+	    "<ref2.20070109@example.org>", "<ref3.20070109@example.org>",
+	    "<ref4.20070109@example.org>", "<ref5.20070109@example.org>",
+	    "<ref6.20070109@example.org>", NULL } },
+};
+
+#define CORPUS_LEN (sizeof(corpus) / sizeof(corpus[0]))
+
+/** Generate the entries that are too big to be written out by hand. */
+static void corpus_init(void)
+{
+    GString *s;
+
+    /* A long chain of folded Received headers, as seen on mail that went
+     * through a few mailing list servers. */
+    s = g_string_new("Return-Path: <list-bounces@example.org>\n");
+    for (int i = 0; i < 60; i++)
+	g_string_append_printf(s,
+		"Received: from relay%d.example.org (relay%d.example.org "
+		"[192.0.2.%d])\n"
+		"\tby mx%d.example.org (Postfix) with ESMTP id %08X\n"
+		"\tfor <joe@example.org>; Mon,  8 Jan 2007 12:%02d:00 +0100 "
+		"(CET)\n", i, i, i % 250, i + 1, 0xabc000 + i, i % 60);
+    g_string_append(s,
+	    "Message-ID: <received.20070108@example.org>\n"
+	    "References: <root.20070108@example.org>\n"
+	    "\n"
+	    "Body.\n");
+    corpus[CORPUS_LEN - 2].header = g_string_free(s, 0);
+
+    /* A single References line far longer than the initial line buffer. */
+    s = g_string_new("Message-ID: <long.20070109@example.org>\nReferences:");
+    for (int i = 0; i < 7; i++)
+	g_string_append_printf(s, " <ref%d.20070109@example.org>", i);
+    g_string_append(s, " ");
+    for (int i = 0; i < 200; i++)
+	g_string_append(s, "garbage-");
+    g_string_append(s, "\n\n");
+    corpus[CORPUS_LEN - 1].header = g_string_free(s, 0);
+}
+
+/** Free what read_rfc822_header filled in. */
+static void message_clear(struct message *msg)
+{
+    g_free(msg->msg_id);
+    g_ptr_array_foreach(msg->references, (GFunc) g_free, 0);
+    g_ptr_array_free(msg->references, 1);
+    memset(msg, 0, sizeof(struct message));
+}
+
+/** Open a header in memory as a stream, for #parse. */
+static FILE *open_header(const char *header, size_t len)
+{
+    FILE *f = fmemopen((void *) header, len, "r");
+    if (!f)
+	perror("fmemopen");
+    return f;
+}
+
+/** Parse a header from a stream opened by #open_header, from its start.
+ * The stream is only rewound, so the timed loop doesn't measure the stdio
+ * setup. */
+static void parse(FILE *f, struct message *msg)
+{
+    rewind(f);
+    memset(msg, 0, sizeof(struct message));
+    read_rfc822_header(f, msg, NULL);
+}
+
+/** Compare the results with the golden ones.
+ * \return 0 - match, -1 - mismatch.
+ */
+static int check(const struct corpus_entry *e, const struct message *msg)
+{
+    int ret = 0;
+    int nrefs = 0;
+
+    if (g_strcmp0(e->msg_id, msg->msg_id)) {
+	fprintf(stderr, "%s: msg_id: expected %s, got %s\n", e->name,
+		e->msg_id ? e->msg_id : "(none)",
+		msg->msg_id ? msg->msg_id : "(none)");
+	ret = -1;
+    }
+
+    while (nrefs < MAX_REFS && e->refs[nrefs])
+	nrefs++;
+
+    for (int i = 0; i < nrefs || i < msg->references->len; i++) {
+	const char *exp = i < nrefs ? e->refs[i] : NULL;
+	const char *got = i < msg->references->len ?
+	    (const char *) g_ptr_array_index(msg->references, i) : NULL;
+
+	if (g_strcmp0(exp, got)) {
+	    fprintf(stderr, "%s: reference %d: expected %s, got %s\n",
+		    e->name, i, exp ? exp : "(none)", got ? got : "(none)");
+	    ret = -1;
+	}
+    }
+
+    return ret;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 100000;
+    int check_only = 0;
+
+    /* Parse cmdline options */
+    while (1) {
+	char c;
+
+	if ((c = getopt(argc, argv, "chn:")) == -1)
+	    break;
+
+	switch (c) {
+	    case 'c':
+		check_only = 1;
+		break;
+
+	    case 'n':
+		iterations = atol(optarg);
+		if (iterations < 1) {
+		    fprintf(stderr, "Bad iteration count: %s\n", optarg);
+		    return -1;
+		}
+		break;
+
+	    case 'h':
+		fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+		fprintf(stderr, " -h - this message\n");
+		fprintf(stderr, " -c - only check against the golden results\n");
+		fprintf(stderr, " -n <count> - iterations per corpus entry "
+			"(default %ld)\n", iterations);
+		return 0;
+
+	    case ':':
+	    case '?':
+	    default:
+		fprintf(stderr, "Use %s -h for help\n", argv[0]);
+		return -1;
+	}
+    }
+
+    corpus_init();
+
+    /* Golden check first. */
+    int failed = 0;
+    for (int i = 0; i < CORPUS_LEN; i++) {
+	struct message msg;
+	FILE *f = open_header(corpus[i].header, strlen(corpus[i].header));
+	if (!f)
+	    return -1;
+	parse(f, &msg);
+	fclose(f);
+	if (check(&corpus[i], &msg))
+	    failed++;
+	message_clear(&msg);
+    }
+
+    if (failed) {
+	fprintf(stderr, "%d of %d corpus entries differ from the golden "
+		"results\n", failed, (int) CORPUS_LEN);
+	return 1;
+    }
+
+    if (check_only) {
+	printf("All %d corpus entries match.\n", (int) CORPUS_LEN);
+	return 0;
+    }
+
+    /* And now the benchmark. */
+    double total_time = 0, total_bytes = 0;
+
+    printf("%-22s %8s %10s %10s\n", "entry", "bytes", "ns/msg", "MB/s");
+    for (int i = 0; i < CORPUS_LEN; i++) {
+	size_t len = strlen(corpus[i].header);
+	struct message msg;
+	FILE *f = open_header(corpus[i].header, len);
+	if (!f)
+	    return -1;
+
+	double start = now();
+	for (long j = 0; j < iterations; j++) {
+	    parse(f, &msg);
+	    message_clear(&msg);
+	}
+	double t = now() - start;
+	fclose(f);
+
+	printf("%-22s %8zu %10.1f %10.1f\n", corpus[i].name, len,
+		t * 1e9 / iterations, len * iterations / t / 1e6);
+	total_time += t;
+	total_bytes += (double) len * iterations;
+    }
+
+    printf("%-22s %8s %10.1f %10.1f\n", "total", "",
+	    total_time * 1e9 / (iterations * CORPUS_LEN),
+	    total_bytes / total_time / 1e6);
+
+    for (int i = CORPUS_LEN - 2; i < CORPUS_LEN; i++)
+	g_free(corpus[i].header);
+
+    return 0;
+}
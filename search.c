@@ -0,0 +1,1173 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+/* Full-text search index.
+ *
+ * The index is a single file with an inverted index of the From, To and
+ * Subject headers and the text parts of the bodies (base64 and
+ * quoted-printable decoded). Header words are indexed both as they are and
+ * with a "from:", "to:" or "subject:" prefix, so queries can be limited to
+ * a header. Words are runs of ASCII letters and digits and non-ASCII
+ * bytes, ASCII is lowercased.
+ *
+ * The file layout (numbers in native byte order):
+ *
+ *   struct search_file_header
+ *   uint32_t doc_offs[ndocs + 1]     -- offsets of the paths in docs
+ *   docs                             -- paths relative to the maildir
+ *   struct search_dict_entry[nterms] -- sorted by term, 8-byte aligned
+ *   terms                            -- the terms, not NUL-terminated
+ *   postings                         -- per term, the ascending document
+ *                                       numbers, as varint deltas
+ *
+ * Queries mmap the file, binary search the dictionary and decode only the
+ * postings of the terms asked for.
+ *
+ * #maildirpp_search_update reads the old index, walks the dirty folders
+ * and looks the messages up by folder and the unique part of the name.
+ * Only the messages not found are read and indexed. Renamed ones get their
+ * new path, those gone from the walked folders are dropped. The file is
+ * then written anew, with the documents renumbered. So an update is a full
+ * rewrite: besides the messages read, it costs O(size of the index), all
+ * the postings are decoded and encoded again, not O(changes).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "search.h"
+#include "util.h"
+
+#define SEARCH_MAGIC "MDSRCH1\n"
+
+struct search_file_header {
+    char magic[8];
+    uint32_t ndocs, nterms;
+    uint64_t doc_offs_off, docs_off, dict_off, terms_off, postings_off,
+	     size;
+};
+
+struct search_dict_entry {
+    uint32_t term_off, term_len;
+    uint32_t df; ///< Number of documents.
+    uint32_t post_len;
+    uint64_t post_off;
+};
+
+/** A document of the index being updated. */
+struct search_doc {
+    char *path; ///< Relative to the maildir, NULL if gone.
+    size_t folder_len; ///< Length of the folder part of #path.
+    int seen; ///< Found by the walk.
+};
+
+/** State of #maildirpp_search_update. */
+struct search_update {
+    struct maildirpp *md;
+    GPtrArray *docs; ///< List of struct search_doc, by document number.
+    GHashTable *by_key; ///< Map of folder/unique name to struct search_doc.
+    GHashTable *postings; ///< Map of term to GArray of uint32_t.
+    GHashTable *walked; ///< Set of walked folders.
+    GHashTable *doc_terms; ///< Set of terms of the document being indexed.
+    char *buf; ///< For reading messages.
+    unsigned long added, removed;
+};
+
+static int search_load(struct search_update *u, const char *index_path);
+static int search_write(struct search_update *u, const char *index_path);
+static void search_doc_free(struct search_doc *doc);
+static char *search_doc_key(const char *folder, size_t folder_len,
+	const char *name);
+static const char *search_folder_name(struct maildir_folder *mdf);
+static void search_folder_pre(struct maildir_folder *mdf);
+static void search_batch(const struct maildir_folder_walk_batch *batch);
+static void search_expire(struct search_update *u);
+static int search_index_message(struct search_update *u, const char *path,
+	uint32_t docid);
+static size_t search_headers(const char *p, size_t len, GString *from,
+	GString *to, GString *subject, GString *ctype, GString *cte);
+static void search_part(struct search_update *u, const char *p, size_t len,
+	const char *ctype, const char *cte, int depth);
+static void search_text(struct search_update *u, const char *prefix,
+	const char *p, size_t len);
+static void search_term_add(struct search_update *u, const char *term);
+static size_t decode_base64(const char *p, size_t len, char *out);
+static size_t decode_qp(const char *p, size_t len, char *out, int header);
+static void decode_header(const char *s, GString *out);
+static int tokenize(const char *p, size_t len, size_t *pos, char *word);
+static GArray *search_term(struct maildir_search *s, const char *term);
+static GArray *search_postings(struct maildir_search *s,
+	const struct search_dict_entry *e);
+static const char *search_doc_path(struct search_update *u, uint32_t docid);
+static struct search_doc *search_doc_add(struct search_update *u,
+	char *path, size_t folder_len);
+static char *search_boundary(const char *ctype);
+static int search_compare_terms(const char **a, const char **b);
+static void write_varint(GByteArray *out, uint32_t n);
+
+
+/** Map a document number to a path, or NULL. */
+static const char *search_doc_path(struct search_update *u, uint32_t docid)
+{
+    return ((struct search_doc *) g_ptr_array_index(u->docs, docid))->path;
+}
+
+/** Update (or create) the search index of the dirty folders. This walks
+ * them, so it should be called when other walks are done (or it gets to
+ * see no dirty folders). The whole file is rewritten, see above.
+ * \return 0 - ok, -1 - error.
+ */
+int maildirpp_search_update(struct maildirpp *md, const char *index_path)
+{
+    struct search_update u = { .md = md };
+    int ret = -1;
+
+    u.docs = g_ptr_array_new();
+    u.by_key = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    u.postings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    (GDestroyNotify) g_array_unref);
+    u.walked = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    u.doc_terms = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    NULL);
+    u.buf = g_malloc(SEARCH_MAX_MSG_SIZE);
+
+    if (search_load(&u, index_path))
+	goto out;
+
+    GArray *pre = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+    GArray *post = g_array_new(0, 0, sizeof(maildir_folder_walk_func));
+    GArray *batch = g_array_new(0, 0, sizeof(maildir_folder_walk_batch_func));
+    maildir_folder_walk_func ff = search_folder_pre;
+    maildir_folder_walk_batch_func bf = search_batch;
+    g_array_append_val(pre, ff);
+    g_array_append_val(batch, bf);
+
+    md->walk_data = &u;
+    maildirpp_folders_walk_batches(md, pre, post, NULL, batch,
+	    SD_NEW | SD_CUR);
+    md->walk_data = NULL;
+
+    g_array_free(batch, 1);
+    g_array_free(post, 1);
+    g_array_free(pre, 1);
+
+    search_expire(&u);
+    ret = search_write(&u, index_path);
+
+out:
+    g_free(u.buf);
+    g_hash_table_destroy(u.doc_terms);
+    g_hash_table_destroy(u.walked);
+    g_hash_table_destroy(u.postings);
+    g_hash_table_destroy(u.by_key);
+    g_ptr_array_foreach(u.docs, (GFunc) search_doc_free, 0);
+    g_ptr_array_free(u.docs, 1);
+
+    return ret;
+}
+
+static void search_doc_free(struct search_doc *doc)
+{
+    g_free(doc->path);
+    g_slice_free(struct search_doc, doc);
+}
+
+/** Key of a document: the folder and the unique part of the name. */
+static char *search_doc_key(const char *folder, size_t folder_len,
+	const char *name)
+{
+    const char *colon = strchr(name, ':');
+    size_t name_len = colon ? colon - name : strlen(name);
+    char *key = g_malloc(folder_len + name_len + 2);
+
+    memcpy(key, folder, folder_len);
+    key[folder_len] = '/';
+    memcpy(key + folder_len + 1, name, name_len);
+    key[folder_len + name_len + 1] = 0;
+
+    return key;
+}
+
+/** Add a document. Takes over \a path. */
+static struct search_doc *search_doc_add(struct search_update *u,
+	char *path, size_t folder_len)
+{
+    struct search_doc *doc = g_slice_new0(struct search_doc);
+    doc->path = path;
+    doc->folder_len = folder_len;
+    g_ptr_array_add(u->docs, doc);
+
+    const char *name = strrchr(path, '/') + 1;
+    g_hash_table_insert(u->by_key, search_doc_key(path, folder_len, name),
+	    doc);
+
+    return doc;
+}
+
+/** Load the documents and postings of an existing index.
+ * \return 0 - ok (or no index yet), -1 - error.
+ */
+static int search_load(struct search_update *u, const char *index_path)
+{
+    if (access(index_path, F_OK) && errno == ENOENT)
+	return 0;
+
+    struct maildir_search *s = maildir_search_open(index_path);
+    if (!s)
+	return -1;
+
+    for (uint32_t i = 0; i < s->ndocs; i++) {
+	const char *p = s->docs + s->doc_offs[i];
+	size_t len = s->doc_offs[i + 1] - s->doc_offs[i];
+	char *path = g_strndup(p, len);
+
+	/* path is folder/new/name or folder/cur/name */
+	char *slash = strrchr(path, '/');
+	size_t folder_len = slash && slash - path >= 4 ?
+	    slash - path - 4 : 0;
+	search_doc_add(u, path, folder_len);
+    }
+
+    for (uint32_t i = 0; i < s->nterms; i++) {
+	const struct search_dict_entry *e = &s->dict[i];
+	char *term = g_strndup(s->terms + e->term_off, e->term_len);
+	g_hash_table_insert(u->postings, term, search_postings(s, e));
+    }
+
+    maildir_search_close(s);
+
+    return 0;
+}
+
+/** Name of a folder relative to the maildir. */
+static const char *search_folder_name(struct maildir_folder *mdf)
+{
+    return mdf->path + strlen(mdf->md->path) + 1;
+}
+
+/** Note the walked folders, to know where to look for gone messages. */
+static void search_folder_pre(struct maildir_folder *mdf)
+{
+    struct search_update *u = mdf->md->walk_data;
+
+    g_hash_table_insert(u->walked, g_strdup(search_folder_name(mdf)), u);
+}
+
+/** Look the messages up in the index, index the new ones. */
+static void search_batch(const struct maildir_folder_walk_batch *batch)
+{
+    struct search_update *u = batch->mdf->md->walk_data;
+    const char *folder = search_folder_name(batch->mdf);
+    size_t folder_len = strlen(folder);
+    const char *subdir = batch->subdir == SD_NEW ? "/new/" : "/cur/";
+
+    for (int i = 0; i < batch->len; i++) {
+	char *key = search_doc_key(folder, folder_len, batch->names[i]);
+	struct search_doc *doc = g_hash_table_lookup(u->by_key, key);
+	g_free(key);
+
+	char *path = g_strconcat(folder, subdir, batch->names[i], NULL);
+	if (doc) {
+	    /* Known, possibly renamed. */
+	    doc->seen = 1;
+	    if (strcmp(doc->path, path)) {
+		g_free(doc->path);
+		doc->path = path;
+	    } else
+		g_free(path);
+	    continue;
+	}
+
+	/* New one. */
+	char full[PATH_MAX];
+	snprintf(full, sizeof(full), "%s%s", batch->subdir_path,
+		batch->names[i]);
+	if (search_index_message(u, full, u->docs->len)) {
+	    g_free(path);
+	    continue;
+	}
+	search_doc_add(u, path, folder_len)->seen = 1;
+	u->added++;
+    }
+}
+
+/** Drop the documents gone from the walked folders and those of folders
+ * that are no more. */
+static void search_expire(struct search_update *u)
+{
+    GHashTable *folders = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int i = 0; i < u->md->subfolders->len; i++)
+	g_hash_table_insert(folders, (void *) search_folder_name(
+		    g_ptr_array_index(u->md->subfolders, i)), u);
+
+    for (int i = 0; i < u->docs->len; i++) {
+	struct search_doc *doc = g_ptr_array_index(u->docs, i);
+	if (doc->seen || !doc->path)
+	    continue;
+
+	char *folder = g_strndup(doc->path, doc->folder_len);
+	if (g_hash_table_lookup(u->walked, folder) ||
+		!g_hash_table_lookup(folders, folder)) {
+	    g_free(doc->path);
+	    doc->path = NULL;
+	    u->removed++;
+	}
+	g_free(folder);
+    }
+
+    g_hash_table_destroy(folders);
+}
+
+/** Read and index a message.
+ * \return 0 - ok, -1 - the message is gone.
+ */
+static int search_index_message(struct search_update *u, const char *path,
+	uint32_t docid)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return -1;
+
+    size_t len = 0;
+    while (len < SEARCH_MAX_MSG_SIZE) {
+	ssize_t r = read(fd, u->buf + len, SEARCH_MAX_MSG_SIZE - len);
+	if (r <= 0)
+	    break;
+	len += r;
+    }
+    close(fd);
+
+    GString *from = g_string_new(""), *to = g_string_new(""),
+	    *subject = g_string_new(""), *ctype = g_string_new(""),
+	    *cte = g_string_new("");
+    size_t body = search_headers(u->buf, len, from, to, subject, ctype, cte);
+
+    GString *decoded = g_string_new("");
+    static const char *const prefixes[] = { "from:", "to:", "subject:" };
+    GString *fields[] = { from, to, subject };
+    for (int i = 0; i < 3; i++) {
+	g_string_truncate(decoded, 0);
+	decode_header(fields[i]->str, decoded);
+	search_text(u, "", decoded->str, decoded->len);
+	search_text(u, prefixes[i], decoded->str, decoded->len);
+    }
+    g_string_free(decoded, 1);
+
+    search_part(u, u->buf + body, len - body, ctype->str, cte->str, 0);
+
+    /* Add the document to the postings of its terms. */
+    GHashTableIter iter;
+    char *term;
+    g_hash_table_iter_init(&iter, u->doc_terms);
+    while (g_hash_table_iter_next(&iter, (void **) &term, NULL)) {
+	GArray *post = g_hash_table_lookup(u->postings, term);
+	if (!post) {
+	    post = g_array_new(0, 0, sizeof(uint32_t));
+	    g_hash_table_insert(u->postings, g_strdup(term), post);
+	}
+	g_array_append_val(post, docid);
+    }
+    g_hash_table_remove_all(u->doc_terms);
+
+    g_string_free(cte, 1);
+    g_string_free(ctype, 1);
+    g_string_free(subject, 1);
+    g_string_free(to, 1);
+    g_string_free(from, 1);
+
+    return 0;
+}
+
+/** Parse a header block, collecting the (unfolded) values of the fields
+ * of interest.
+ * \return Offset of the body.
+ */
+static size_t search_headers(const char *p, size_t len, GString *from,
+	GString *to, GString *subject, GString *ctype, GString *cte)
+{
+    static const struct {
+	const char *name;
+	size_t len;
+    } names[] = {
+	{ "from", 4 }, { "to", 2 }, { "subject", 7 }, { "content-type", 12 },
+	{ "content-transfer-encoding", 25 }
+    };
+    GString *values[] = { from, to, subject, ctype, cte };
+    GString *cur = NULL;
+    size_t pos = 0;
+
+    while (pos < len) {
+	const char *line = p + pos;
+	const char *nl = memchr(line, '\n', len - pos);
+	size_t line_len = nl ? (size_t) (nl - line) : len - pos;
+	pos += line_len + (nl ? 1 : 0);
+	if (line_len && line[line_len - 1] == '\r')
+	    line_len--;
+
+	if (line_len == 0)
+	    break; /* End of the header. */
+
+	if (line[0] == ' ' || line[0] == '\t') {
+	    if (cur)
+		g_string_append_len(cur, line, line_len);
+	    continue;
+	}
+
+	cur = NULL;
+	const char *colon = memchr(line, ':', line_len);
+	if (!colon)
+	    continue;
+	for (int i = 0; i < 5; i++)
+	    if (colon - line == names[i].len &&
+		    !g_ascii_strncasecmp(line, names[i].name, names[i].len)) {
+		cur = values[i];
+		if (!cur)
+		    break;
+		if (cur->len)
+		    g_string_append_c(cur, ' ');
+		g_string_append_len(cur, colon + 1,
+			line + line_len - colon - 1);
+		break;
+	    }
+    }
+
+    return pos;
+}
+
+/** Get the boundary parameter of a multipart Content-Type. */
+static char *search_boundary(const char *ctype)
+{
+    const char *p = ctype;
+
+    while ((p = strchr(p, '=')) != NULL) {
+	if (p - ctype >= 8 && !g_ascii_strncasecmp(p - 8, "boundary", 8))
+	    break;
+	p++;
+    }
+    if (!p)
+	return NULL;
+
+    p++;
+    if (*p == '"') {
+	const char *e = strchr(++p, '"');
+	return e ? g_strndup(p, e - p) : NULL;
+    }
+
+    size_t n = strcspn(p, "; \t\r\n");
+    return n ? g_strndup(p, n) : NULL;
+}
+
+/** Index a MIME part: the text ones, and the parts of the multipart
+ * ones. */
+static void search_part(struct search_update *u, const char *p, size_t len,
+	const char *ctype, const char *cte, int depth)
+{
+    while (*ctype == ' ' || *ctype == '\t')
+	ctype++;
+    while (*cte == ' ' || *cte == '\t')
+	cte++;
+
+    if (!g_ascii_strncasecmp(ctype, "multipart/", 10)) {
+	char *boundary = search_boundary(ctype);
+	if (!boundary || depth >= 4) {
+	    g_free(boundary);
+	    return;
+	}
+
+	/* Split the body at lines starting with --boundary. */
+	char *delim = g_strconcat("--", boundary, NULL);
+	size_t delim_len = strlen(delim);
+	const char *end = p + len, *part = NULL, *d = p;
+
+	while ((d = memmem(d, end - d, delim, delim_len)) != NULL) {
+	    if (d != p && d[-1] != '\n') {
+		d += delim_len;
+		continue;
+	    }
+
+	    if (part) {
+		const char *part_end = d;
+		if (part_end > part && part_end[-1] == '\n')
+		    part_end--;
+		if (part_end > part && part_end[-1] == '\r')
+		    part_end--;
+
+		GString *pctype = g_string_new(""), *pcte = g_string_new("");
+		size_t body = search_headers(part, part_end - part, NULL, NULL,
+			NULL, pctype, pcte);
+		search_part(u, part + body, part_end - part - body,
+			pctype->str, pcte->str, depth + 1);
+		g_string_free(pcte, 1);
+		g_string_free(pctype, 1);
+	    }
+
+	    d += delim_len;
+	    if (end - d >= 2 && d[0] == '-' && d[1] == '-')
+		break; /* The closing delimiter. */
+	    const char *nl = memchr(d, '\n', end - d);
+	    if (!nl)
+		break;
+	    part = nl + 1;
+	}
+
+	g_free(delim);
+	g_free(boundary);
+	return;
+    }
+
+    if (*ctype && g_ascii_strncasecmp(ctype, "text/", 5))
+	return; /* Not text. */
+
+    char *text = NULL;
+    if (!g_ascii_strncasecmp(cte, "base64", 6)) {
+	text = g_malloc(len);
+	len = decode_base64(p, len, text);
+	p = text;
+    } else if (!g_ascii_strncasecmp(cte, "quoted-printable", 16)) {
+	text = g_malloc(len);
+	len = decode_qp(p, len, text, 0);
+	p = text;
+    }
+
+    if (!g_ascii_strncasecmp(ctype, "text/html", 9)) {
+	/* Leave out the tags. */
+	char *stripped = g_malloc(len + 1);
+	size_t n = 0;
+	int in_tag = 0;
+	for (size_t i = 0; i < len; i++) {
+	    if (p[i] == '<')
+		in_tag = 1;
+	    else if (p[i] == '>') {
+		in_tag = 0;
+		stripped[n++] = ' ';
+	    } else if (!in_tag)
+		stripped[n++] = p[i];
+	}
+	search_text(u, "", stripped, n);
+	g_free(stripped);
+    } else
+	search_text(u, "", p, len);
+
+    g_free(text);
+}
+
+/** Add the words of a text to the terms of the document. */
+static void search_text(struct search_update *u, const char *prefix,
+	const char *p, size_t len)
+{
+    char term[SEARCH_MAX_TERM + 16];
+    size_t prefix_len = strlen(prefix);
+    size_t pos = 0;
+
+    memcpy(term, prefix, prefix_len);
+    while (tokenize(p, len, &pos, term + prefix_len))
+	search_term_add(u, term);
+}
+
+static void search_term_add(struct search_update *u, const char *term)
+{
+    if (!g_hash_table_lookup_extended(u->doc_terms, term, NULL, NULL))
+	g_hash_table_insert(u->doc_terms, g_strdup(term), NULL);
+}
+
+/** Get the next indexable word from \a p, starting at \a *pos.
+ * \param word At least SEARCH_MAX_TERM + 1 bytes.
+ * \return 1 - got a word, 0 - no more words.
+ */
+static int tokenize(const char *p, size_t len, size_t *pos, char *word)
+{
+    size_t i = *pos;
+
+    while (i < len) {
+	/* Skip to a word. */
+	while (i < len && !g_ascii_isalnum(p[i]) && !(p[i] & 0x80))
+	    i++;
+
+	size_t start = i, n = 0;
+	while (i < len && (g_ascii_isalnum(p[i]) || (p[i] & 0x80))) {
+	    if (n < SEARCH_MAX_TERM)
+		word[n] = g_ascii_tolower(p[i]);
+	    n++;
+	    i++;
+	}
+
+	if (i > start && n >= SEARCH_MIN_TERM && n <= SEARCH_MAX_TERM) {
+	    word[n] = 0;
+	    *pos = i;
+	    return 1;
+	}
+    }
+
+    *pos = i;
+    return 0;
+}
+
+static size_t decode_base64(const char *p, size_t len, char *out)
+{
+    unsigned int acc = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len && p[i] != '='; i++) {
+	const char *c = strchr("ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz0123456789+/", p[i]);
+	if (!c || !p[i])
+	    continue;
+	acc = (acc << 6) | (c - "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz0123456789+/");
+	bits += 6;
+	if (bits >= 8) {
+	    bits -= 8;
+	    out[n++] = (acc >> bits) & 0xff;
+	}
+    }
+
+    return n;
+}
+
+/** Decode quoted-printable, or the Q encoding of headers. */
+static size_t decode_qp(const char *p, size_t len, char *out, int header)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+	if (p[i] == '=' && i + 1 < len) {
+	    if (p[i + 1] == '\n') {
+		i++; continue; /* Soft line break. */
+	    }
+	    if (p[i + 1] == '\r' && i + 2 < len && p[i + 2] == '\n') {
+		i += 2; continue;
+	    }
+	    if (i + 2 < len && g_ascii_isxdigit(p[i + 1]) &&
+		    g_ascii_isxdigit(p[i + 2])) {
+		out[n++] = g_ascii_xdigit_value(p[i + 1]) << 4 |
+		    g_ascii_xdigit_value(p[i + 2]);
+		i += 2; continue;
+	    }
+	}
+	out[n++] = header && p[i] == '_' ? ' ' : p[i];
+    }
+
+    return n;
+}
+
+/** Decode the RFC 2047 encoded words of a header value. The charset is
+ * ignored, words are indexed as bytes. */
+static void decode_header(const char *s, GString *out)
+{
+    const char *p = s;
+
+    while (*p) {
+	const char *start = strstr(p, "=?");
+	if (!start)
+	    break;
+
+	/* =?charset?X?text?= */
+	const char *q1 = strchr(start + 2, '?');
+	const char *q2 = q1 ? strchr(q1 + 1, '?') : NULL;
+	const char *end = q2 ? strstr(q2 + 1, "?=") : NULL;
+	if (!end || q2 != q1 + 2) {
+	    g_string_append_len(out, p, start + 2 - p);
+	    p = start + 2;
+	    continue;
+	}
+
+	g_string_append_len(out, p, start - p);
+	size_t len = end - q2 - 1;
+	char *buf = g_malloc(len + 1);
+	if (q1[1] == 'B' || q1[1] == 'b')
+	    len = decode_base64(q2 + 1, len, buf);
+	else
+	    len = decode_qp(q2 + 1, len, buf, 1);
+	g_string_append_len(out, buf, len);
+	g_free(buf);
+	p = end + 2;
+    }
+
+    g_string_append(out, p);
+}
+
+static int search_compare_terms(const char **a, const char **b)
+{
+    return strcmp(*a, *b);
+}
+
+static void write_varint(GByteArray *out, uint32_t n)
+{
+    guint8 c;
+
+    do {
+	c = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	g_byte_array_append(out, &c, 1);
+	n >>= 7;
+    } while (n);
+}
+
+/** Write the index, with the gone documents left out.
+ * \return 0 - ok, -1 - error.
+ */
+static int search_write(struct search_update *u, const char *index_path)
+{
+    /* Renumber the documents. */
+    uint32_t *newid = g_new(uint32_t, u->docs->len + 1);
+    GArray *doc_offs = g_array_new(0, 0, sizeof(uint32_t));
+    GString *docs = g_string_new("");
+    uint32_t ndocs = 0;
+
+    for (uint32_t i = 0; i < u->docs->len; i++) {
+	const char *path = search_doc_path(u, i);
+	if (!path) {
+	    newid[i] = UINT32_MAX;
+	    continue;
+	}
+	newid[i] = ndocs++;
+	uint32_t off = docs->len;
+	g_array_append_val(doc_offs, off);
+	g_string_append(docs, path);
+    }
+    uint32_t off = docs->len;
+    g_array_append_val(doc_offs, off);
+    while (docs->len % 8)
+	g_string_append_c(docs, 0);
+
+    /* Sort the terms and encode the postings. */
+    GPtrArray *terms = g_ptr_array_new();
+    GHashTableIter iter;
+    void *term;
+    g_hash_table_iter_init(&iter, u->postings);
+    while (g_hash_table_iter_next(&iter, &term, NULL))
+	g_ptr_array_add(terms, term);
+    g_ptr_array_sort(terms, (GCompareFunc) search_compare_terms);
+
+    GArray *dict = g_array_new(0, 0, sizeof(struct search_dict_entry));
+    GString *term_blob = g_string_new("");
+    GByteArray *postings = g_byte_array_new();
+
+    for (int i = 0; i < terms->len; i++) {
+	const char *t = g_ptr_array_index(terms, i);
+	GArray *post = g_hash_table_lookup(u->postings, t);
+	struct search_dict_entry e = { .term_off = term_blob->len,
+	    .term_len = strlen(t), .post_off = postings->len };
+	uint32_t last = 0;
+
+	for (int j = 0; j < post->len; j++) {
+	    uint32_t id = newid[g_array_index(post, uint32_t, j)];
+	    if (id == UINT32_MAX)
+		continue;
+	    write_varint(postings, e.df ? id - last : id);
+	    last = id;
+	    e.df++;
+	}
+	if (!e.df)
+	    continue;
+
+	e.post_len = postings->len - e.post_off;
+	g_string_append_len(term_blob, t, e.term_len);
+	g_array_append_val(dict, e);
+    }
+
+    struct search_file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SEARCH_MAGIC, 8);
+    h.ndocs = ndocs;
+    h.nterms = dict->len;
+    h.doc_offs_off = sizeof(h);
+    h.docs_off = h.doc_offs_off + doc_offs->len * sizeof(uint32_t);
+    h.dict_off = h.docs_off + docs->len;
+    h.dict_off += (8 - h.dict_off % 8) % 8;
+    h.terms_off = h.dict_off + dict->len * sizeof(struct search_dict_entry);
+    h.postings_off = h.terms_off + term_blob->len;
+    h.size = h.postings_off + postings->len;
+
+    /* Write a new file and rename it over the old one. */
+    int ret = -1;
+    char *tmp = g_strconcat(index_path, ".tmp", NULL);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+	perror(tmp); goto out;
+    }
+
+    static const char pad[8];
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(doc_offs->data, sizeof(uint32_t), doc_offs->len, f);
+    fwrite(docs->str, 1, docs->len, f);
+    fwrite(pad, 1, h.dict_off - h.docs_off - docs->len, f);
+    fwrite(dict->data, sizeof(struct search_dict_entry), dict->len, f);
+    fwrite(term_blob->str, 1, term_blob->len, f);
+    fwrite(postings->data, 1, postings->len, f);
+
+    if (ferror(f) | fclose(f)) {
+	perror(tmp); unlink(tmp); goto out;
+    }
+    if (rename(tmp, index_path)) {
+	perror(index_path); unlink(tmp); goto out;
+    }
+    ret = 0;
+
+out:
+    g_free(tmp);
+    g_byte_array_free(postings, 1);
+    g_string_free(term_blob, 1);
+    g_array_free(dict, 1);
+    g_ptr_array_free(terms, 1);
+    g_string_free(docs, 1);
+    g_array_free(doc_offs, 1);
+    g_free(newid);
+
+    return ret;
+}
+
+/** Open an index for queries.
+ * \return NULL on error.
+ */
+struct maildir_search *maildir_search_open(const char *index_path)
+{
+    struct maildir_search *s = g_new0(struct maildir_search, 1);
+    struct stat st;
+
+    s->fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (s->fd == -1) {
+	perror(index_path); goto err1;
+    }
+    if (fstat(s->fd, &st)) {
+	perror(index_path); goto err2;
+    }
+    s->size = st.st_size;
+    if (s->size < sizeof(struct search_file_header))
+	goto bad;
+
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+	perror(index_path); goto err2;
+    }
+
+    const struct search_file_header *h =
+	(const struct search_file_header *) s->map;
+    if (memcmp(h->magic, SEARCH_MAGIC, 8) || h->size != s->size ||
+	    h->doc_offs_off > h->docs_off || h->docs_off > h->dict_off ||
+	    h->dict_off > h->terms_off || h->terms_off > h->postings_off ||
+	    h->postings_off > h->size || h->dict_off % 8 ||
+	    h->doc_offs_off % sizeof(uint32_t) ||
+	    (h->docs_off - h->doc_offs_off) / sizeof(uint32_t) !=
+	    (uint64_t) h->ndocs + 1 ||
+	    (h->terms_off - h->dict_off) / sizeof(struct search_dict_entry) !=
+	    h->nterms)
+	goto bad_map;
+
+    s->ndocs = h->ndocs;
+    s->nterms = h->nterms;
+    s->doc_offs = (const uint32_t *) (s->map + h->doc_offs_off);
+    s->docs = s->map + h->docs_off;
+    s->dict = (const struct search_dict_entry *) (s->map + h->dict_off);
+    s->terms = s->map + h->terms_off;
+    s->postings = (const unsigned char *) s->map + h->postings_off;
+
+    /* Nothing may point out of its area: the queries don't check. */
+    uint64_t docs_len = h->dict_off - h->docs_off,
+	     terms_len = h->postings_off - h->terms_off,
+	     postings_len = h->size - h->postings_off;
+    for (uint32_t i = 0; i < s->ndocs; i++)
+	if (s->doc_offs[i] > s->doc_offs[i + 1])
+	    goto bad_map;
+    if (s->doc_offs[s->ndocs] > docs_len)
+	goto bad_map;
+    for (uint32_t i = 0; i < s->nterms; i++) {
+	const struct search_dict_entry *e = &s->dict[i];
+	if (e->term_off > terms_len || e->term_len > terms_len - e->term_off ||
+		e->post_off > postings_len ||
+		e->post_len > postings_len - e->post_off)
+	    goto bad_map;
+    }
+
+    return s;
+
+bad_map:
+    munmap((void *) s->map, s->size);
+bad:
+    fprintf(stderr, "%s: not a search index\n", index_path);
+err2:
+    close(s->fd);
+err1:
+    g_free(s);
+    return NULL;
+}
+
+void maildir_search_close(struct maildir_search *s)
+{
+    munmap((void *) s->map, s->size);
+    close(s->fd);
+    g_free(s);
+}
+
+/** Get the postings of a term.
+ * \return Sorted list of document numbers (uint32_t).
+ */
+static GArray *search_term(struct maildir_search *s, const char *term)
+{
+    size_t len = strlen(term);
+    uint32_t lo = 0, hi = s->nterms;
+
+    while (lo < hi) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	const struct search_dict_entry *e = &s->dict[mid];
+	int c = memcmp(s->terms + e->term_off, term,
+		MIN(e->term_len, len));
+	if (!c)
+	    c = e->term_len < len ? -1 : e->term_len > len;
+
+	if (c < 0)
+	    lo = mid + 1;
+	else if (c > 0)
+	    hi = mid;
+	else
+	    return search_postings(s, e);
+    }
+
+    return g_array_new(0, 0, sizeof(uint32_t));
+}
+
+/** Decode the postings of a dictionary entry.
+ * \return Sorted list of document numbers (uint32_t).
+ */
+static GArray *search_postings(struct maildir_search *s,
+	const struct search_dict_entry *e)
+{
+    /* A posting takes a byte at least. */
+    GArray *res = g_array_sized_new(0, 0, sizeof(uint32_t),
+	    MIN(e->df, e->post_len));
+    const unsigned char *p = s->postings + e->post_off,
+	  *end = p + e->post_len;
+    uint32_t id = 0;
+
+    for (uint32_t i = 0; i < e->df && p < end; i++) {
+	uint32_t delta = 0;
+	int shift = 0;
+	while (p < end) {
+	    if (shift < 32)
+		delta |= (uint32_t) (*p & 0x7f) << shift;
+	    shift += 7;
+	    if (!(*p++ & 0x80))
+		break;
+	}
+	id = i ? id + delta : delta;
+	if (id < s->ndocs)
+	    g_array_append_val(res, id);
+    }
+
+    return res;
+}
+
+/* Query evaluation. Results are sorted lists of document numbers. */
+
+struct query {
+    struct maildir_search *s;
+    const char *p;
+    int error;
+};
+
+static GArray *query_or(struct query *q);
+
+static GArray *query_all(struct query *q)
+{
+    GArray *res = g_array_sized_new(0, 0, sizeof(uint32_t), q->s->ndocs);
+    for (uint32_t i = 0; i < q->s->ndocs; i++)
+	g_array_append_val(res, i);
+    return res;
+}
+
+static GArray *query_and2(GArray *a, GArray *b)
+{
+    GArray *res = g_array_new(0, 0, sizeof(uint32_t));
+    for (int i = 0, j = 0; i < a->len && j < b->len; ) {
+	uint32_t x = g_array_index(a, uint32_t, i),
+		 y = g_array_index(b, uint32_t, j);
+	if (x < y)
+	    i++;
+	else if (x > y)
+	    j++;
+	else {
+	    g_array_append_val(res, x);
+	    i++; j++;
+	}
+    }
+    g_array_free(a, 1);
+    g_array_free(b, 1);
+    return res;
+}
+
+static GArray *query_or2(GArray *a, GArray *b)
+{
+    GArray *res = g_array_new(0, 0, sizeof(uint32_t));
+    int i = 0, j = 0;
+    while (i < a->len || j < b->len) {
+	uint32_t x = i < a->len ? g_array_index(a, uint32_t, i) : UINT32_MAX,
+		 y = j < b->len ? g_array_index(b, uint32_t, j) : UINT32_MAX;
+	uint32_t v = MIN(x, y);
+	g_array_append_val(res, v);
+	if (x == v)
+	    i++;
+	if (y == v)
+	    j++;
+    }
+    g_array_free(a, 1);
+    g_array_free(b, 1);
+    return res;
+}
+
+static GArray *query_not(struct query *q, GArray *a)
+{
+    GArray *res = g_array_new(0, 0, sizeof(uint32_t));
+    int j = 0;
+    for (uint32_t i = 0; i < q->s->ndocs; i++) {
+	while (j < a->len && g_array_index(a, uint32_t, j) < i)
+	    j++;
+	if (j == a->len || g_array_index(a, uint32_t, j) != i)
+	    g_array_append_val(res, i);
+    }
+    g_array_free(a, 1);
+    return res;
+}
+
+static void query_skip(struct query *q)
+{
+    while (*q->p == ' ' || *q->p == '\t')
+	q->p++;
+}
+
+/** Is the next word \a w (an operator)? Skip it if so. */
+static int query_op(struct query *q, const char *w)
+{
+    size_t n = strlen(w);
+    query_skip(q);
+    if (strncmp(q->p, w, n) || (q->p[n] && !strchr(" \t()", q->p[n])))
+	return 0;
+    q->p += n;
+    return 1;
+}
+
+/** A word of the query: all of its terms must match. "from:", "to:" and
+ * "subject:" limit it to the header. */
+static GArray *query_word(struct query *q, const char *w, size_t len)
+{
+    static const char *const prefixes[] = { "from:", "to:", "subject:" };
+    const char *prefix = "";
+    char term[SEARCH_MAX_TERM + 16];
+    GArray *res = NULL;
+
+    for (int i = 0; i < 3; i++) {
+	size_t n = strlen(prefixes[i]);
+	if (len > n && !g_ascii_strncasecmp(w, prefixes[i], n)) {
+	    prefix = prefixes[i];
+	    w += n;
+	    len -= n;
+	    break;
+	}
+    }
+
+    size_t prefix_len = strlen(prefix), pos = 0;
+    memcpy(term, prefix, prefix_len);
+    while (tokenize(w, len, &pos, term + prefix_len)) {
+	GArray *t = search_term(q->s, term);
+	res = res ? query_and2(res, t) : t;
+    }
+
+    /* Nothing to look up, the word doesn't restrict anything. */
+    return res ? res : query_all(q);
+}
+
+static GArray *query_unary(struct query *q)
+{
+    if (query_op(q, "NOT"))
+	return query_not(q, query_unary(q));
+
+    query_skip(q);
+    if (*q->p == '-') {
+	q->p++;
+	return query_not(q, query_unary(q));
+    }
+
+    if (*q->p == '(') {
+	q->p++;
+	GArray *res = query_or(q);
+	query_skip(q);
+	if (*q->p == ')')
+	    q->p++;
+	else
+	    q->error = 1;
+	return res;
+    }
+
+    size_t n = strcspn(q->p, " \t()");
+    if (n == 0) {
+	q->error = 1;
+	return g_array_new(0, 0, sizeof(uint32_t));
+    }
+    GArray *res = query_word(q, q->p, n);
+    q->p += n;
+    return res;
+}
+
+static GArray *query_and(struct query *q)
+{
+    GArray *res = query_unary(q);
+
+    while (!q->error) {
+	query_skip(q);
+	if (!*q->p || *q->p == ')')
+	    break;
+	if (query_op(q, "OR")) {
+	    q->p -= 2; /* Leave it to query_or. */
+	    break;
+	}
+	query_op(q, "AND");
+	res = query_and2(res, query_unary(q));
+    }
+
+    return res;
+}
+
+static GArray *query_or(struct query *q)
+{
+    GArray *res = query_and(q);
+
+    while (!q->error && query_op(q, "OR"))
+	res = query_or2(res, query_and(q));
+
+    return res;
+}
+
+/** Search the index. Words must all match, unless joined by OR. NOT (or
+ * '-') negates, parentheses group, e.g.
+ * <code>from:joe (budget OR invoice) -draft</code>.
+ *
+ * \return List of paths of the matching messages (relative to the
+ *   maildir, as of the last update). Free them with g_free. NULL if the
+ *   query is malformed.
+ */
+GPtrArray *maildir_search_query(struct maildir_search *s, const char *query)
+{
+    struct query q = { .s = s, .p = query };
+    GArray *res = query_or(&q);
+
+    query_skip(&q);
+    if (q.error || *q.p) {
+	g_array_free(res, 1);
+	return NULL;
+    }
+
+    GPtrArray *paths = g_ptr_array_sized_new(res->len);
+    for (int i = 0; i < res->len; i++) {
+	uint32_t id = g_array_index(res, uint32_t, i);
+	g_ptr_array_add(paths, g_strndup(s->docs + s->doc_offs[id],
+		    s->doc_offs[id + 1] - s->doc_offs[id]));
+    }
+    g_array_free(res, 1);
+
+    return paths;
+}
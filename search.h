@@ -0,0 +1,36 @@
+/* This file is a part of the maildirtools package. See the COPYRIGHT file for
+ * details. */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include "maildir.h"
+
+/** Max. number of bytes of a message that get indexed. */
+#define SEARCH_MAX_MSG_SIZE (1 << 20)
+
+/** Words shorter or longer than these are not indexed. */
+#define SEARCH_MIN_TERM 2
+#define SEARCH_MAX_TERM 64
+
+/** An index opened for queries, see #maildir_search_open. */
+struct maildir_search {
+    int fd;
+    const char *map; ///< The whole index file, mmap-ed.
+    size_t size;
+    uint32_t ndocs, nterms;
+    const uint32_t *doc_offs; ///< ndocs + 1 offsets into #docs.
+    const char *docs; ///< Paths of the messages, relative to the maildir.
+    const struct search_dict_entry *dict; ///< Sorted by term.
+    const char *terms;
+    const unsigned char *postings;
+};
+
+int maildirpp_search_update(struct maildirpp *md, const char *index_path);
+struct maildir_search *maildir_search_open(const char *index_path);
+void maildir_search_close(struct maildir_search *s);
+GPtrArray *maildir_search_query(struct maildir_search *s, const char *query);
+
+#endif /* SEARCH_H */